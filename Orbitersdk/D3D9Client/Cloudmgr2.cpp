@@ -53,12 +53,40 @@ void CloudTile::PreLoad()
 	}
 	if (!ok && cmgr->ZTreeManager(0)) { // try loading from compressed archive
 		BYTE *buf;
-		DWORD ndata = cmgr->ZTreeManager(0)->ReadData(lvl+4, ilat, ilng, &buf);
+		DWORD ndata = cmgr->ZTreeManager(0)->ReadData(lvl+4, ilat, ilng, &buf, &timing.zt);
 		if (ndata) {
 			LoadTextureFromMemory(buf, ndata, &pPreSrf, false);
 			cmgr->ZTreeManager(0)->ReleaseData(buf);
 		}
 	}
+
+	timing.Book(TileStats::DECODE);
+
+	// Without a texture of its own the tile maps a subrange of the parent texture
+	if (!pPreSrf) GetParentSubTexRange(&texrange);
+
+	// Build the mesh in system memory here, Load() only uploads it
+	CreateMesh();
+}
+
+// -----------------------------------------------------------------------
+
+void CloudTile::CreateMesh ()
+{
+	bool shift_origin = (lvl >= 4);
+	int res = mgr->GridRes();
+
+	if (!lvl) {
+		// create hemisphere mesh for western or eastern hemispheres
+		mesh = CreateMesh_hemisphere (res, 0, cloudalt);
+	//} else if (ilat == 0 || ilat == (1<<lvl)-1) {
+		// create triangular patch for north/south pole region
+	//	mesh = CreateMesh_tripatch (TILE_PATCHRES, elev, shift_origin, &vtxshift);
+	} else {
+		// create rectangular patch
+		mesh = CreateMesh_quadpatch (res, res, 0, 1.0, cloudalt, &texrange, shift_origin, &vtxshift);
+	}
+	timing.Book(TileStats::MESH);
 }
 
 
@@ -78,19 +106,9 @@ void CloudTile::Load ()
 		} else tex = 0;
 	} else TileCatalog->Add(tex);
 
-	bool shift_origin = (lvl >= 4);
-	int res = mgr->GridRes();
-
-	if (!lvl) {
-		// create hemisphere mesh for western or eastern hemispheres
-		mesh = CreateMesh_hemisphere (res, 0, cloudalt);
-	//} else if (ilat == 0 || ilat == (1<<lvl)-1) {
-		// create triangular patch for north/south pole region
-	//	mesh = CreateMesh_tripatch (TILE_PATCHRES, elev, shift_origin, &vtxshift);
-	} else {
-		// create rectangular patch
-		mesh = CreateMesh_quadpatch (res, res, 0, 1.0, cloudalt, &texrange, shift_origin, &vtxshift);
-	}
+	// Upload the mesh (built by PreLoad, unless the tile was loaded without it)
+	if (!mesh) CreateMesh();
+	if (mesh) mesh->MapVertices(pDev);
 }
 
 // -----------------------------------------------------------------------
@@ -188,17 +206,20 @@ void TileManager2<CloudTile>::Render (MATRIX4 &dwmat, bool use_zbuf, const vPlan
 
 	// TODO: render full sphere for levels < 4
 
-	loader->WaitForMutex();
+	// finish the tiles pre-loaded by the load threads
+	loader->LoadCompleted();
 
-	// update the tree
+	// update the tree, the load queue is locked only while the tree is processed
+	loader->WaitForMutex();
+	SelectTiles (tiletree);
 	for (i = 0; i < 2; i++)
 		ProcessNode (tiletree+i);
+	PrefetchTiles (tiletree);
+	TrimCache ();
+	loader->ReleaseMutex ();
 
 	// render the tree
-	for (i = 0; i < 2; i++)
-		RenderNode (tiletree+i);
-	
-	loader->ReleaseMutex ();
+	RenderTiles<CloudTile> ();
 
 	if (np)
 		scene->SetCameraFrustumLimits(np,fp);
@@ -249,12 +270,3 @@ void TileManager2<CloudTile>::InitHasIndividualFiles()
 		hasIndividualFiles[0] = GetClient()->TexturePath(path, dummy);
 	}
 }
-
-// -----------------------------------------------------------------------
-
-template<>
-Tile * TileManager2<CloudTile>::SearchTile (double lng, double lat, int maxlvl, bool bOwntex) const
-{
-	if (lng<0) return SearchTileSub(&tiletree[0], lng, lat, maxlvl, bOwntex);
-	else	   return SearchTileSub(&tiletree[1], lng, lat, maxlvl, bOwntex);
-}
@@ -15,7 +15,7 @@
  * Rendering of planetary cloud layers using texture tiles at
  * variable resolutions (new version).
  */
-class CloudTile: public Tile {
+class CloudTile: public Tile, public Pooled<CloudTile> {
 	friend class TileManager2Base;
 	template<class CloudTile> friend class TileManager2;
 
@@ -23,12 +23,15 @@ public:
 	CloudTile (TileManager2Base *_mgr, int _lvl, int _ilat, int _ilng);
 	~CloudTile ();
 
+	inline QuadTreeNode<CloudTile> *GetNode() const { return node; }
 	inline void SetNode (QuadTreeNode<CloudTile> *_node) { node = _node; }
 	// Register the tile to a quad tree node
 
 	double GetMinElev() const { return cloudalt; }		// virtual from Tile::
 	double GetMaxElev() const { return cloudalt; }		// virtual from Tile::
 	double GetMeanElev() const { return cloudalt; }		// virtual from Tile::
+	const char *LayerName() const { return "Cloud"; }	// virtual from Tile::
+	void ReleaseSubtree () { if (node) node->DelChildren(); }	// virtual from Tile::
 
 protected:
 	virtual Tile *getParent() const { return node && node->Parent() ? node->Parent()->Entry() : NULL; }
@@ -37,6 +40,7 @@ protected:
 	virtual void Load ();
 	virtual void PreLoad ();
 	virtual void Render ();
+	void CreateMesh ();
 
 	double cloudalt;
 	TileManager2<CloudTile> *cmgr;	// cloud tile manager interface
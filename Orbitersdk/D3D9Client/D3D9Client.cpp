@@ -753,6 +753,7 @@ HWND D3D9Client::clbkCreateRenderWindow()
 
 	TileManager::GlobalInit(this);
 	TileManager2Base::GlobalInit(this);
+	ElevCache::Global().SetBudget((__int64)Config->TileElevCache << 20);
 	PlanetRenderer::GlobalInit(this);
 	RingManager::GlobalInit(this);
 	HazeManager::GlobalInit(this);
@@ -1149,6 +1150,7 @@ void D3D9Client::clbkDestroyRenderWindow (bool fastclose)
 	HazeManager2::GlobalExit();
 	TileManager::GlobalExit();
 	TileManager2Base::GlobalExit();
+	ElevCache::Global().Clear();
 	PlanetRenderer::GlobalExit();
 	D3D9ParticleStream::GlobalExit();
 	CSphereManager::GlobalExit();
@@ -2046,6 +2048,7 @@ LRESULT D3D9Client::RenderWndProc (HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM l
 			bool bShift = (GetAsyncKeyState(VK_SHIFT) & 0x8000)!=0;
 			bool bCtrl  = (GetAsyncKeyState(VK_CONTROL) & 0x8000)!=0;
 			if (wParam == 'C' && bShift && bCtrl) bControlPanel = !bControlPanel;
+			else if (bControlPanel && bShift && bCtrl) ControlPanelMsg(wParam);
 			if (wParam == 'N' && bShift && bCtrl) Config->bCloudNormals = !Config->bCloudNormals;
 			break;
 		}
@@ -92,6 +92,10 @@ struct _D3D9Stats {
 	struct {
 		DWORD Verts;		///< Number of vertices rendered
 		WORD  Tiles[32];	///< Number of tiles rendered (per level)
+		DWORD SubTex;		///< Number of tiles rendered with an ancestor sub-texture
+		DWORD Uploads;		///< Number of loaded tiles uploaded to the device
+		DWORD Ready;		///< Number of loaded tiles waiting for upload
+		float UploadBudget;	///< Tile upload time allowed per frame [ms]
 	} Surf;					///< Surface related statistics (new surface engine)
 
 	struct {
@@ -113,6 +117,9 @@ struct _D3D9Stats {
 	DWORD TilesCached;		///< Number of cached tiles
 	DWORD TilesCachedMB;	///< Total size of tile cache (MBytes)
 	DWORD TilesAllocated;	///< Number of allocated tiles
+	DWORD TilesParked;		///< Number of parked (inactive, cached) tile subtrees
+	DWORD ParkedGPU;		///< Video memory held by parked subtrees (bytes)
+	DWORD ParkedSys;		///< System memory held by parked subtrees (bytes)
 };
 
 
@@ -76,6 +76,17 @@ void D3D9Config::Reset ()
 	ShaderDebug			= 0;
 	PresentLocation		= 1;
 	PlanetTileLoadFlags	= 0x3;
+	TileArchiveMapping	= 1;
+	TileArchiveCache	= 64;
+	TilePrefetchTime	= 1.0;
+	TileLoadThreads		= 0;
+	TileLoadQueueSize	= 0;
+	TileFrameTime		= 0.0;
+	TileCacheGPU		= 256;
+	TileLodThreads		= 2;
+	TileLodIncremental	= 1;
+	TileCacheSys		= 256;
+	TileElevCache		= 128;
 	TerrainShadowing	= 1;
 	LabelDisplayFlags	= LABEL_DISPLAY_RECORD | LABEL_DISPLAY_REPLAY;
 	CloudMicro			= 1;
@@ -164,6 +175,17 @@ bool D3D9Config::ReadParams ()
 	if (oapiReadItem_int   (hFile, "ShaderDebug", i))					ShaderDebug = max(0, min(1, i));
 	if (oapiReadItem_int   (hFile, "PresentLocation", i))				PresentLocation = max(0, min(1, i));
 	if (oapiReadItem_int   (hFile, "PlanetTileLoadFlags", i))			PlanetTileLoadFlags = max(1, min(3, i));
+	if (oapiReadItem_int   (hFile, "TileArchiveMapping", i))			TileArchiveMapping = max(0, min(1, i));
+	if (oapiReadItem_int   (hFile, "TileArchiveCache", i))			TileArchiveCache = max(0, min(1024, i));
+	if (oapiReadItem_float (hFile, "TilePrefetchTime", d))			TilePrefetchTime = max(0.0, min(10.0, d));
+	if (oapiReadItem_int   (hFile, "TileLoadThreads", i))			TileLoadThreads = max(0, min(16, i));
+	if (oapiReadItem_int   (hFile, "TileLoadQueueSize", i))			TileLoadQueueSize = max(0, min(65536, i));
+	if (oapiReadItem_int   (hFile, "TileLodThreads", i))			TileLodThreads = max(0, min(8, i));
+	if (oapiReadItem_int   (hFile, "TileLodIncremental", i))		TileLodIncremental = max(0, min(1, i));
+	if (oapiReadItem_int   (hFile, "TileCacheGPU", i))				TileCacheGPU = max(0, min(2048, i));
+	if (oapiReadItem_int   (hFile, "TileCacheSys", i))				TileCacheSys = max(0, min(2048, i));
+	if (oapiReadItem_int   (hFile, "TileElevCache", i))				TileElevCache = max(0, min(2048, i));
+	if (oapiReadItem_float (hFile, "TileFrameTime", d))				TileFrameTime = max(0.0, min(1000.0, d));
 	if (oapiReadItem_int   (hFile, "LabelDisplayFlags", i))				LabelDisplayFlags = max(0, min(3, i));
 	if (oapiReadItem_int   (hFile, "GDIOverlay", i))					GDIOverlay = max(0, min(1, i));
 	if (oapiReadItem_int   (hFile, "gcGUIMode", i))						gcGUIMode = max(0, min(3, i));
@@ -242,6 +264,17 @@ void D3D9Config::WriteParams ()
 	oapiWriteItem_int   (hFile, "ShaderDebug", ShaderDebug);
 	oapiWriteItem_int   (hFile, "PresentLocation", PresentLocation);
 	oapiWriteItem_int   (hFile, "PlanetTileLoadFlags", PlanetTileLoadFlags);
+	oapiWriteItem_int   (hFile, "TileArchiveMapping", TileArchiveMapping);
+	oapiWriteItem_int   (hFile, "TileArchiveCache", TileArchiveCache);
+	oapiWriteItem_float (hFile, "TilePrefetchTime", TilePrefetchTime);
+	oapiWriteItem_int   (hFile, "TileLoadThreads", TileLoadThreads);
+	oapiWriteItem_int   (hFile, "TileLoadQueueSize", TileLoadQueueSize);
+	oapiWriteItem_int   (hFile, "TileLodThreads", TileLodThreads);
+	oapiWriteItem_int   (hFile, "TileLodIncremental", TileLodIncremental);
+	oapiWriteItem_int   (hFile, "TileCacheGPU", TileCacheGPU);
+	oapiWriteItem_int   (hFile, "TileCacheSys", TileCacheSys);
+	oapiWriteItem_int   (hFile, "TileElevCache", TileElevCache);
+	oapiWriteItem_float (hFile, "TileFrameTime", TileFrameTime);
 	oapiWriteItem_int   (hFile, "LabelDisplayFlags", LabelDisplayFlags);
 	oapiWriteItem_int   (hFile, "GDIOverlay", GDIOverlay);
 	oapiWriteItem_int	(hFile, "gcGUIMode", gcGUIMode);
@@ -84,6 +84,17 @@ public:
 	int MicroBias;					///< Mipmap LOD Bias for surface micro textures
 	int CloudMicro;					///< Cloud layer micro textures
 	int PlanetTileLoadFlags;		///< Planet Tile Load Flags (0x1=load tiles from directory tree, 0x2=load tiles from compressed archive, 0x3=both \[try directory tree first, then archive\])
+	int TileArchiveMapping;			///< Access compressed tile archives through memory-mapped views (0=positional reads, 1=map if possible \[default\])
+	int TileArchiveCache;			///< Memory budget for inflated tile archive nodes \[MB\] (0=disabled, default=64)
+	double TilePrefetchTime;		///< Look-ahead of the camera-motion predictive tile prefetch \[s\] (0=disabled, default=1)
+	int TileLoadThreads;			///< Number of tile loader worker threads (0=automatic \[default\], 1...16)
+	int TileLoadQueueSize;			///< Capacity of the asynchronous tile load queue \[tiles\] (0=unbounded \[default\])
+	int TileLodThreads;				///< Number of worker threads of the tile LOD selection (0=select on the render thread, 1...8, default=2)
+	int TileLodIncremental;			///< Keep the tile LOD decisions while the camera movement can't change them (0=evaluate every frame, 1=on \[default\])
+	int TileCacheGPU;				///< Video memory budget for parked (out of view) tile subtrees \[MB\] (0=release at once, default=256)
+	int TileCacheSys;				///< System memory budget for parked tile subtrees \[MB\] (0=no separate limit, default=256)
+	int TileElevCache;				///< Memory budget for decoded elevation grids no tile is using \[MB\] (0=disabled, default=128)
+	double TileFrameTime;			///< Frame time the tile uploads are throttled to \[ms\] (0=automatic \[default\])
 	int GDIOverlay;					///< GDI Overlay
 	int gcGUIMode;					///< gcGUI Operation Mode
 	int bAbsAnims;					///< Absolute animations
@@ -15,6 +15,10 @@
 #include "Mesh.h"
 #include "psapi.h"
 #include "DebugControls.h"
+#include "ZTreeMgr.h"
+#include "Surfmgr2.h"
+#include "TileStats.h"
+#include "SlabPool.h"
 
 using namespace oapi;
 
@@ -199,8 +203,39 @@ void D3D9Client::RenderControlPanel()
 	Label("Tile Textures Loaded.: %u (%u MB)", tile_count, tile_size>>20); 
 	Label("Tiles Rendered (Old).: %u (%u kVtx)", tile_render_countA, D3D9Stats.Old.Verts>>10);
 	Label("Tiles Rendered (New).: %u (%u kVtx)", tile_render_countB, D3D9Stats.Surf.Verts>>10);
+	Label("Tiles w/o Own Texture: %u", D3D9Stats.Surf.SubTex);
+	Label("Tile Uploads.........: %u (%u waiting, budget %.1f ms)", D3D9Stats.Surf.Uploads, D3D9Stats.Surf.Ready, D3D9Stats.Surf.UploadBudget);
 	Label("Tiles Allocated (New): %u", D3D9Stats.TilesAllocated);
+	Label("Tile Pools...........: %u objects (%u kB)", DWORD(SlabPoolTotal().objects), DWORD(SlabPoolTotal().bytes>>10));
 	Label("Tile Vertex Cache....: %u (%u MB)", D3D9Stats.TilesCached, D3D9Stats.TilesCachedMB>>20);
+	Label("Parked Subtrees......: %u (%u MB video, %u MB system)", D3D9Stats.TilesParked, D3D9Stats.ParkedGPU>>20, D3D9Stats.ParkedSys>>20);
+
+	ZTreeCache::Stats zcs;
+	ZTreeCache::Global().GetStats(&zcs);
+	Label("Archive Node Cache...: %u (%u MB)", zcs.entries, DWORD(zcs.bytes>>20));
+	Label("Archive Cache Hits...: %u / %u (%u evicted)", zcs.hits, zcs.hits+zcs.misses, zcs.evictions);
+
+	ElevCache::Stats ecs;
+	ElevCache::Global().GetStats(&ecs);
+	Label("Elevation Grid Cache.: %u (%u unused, %u MB)", ecs.entries, ecs.idle, DWORD(ecs.bytes>>20));
+	Label("Elevation Cache Hits.: %u / %u (%u evicted)", ecs.hits, ecs.hits+ecs.misses, ecs.evictions);
+
+	// Tile load latency per stage [ms], Ctrl+Shift+T writes the details to D3D9TileLoad.csv
+	TileStats::Percentiles tpc[TileStats::NSTAGE];
+	char row[4][160];
+	int len[4];
+	for (int i = 0; i < TileStats::NSTAGE; i++) TileStats::Global().Get(i, &tpc[i]);
+	len[0] = sprintf_s(row[0], 160, "Tile Loads Timed.....: %-7u", tpc[TileStats::TOTAL].count);
+	len[1] = sprintf_s(row[1], 160, "Tile Load p50 [ms]...:");
+	len[2] = sprintf_s(row[2], 160, "Tile Load p95 [ms]...:");
+	len[3] = sprintf_s(row[3], 160, "Tile Load p99 [ms]...:");
+	for (int i = 0; i < TileStats::NSTAGE; i++) {
+		len[0] += sprintf_s(row[0]+len[0], 160-len[0], " %7.7s", TileStats::StageName(i));
+		len[1] += sprintf_s(row[1]+len[1], 160-len[1], " %7.1f", tpc[i].p50*1e-3);
+		len[2] += sprintf_s(row[2]+len[2], 160-len[2], " %7.1f", tpc[i].p95*1e-3);
+		len[3] += sprintf_s(row[3]+len[3], 160-len[3], " %7.1f", tpc[i].p99*1e-3);
+	}
+	for (int i = 0; i < 4; i++) Label("%s", row[i]);
 
 
 
@@ -380,5 +415,10 @@ void D3D9Client::RenderControlPanel()
 
 bool D3D9Client::ControlPanelMsg(WPARAM wParam)
 {
+	switch (wParam) {
+	case 'T': // dump the tile load latencies
+		TileStats::Global().WriteCSV("D3D9TileLoad.csv");
+		return true;
+	}
 	return false;
 }
\ No newline at end of file
@@ -0,0 +1,251 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// ElevDecode.cpp
+// Decoding of elevation tile payloads into elevation grids
+//
+// The raw samples are widened, rescaled, offset, converted to float
+// and merged into the grids in one pass. The vector kernel handles
+// eight samples per step and gives the same results as the scalar
+// one: the rescaling is done in double precision and truncated, and
+// the offset wraps around at 16 bit, as in the per-sample code.
+// Integral scale factors are applied as a 16 bit multiply instead,
+// which keeps the same low 16 bits, and flat payloads are a fill.
+//
+// ElevEncode goes the other way, for consumers that need the int16
+// samples of a grid which is only kept in float.
+// ==============================================================
+
+#include "ElevDecode.h"
+#include <math.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define ELEVDECODE_SSE2
+#include <emmintrin.h>
+#endif
+
+// =======================================================================
+
+int ElevDecodeSize (int dtype)
+{
+	switch (dtype) {
+	case 8:   return 1;
+	case -16: return 2;
+	default:  return 0;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+static void DecodeFlat (const ElevDecodePrm *prm, int n, int16_t *e, float *elev)
+{
+	// no samples, so nothing is masked out: every sample is the offset
+	const float v = float(prm->offset) * prm->res;
+	for (int i = 0; i < n; i++) elev[i] = v;
+	if (e) for (int i = 0; i < n; i++) e[i] = prm->offset;
+}
+
+// -----------------------------------------------------------------------
+
+static void DecodeScalar (const ElevDecodePrm *prm, const void *src, int i0, int n, int16_t *e, float *elev)
+{
+	const uint8_t *s8 = (const uint8_t*)src;
+	const int16_t *s16 = (const int16_t*)src;
+	bool do_rescale = (prm->rescale != 1.0);
+	int maskval = (prm->dtype == 8 ? 0xFF : 0x7FFF);
+
+	for (int i = i0; i < n; i++) {
+		int r = (prm->dtype == 8 ? s8[i] : s16[i]);
+		if (prm->mask && r == maskval) continue;
+		int16_t v = (do_rescale ? (int16_t)(int32_t)(r * prm->rescale) : (int16_t)r);
+		v = (int16_t)(v + prm->offset);
+		if (e) e[i] = v;
+		elev[i] = float(v) * prm->res;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+static void EncodeScalar (const float *elev, int i0, int n, float res, int16_t *e)
+{
+	float f = 1.0f / res;
+	for (int i = i0; i < n; i++) {
+		long v = lrintf(elev[i] * f); // nearest, as cvtps2dq
+		e[i] = (int16_t)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+#if defined(ELEVDECODE_SSE2)
+
+static inline __m128i Rescale4 (__m128i v, __m128d f)
+{
+	// four int32 samples, scaled in double precision and truncated
+	__m128i lo = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(v), f));
+	__m128i hi = _mm_cvttpd_epi32(_mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2))), f));
+	return _mm_unpacklo_epi64(lo, hi);
+}
+
+static inline __m128i Wrap16 (__m128i lo, __m128i hi)
+{
+	// low 16 bits of eight int32 values (no saturation)
+	lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+	hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+	return _mm_packs_epi32(lo, hi);
+}
+
+enum { SCALE_NONE, SCALE_INT, SCALE_FRAC };
+
+template<int DTYPE, int SCALE, bool MASK>
+static void DecodeSSE2 (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev)
+{
+	const uint8_t *s8 = (const uint8_t*)src;
+	const int16_t *s16 = (const int16_t*)src;
+	const __m128d f = _mm_set1_pd(prm->rescale);
+	const __m128i k = _mm_set1_epi16((int16_t)(int32_t)(SCALE == SCALE_INT ? prm->rescale : 0.0));
+	const __m128i ofs = _mm_set1_epi16(prm->offset);
+	const __m128i maskval = _mm_set1_epi16(prm->dtype == 8 ? 0xFF : 0x7FFF);
+	const __m128 res = _mm_set1_ps(prm->res);
+	const __m128i zero = _mm_setzero_si128();
+
+	int i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m128i r;
+		if (DTYPE == 8) r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(s8+i)), zero);
+		else            r = _mm_loadu_si128((const __m128i*)(s16+i));
+
+		__m128i keep = zero; // samples masked out by the mod layer
+		if (MASK) {
+			keep = _mm_cmpeq_epi16(r, maskval);
+			if (_mm_movemask_epi8(keep) == 0xFFFF) continue;
+		}
+
+		__m128i lo, hi;
+		if (SCALE == SCALE_INT) {
+			r = _mm_mullo_epi16(r, k);
+		} else if (SCALE == SCALE_FRAC) { // on the sign-extended int32 halves
+			lo = _mm_srai_epi32(_mm_unpacklo_epi16(r, r), 16);
+			hi = _mm_srai_epi32(_mm_unpackhi_epi16(r, r), 16);
+			r = Wrap16(Rescale4(lo, f), Rescale4(hi, f));
+		}
+		r = _mm_add_epi16(r, ofs);
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(r, r), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(r, r), 16);
+		__m128 flo = _mm_mul_ps(_mm_cvtepi32_ps(lo), res);
+		__m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(hi), res);
+
+		if (MASK) { // merge with the grid
+			if (e) {
+				__m128i old = _mm_loadu_si128((const __m128i*)(e+i));
+				r = _mm_or_si128(_mm_and_si128(keep, old), _mm_andnot_si128(keep, r));
+			}
+			__m128 klo = _mm_castsi128_ps(_mm_unpacklo_epi16(keep, keep));
+			__m128 khi = _mm_castsi128_ps(_mm_unpackhi_epi16(keep, keep));
+			flo = _mm_or_ps(_mm_and_ps(klo, _mm_loadu_ps(elev+i)), _mm_andnot_ps(klo, flo));
+			fhi = _mm_or_ps(_mm_and_ps(khi, _mm_loadu_ps(elev+i+4)), _mm_andnot_ps(khi, fhi));
+		}
+		if (e) _mm_storeu_si128((__m128i*)(e+i), r);
+		_mm_storeu_ps(elev+i, flo);
+		_mm_storeu_ps(elev+i+4, fhi);
+	}
+	DecodeScalar (prm, src, i, n, e, elev); // remaining samples
+}
+
+template<int DTYPE, bool MASK>
+static void DecodeSSE2 (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev)
+{
+	// integral factors: (int16)(int32)(r*k) are the low 16 bits of r*k, which
+	// does not overflow int32 for |k| < 65536
+	if (prm->rescale == 1.0)
+		DecodeSSE2<DTYPE, SCALE_NONE, MASK> (prm, src, n, e, elev);
+	else if (prm->rescale == floor(prm->rescale) && fabs(prm->rescale) < 65536.0)
+		DecodeSSE2<DTYPE, SCALE_INT, MASK> (prm, src, n, e, elev);
+	else
+		DecodeSSE2<DTYPE, SCALE_FRAC, MASK> (prm, src, n, e, elev);
+}
+
+static void DecodeSSE2 (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev)
+{
+	// one loop per payload format, scaling and masking, without branches in the loop
+	if (prm->dtype == 8) {
+		if (prm->mask) DecodeSSE2<8, true> (prm, src, n, e, elev);
+		else           DecodeSSE2<8, false> (prm, src, n, e, elev);
+	} else {
+		if (prm->mask) DecodeSSE2<-16, true> (prm, src, n, e, elev);
+		else           DecodeSSE2<-16, false> (prm, src, n, e, elev);
+	}
+}
+
+static void EncodeSSE2 (const float *elev, int n, float res, int16_t *e)
+{
+	const __m128 f = _mm_set1_ps(1.0f / res);
+	int i = 0;
+	for (; i+8 <= n; i += 8) {
+		__m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(elev+i), f));
+		__m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(elev+i+4), f));
+		_mm_storeu_si128((__m128i*)(e+i), _mm_packs_epi32(lo, hi)); // saturating
+	}
+	EncodeScalar (elev, i, n, res, e); // remaining samples
+}
+
+#endif
+
+// =======================================================================
+
+void ElevDecode (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev)
+{
+	if (!ElevDecodeSize (prm->dtype)) {
+		DecodeFlat (prm, n, e, elev);
+		return;
+	}
+#if defined(ELEVDECODE_SSE2)
+	DecodeSSE2 (prm, src, n, e, elev);
+#else
+	DecodeScalar (prm, src, 0, n, e, elev);
+#endif
+}
+
+// -----------------------------------------------------------------------
+
+void ElevDecodeScalar (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev)
+{
+	if (!ElevDecodeSize (prm->dtype)) {
+		DecodeFlat (prm, n, e, elev);
+		return;
+	}
+	DecodeScalar (prm, src, 0, n, e, elev);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevEncode (const float *elev, int n, float res, int16_t *e)
+{
+#if defined(ELEVDECODE_SSE2)
+	EncodeSSE2 (elev, n, res, e);
+#else
+	EncodeScalar (elev, 0, n, res, e);
+#endif
+}
+
+// -----------------------------------------------------------------------
+
+void ElevEncodeScalar (const float *elev, int n, float res, int16_t *e)
+{
+	EncodeScalar (elev, 0, n, res, e);
+}
+
+// -----------------------------------------------------------------------
+
+const char *ElevDecodeKernel ()
+{
+#if defined(ELEVDECODE_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
@@ -0,0 +1,54 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// ElevDecode.h
+// Decoding of elevation tile payloads into elevation grids
+//
+// Self-contained (no Orbiter or DirectX dependencies), so the
+// kernel can be checked and timed outside of the client.
+// ==============================================================
+
+#ifndef __ELEVDECODE_H
+#define __ELEVDECODE_H
+
+#include <stdint.h>
+
+/**
+ * \brief Decoding parameters of an elevation payload
+ *
+ * A raw sample r becomes e = (int16)(r * rescale) + offset (16 bit
+ * wrap-around, the rescaled value truncated towards zero), and the
+ * elevation elev = float(e) * res.
+ */
+struct ElevDecodePrm {
+	int     dtype;   ///< payload format: 0 = flat (no data), 8 = uint8, -16 = int16
+	double  rescale; ///< scale factor of the raw samples (1: none)
+	int16_t offset;  ///< offset added to the rescaled samples
+	float   res;     ///< elevation resolution [m]
+	bool    mask;    ///< mod layer: samples equal to the mask value (uint8: 255, int16: 32767) leave the grid unchanged
+};
+
+void ElevDecode (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev);
+// decode n samples from 'src' into e[0..n-1] and elev[0..n-1] in a single pass. 'e' may be NULL
+
+void ElevDecodeScalar (const ElevDecodePrm *prm, const void *src, int n, int16_t *e, float *elev);
+// the same without vector instructions
+
+void ElevEncode (const float *elev, int n, float res, int16_t *e);
+// the inverse: nearest int16 samples of elev[0..n-1]/res (saturated). Recovers the decoded samples
+// e exactly from elev = float(e) * res
+
+void ElevEncodeScalar (const float *elev, int n, float res, int16_t *e);
+// the same without vector instructions
+
+int ElevDecodeSize (int dtype);
+// size of a raw sample [bytes], 0 for flat payloads
+
+const char *ElevDecodeKernel ();
+// name of the kernel used by ElevDecode ("SSE2" or "scalar")
+
+#endif // !__ELEVDECODE_H
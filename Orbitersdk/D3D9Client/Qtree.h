@@ -12,8 +12,13 @@
 #ifndef __QTREE_H
 #define __QTREE_H
 
+#include "SlabPool.h"
+
+// Nodes are allocated from a SlabPool, their entries (tiles) should be too.
+// DelChild and DelChildren return the storage of a deleted subtree to the
+// pools in one batch
 template<typename T>
-class QuadTreeNode {
+class QuadTreeNode: public Pooled<QuadTreeNode<T> > {
 public:
 	QuadTreeNode (QuadTreeNode<T> *_parent = NULL, T *_entry = NULL);
 
@@ -51,6 +56,9 @@ public:
 	// was locked and not the entire subtree could be deleted.
 
 private:
+	bool DelSubtrees ();
+	// DelChildren, inside the batch of the outermost call
+
 	T *entry;
 	QuadTreeNode *parent;
 	QuadTreeNode *child[4];
@@ -107,9 +115,11 @@ template<typename T>
 bool QuadTreeNode<T>::DelChild (int idx)
 {
 	_ASSERT(idx < 4);
+	SlabBatch<QuadTreeNode<T> > nodes;
+	SlabBatch<T> entries;
 	bool ok = true;
 	if (child[idx]) {
-		if (child[idx]->DelChildren() && child[idx]->entry->PreDelete()) {
+		if (child[idx]->DelSubtrees() && child[idx]->entry->PreDelete()) {
 			delete child[idx];
 			child[idx] = NULL;
 		} else {
@@ -121,12 +131,20 @@ bool QuadTreeNode<T>::DelChild (int idx)
 
 template<typename T>
 bool QuadTreeNode<T>::DelChildren ()
+{
+	SlabBatch<QuadTreeNode<T> > nodes;
+	SlabBatch<T> entries;
+	return DelSubtrees();
+}
+
+template<typename T>
+bool QuadTreeNode<T>::DelSubtrees ()
 {
 	// recursively delete the child trees extending from the node
 	bool ok = true;
 	for (int i = 0; i < 4; ++i) {
 		if (child[i]) {
-			if (child[i]->DelChildren() && child[i]->Entry()->PreDelete()) {
+			if (child[i]->DelSubtrees() && child[i]->Entry()->PreDelete()) {
 				delete child[i];
 				child[i] = NULL;
 			} else {
@@ -0,0 +1,227 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// SlabPool.h
+// Fixed-size object pools for the planet quadtrees
+//
+// Self-contained (no Orbiter or DirectX dependencies), so the
+// allocator can be used and timed outside of the client.
+// ==============================================================
+
+#ifndef __SLABPOOL_H
+#define __SLABPOOL_H
+
+#include <stddef.h>
+#include <new>
+
+/**
+ * \brief Memory held by all slab pools
+ */
+struct SlabPoolTotals {
+	size_t objects; ///< objects allocated
+	size_t bytes;   ///< size of the slabs [bytes]
+};
+
+inline SlabPoolTotals &SlabPoolTotal ()
+{
+	static SlabPoolTotals totals = { 0, 0 };
+	return totals;
+}
+
+/**
+ * \brief Slab allocator for objects of type T
+ *
+ * Objects are carved from slabs of N slots. Each slab keeps its own free
+ * list, slabs with free slots are chained, so allocating and freeing are a
+ * few pointer operations and never touch the heap, except when a slab is
+ * added or released. Completely empty slabs are released, except for one
+ * kept in reserve, so freeing a large subtree gives the memory back while
+ * the usual grow-shrink traffic of the quadtree stays within the pool.
+ *
+ * A subtree can be freed in bulk: between Defer and Flush (see SlabBatch),
+ * slabs emptied by Free are set aside, and Flush releases them together,
+ * instead of deciding slab by slab which one to keep in reserve.
+ *
+ * Not thread-safe: each pool must be used by one thread at a time (the
+ * quadtrees are only modified by the render thread).
+ */
+template<class T, size_t N = 256>
+class SlabPool {
+public:
+	SlabPool (): partial(NULL), emptied(NULL), nslab(0), nempty(0), nlive(0), ndefer(0) {}
+
+	~SlabPool ()
+	{
+		// objects still alive at this point are leaked by their owner, don't
+		// release their memory under them
+		while (partial && !partial->nlive) {
+			Slab *s = partial;
+			Unlink (s);
+			Release (s);
+		}
+	}
+
+	static SlabPool &Global ()
+	{
+		static SlabPool pool;
+		return pool;
+	}
+	// the pool shared by all objects of type T
+
+	void *Alloc ()
+	{
+		if (!partial) {
+			Slab *s = new Slab;
+			s->nlive = 0;
+			s->free = NULL;
+			for (size_t i = N; i-- > 0; ) {
+				s->slot[i].slab = s;
+				s->slot[i].u.next = s->free;
+				s->free = &s->slot[i];
+			}
+			s->prev = s->next = NULL;
+			Link (s);
+			nslab++, nempty++;
+			SlabPoolTotal().bytes += sizeof(Slab);
+		}
+		Slab *s = partial;
+		Slot *slot = s->free;
+		s->free = slot->u.next;
+		if (!s->nlive++) nempty--;
+		if (!s->free) Unlink (s); // slab full
+		nlive++;
+		SlabPoolTotal().objects++;
+		return slot->u.obj;
+	}
+	// storage for one object of type T
+
+	void Free (void *p)
+	{
+		if (!p) return;
+		Slot *slot = (Slot*)p; // the object is the first member of its slot
+		Slab *s = slot->slab;
+		if (!s->free) Link (s); // slab was full
+		slot->u.next = s->free;
+		s->free = slot;
+		nlive--;
+		SlabPoolTotal().objects--;
+		if (!--s->nlive) {
+			if (ndefer) { // set aside for Flush
+				Unlink (s);
+				s->next = emptied;
+				emptied = s;
+			} else if (nempty) { // keep one empty slab in reserve
+				Unlink (s);
+				Release (s);
+			} else nempty++;
+		}
+	}
+	// return storage obtained from Alloc
+
+	inline void Defer () { ndefer++; }
+	// keep the slabs emptied by Free until the matching Flush
+
+	void Flush ()
+	{
+		if (!ndefer || --ndefer) return;
+		while (emptied) {
+			Slab *s = emptied;
+			emptied = s->next;
+			if (nempty) Release (s);
+			else { // keep one empty slab in reserve
+				Link (s);
+				nempty++;
+			}
+		}
+	}
+	// release the slabs emptied since the outermost Defer
+
+	inline size_t Objects () const { return nlive; }
+	// number of allocated objects
+
+	inline size_t Bytes () const { return nslab * sizeof(Slab); }
+	// memory held by the pool [bytes]
+
+private:
+	struct Slab;
+	struct Slot {
+		union {
+			Slot *next;                           ///< next free slot of the slab
+			double align;                         ///< alignment of the object storage
+			char obj[sizeof(T)];                  ///< object storage
+		} u;
+		Slab *slab;                               ///< slab the slot belongs to
+	};
+	struct Slab {
+		Slab *prev, *next; ///< chain of slabs with free slots
+		Slot *free;        ///< free slots of this slab
+		size_t nlive;      ///< allocated slots
+		Slot slot[N];
+	};
+
+	void Link (Slab *s)
+	{
+		s->prev = NULL;
+		s->next = partial;
+		if (partial) partial->prev = s;
+		partial = s;
+	}
+
+	void Unlink (Slab *s)
+	{
+		if (s->prev) s->prev->next = s->next;
+		else partial = s->next;
+		if (s->next) s->next->prev = s->prev;
+		s->prev = s->next = NULL;
+	}
+
+	void Release (Slab *s)
+	{
+		delete s;
+		nslab--;
+		SlabPoolTotal().bytes -= sizeof(Slab);
+	}
+
+	Slab *partial; ///< slabs with free slots
+	Slab *emptied; ///< slabs emptied while deferred, chained through 'next'
+	size_t nslab;  ///< slabs allocated
+	size_t nempty; ///< slabs without allocated slots (at most one)
+	size_t nlive;  ///< objects allocated
+	size_t ndefer; ///< nesting depth of Defer
+};
+
+/**
+ * \brief Scope in which SlabPool<T> frees in bulk (Defer on entry, Flush on exit)
+ */
+template<class T>
+class SlabBatch {
+public:
+	SlabBatch () { SlabPool<T>::Global().Defer(); }
+	~SlabBatch () { SlabPool<T>::Global().Flush(); }
+};
+
+/**
+ * \brief Base class routing new/delete of class T through SlabPool<T>
+ *
+ * Classes derived from T again fall back to the heap, as do arrays.
+ */
+template<class T>
+class Pooled {
+public:
+	static void *operator new (size_t size)
+	{
+		return (size == sizeof(T) ? SlabPool<T>::Global().Alloc() : ::operator new(size));
+	}
+
+	static void operator delete (void *p, size_t size)
+	{
+		if (size == sizeof(T)) SlabPool<T>::Global().Free(p);
+		else ::operator delete(p);
+	}
+};
+
+#endif // !__SLABPOOL_H
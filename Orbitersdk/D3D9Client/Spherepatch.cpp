@@ -51,8 +51,8 @@ VBMESH::VBMESH ()
 VBMESH::~VBMESH ()
 {
 	if (pMgr) {
-		pMgr->RecycleVertexBuffer(0, &pVB);
-		pMgr->RecycleIndexBuffer(0, &pIB);
+		if (pVB) pMgr->RecycleVertexBuffer(0, &pVB); // NULL if never mapped
+		if (pIB) pMgr->RecycleIndexBuffer(0, &pIB);
 	} else {
 		SAFE_RELEASE(pVB);
 		SAFE_RELEASE(pIB);
@@ -22,10 +22,11 @@
 #include "VectorHelpers.h"
 #include "DebugControls.h"
 #include "gcConst.h"
+#include "ElevDecode.h"
 
 // =======================================================================
 extern void FilterElevationGraphics(OBJHANDLE hPlanet, int lvl, int ilat, int ilng, float *elev);
-
+extern DWORD TextureSizeInBytes(LPDIRECT3DTEXTURE9 pTex);
 
 
 // =======================================================================
@@ -43,6 +44,188 @@ static void VtxInterpolate (VERTEX_2TEX &res, const VERTEX_2TEX &a, const VERTEX
 	res.nz = a.nz*w0 + b.nz*w1;
 }
 
+// =======================================================================
+// Shared cache of decoded elevation grids
+
+ElevCache::ElevCache () :
+	nextlent(0), budget(0), used(0)
+{
+	memset(lent, 0, sizeof(lent));
+	memset(&stats, 0, sizeof(Stats));
+	InitializeCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ElevCache::~ElevCache ()
+{
+	Trim(0);
+	DeleteCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ElevCache &ElevCache::Global ()
+{
+	static ElevCache cache;
+	return cache;
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::SetBudget (__int64 bytes)
+{
+	EnterCriticalSection(&cs);
+	budget = bytes;
+	Trim(budget);
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+const ElevGrid *ElevCache::Get (OBJHANDLE body, int lvl, int ilat, int ilng)
+{
+	std::pair<OBJHANDLE, UINT64> key(body, ((UINT64)(lvl+8) << 48) | ((UINT64)ilat << 24) | (UINT64)ilng);
+	Entry *entry = NULL;
+
+	EnterCriticalSection(&cs);
+	auto it = index.find(key);
+	if (it != index.end()) {
+		entry = it->second;
+		if (!entry->refs++) lru.erase(entry->pos); // in use again
+		stats.hits++;
+	} else {
+		stats.misses++;
+	}
+	LeaveCriticalSection(&cs);
+	return entry;
+}
+
+// -----------------------------------------------------------------------
+
+const ElevGrid *ElevCache::Put (OBJHANDLE body, int lvl, int ilat, int ilng, const ELEVFILEHEADER *hdr, bool file, float *elev)
+{
+	std::pair<OBJHANDLE, UINT64> key(body, ((UINT64)(lvl+8) << 48) | ((UINT64)ilat << 24) | (UINT64)ilng);
+	Entry *entry;
+
+	EnterCriticalSection(&cs);
+	auto it = index.find(key);
+	if (it != index.end()) { // stored meanwhile
+		entry = it->second;
+		if (!entry->refs++) lru.erase(entry->pos);
+		delete []elev;
+	} else {
+		entry = new Entry;
+		memcpy(&entry->hdr, hdr, sizeof(ELEVFILEHEADER));
+		entry->file = file;
+		entry->elev = elev;
+		entry->key = key;
+		entry->refs = 1;
+		entry->size = TILE_ELEVSTRIDE*TILE_ELEVSTRIDE*sizeof(float);
+		index[key] = entry;
+		used += entry->size;
+		Trim(budget);
+	}
+	LeaveCriticalSection(&cs);
+	return entry;
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::AddRef (const ElevGrid *grid)
+{
+	Entry *entry = static_cast<Entry*>(const_cast<ElevGrid*>(grid));
+	EnterCriticalSection(&cs);
+	if (!entry->refs++) lru.erase(entry->pos);
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::Release (const ElevGrid *grid)
+{
+	Entry *entry = static_cast<Entry*>(const_cast<ElevGrid*>(grid));
+	EnterCriticalSection(&cs);
+	if (!--entry->refs) {
+		if ((__int64)entry->size <= budget) { // keep it for later
+			lru.push_front(entry);
+			entry->pos = lru.begin();
+			Trim(budget);
+		} else {
+			Delete(entry);
+		}
+	}
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::Lend (const ElevGrid *grid)
+{
+	// callers may fetch several grids before using them (e.g. neighbours for interpolation),
+	// so the oldest of the last nLent is released, not the previous one
+	const ElevGrid *prev;
+	EnterCriticalSection(&cs);
+	prev = lent[nextlent];
+	lent[nextlent] = static_cast<Entry*>(const_cast<ElevGrid*>(grid));
+	nextlent = (nextlent + 1) % nLent;
+	LeaveCriticalSection(&cs);
+	if (prev) Release(prev);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::Clear ()
+{
+	for (int i = 0; i < nLent; i++) Lend(NULL);
+	EnterCriticalSection(&cs);
+	if (stats.hits + stats.misses) {
+		LogAlw("Elevation grid cache: %u hits / %u lookups (%0.1f%%), %u evicted", stats.hits, stats.hits + stats.misses,
+			100.0 * stats.hits / (stats.hits + stats.misses), stats.evictions);
+	}
+	Trim(0);
+	if (!index.empty()) LogErr("Elevation grid cache: %u grids still in use", (DWORD)index.size());
+	memset(&stats, 0, sizeof(Stats));
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::GetStats (Stats *s) const
+{
+	EnterCriticalSection(&cs);
+	*s = stats;
+	s->entries = (DWORD)index.size();
+	s->idle = (DWORD)lru.size();
+	s->bytes = used;
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::Trim (__int64 limit)
+{
+	// caller must own the critical section. Grids in use are never dropped
+	while (used > limit && !lru.empty()) {
+		Entry *entry = lru.back();
+		lru.pop_back();
+		Delete(entry);
+		stats.evictions++;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void ElevCache::Delete (Entry *entry)
+{
+	// caller must own the critical section
+	used -= entry->size;
+	index.erase(entry->key);
+	delete []entry->elev;
+	delete entry;
+}
+
+
 
 int compare_lights(const void * a, const void * b);
 
@@ -57,7 +240,8 @@ SurfTile::SurfTile (TileManager2Base *_mgr, int _lvl, int _ilat, int _ilng)
 	node = 0;
 	elev = NULL;
 	ggelev = NULL;
-	elev_file = NULL;
+	egrid = NULL;
+	elevReady = 0;
 	ltex = NULL;
 	has_elevfile = false;
 	label = NULL;
@@ -67,20 +251,19 @@ SurfTile::SurfTile (TileManager2Base *_mgr, int _lvl, int _ilat, int _ilng)
 	if (Config->TileMipmaps == 1 && _lvl < 10) bMipmaps = true;
 
 	memset(&ehdr, 0, sizeof(ELEVFILEHEADER));
+	InitializeCriticalSection(&elevLock);
 }
 
 // -----------------------------------------------------------------------
 
 SurfTile::~SurfTile ()
 {
-	if (elev) {
-		delete []elev;
+	if (egrid) {
+		ElevCache::Global().Release(egrid);
+		egrid = NULL;
 		elev = NULL;
 	}
-	if (elev_file) {
-		delete []elev_file;
-		elev_file = NULL;
-	}
+	DeleteCriticalSection(&elevLock);
 	if (ltex && owntex) {
 		if (TileCatalog->Remove(ltex)) ltex->Release();
 	}
@@ -89,6 +272,15 @@ SurfTile::~SurfTile ()
 
 // -----------------------------------------------------------------------
 
+void SurfTile::MemoryUse (size_t *gpu, size_t *sys) const
+{
+	Tile::MemoryUse (gpu, sys);
+	if (ltex && owntex) *gpu += TextureSizeInBytes (ltex);
+	if (elev) *sys += TILE_ELEVSTRIDE*TILE_ELEVSTRIDE*sizeof(float);
+}
+
+// -----------------------------------------------------------------------
+
 void SurfTile::PreLoad()
 {
 	char fname[128];
@@ -109,7 +301,7 @@ void SurfTile::PreLoad()
 
 	if (!ok && smgr->ZTreeManager(0)) { // try loading from compressed archive
 		BYTE *buf;
-		DWORD ndata = smgr->ZTreeManager(0)->ReadData(lvl+4, ilat, ilng, &buf);
+		DWORD ndata = smgr->ZTreeManager(0)->ReadData(lvl+4, ilat, ilng, &buf, &timing.zt);
 		if (ndata) {
 			ok = LoadTextureFromMemory(buf, ndata, &pPreSrf);
 			smgr->ZTreeManager(0)->ReleaseData(buf);
@@ -128,7 +320,7 @@ void SurfTile::PreLoad()
 		}
 		if (!ok && smgr->ZTreeManager(1)) { // try loading from compressed archive
 			BYTE *buf;
-			DWORD ndata = smgr->ZTreeManager(1)->ReadData(lvl+4, ilat, ilng, &buf);
+			DWORD ndata = smgr->ZTreeManager(1)->ReadData(lvl+4, ilat, ilng, &buf, &timing.zt);
 			if (ndata) {
 				LoadTextureFromMemory(buf, ndata, &pPreMsk);
 				smgr->ZTreeManager(1)->ReleaseData(buf);
@@ -138,6 +330,38 @@ void SurfTile::PreLoad()
 
 	mgr->TileLabel(pPreSrf, lvl, ilat, ilng);
 	mgr->TileLabel(pPreMsk, lvl, ilat, ilng);
+	timing.Book(TileStats::DECODE);
+
+	// Without a texture of its own the tile maps a subrange of an ancestor texture
+	if (!pPreSrf) GetParentSubTexRange(&texrange);
+
+	// Build the mesh in system memory here, Load() only uploads it
+	CreateMesh();
+}
+
+// -----------------------------------------------------------------------
+
+void SurfTile::CreateMesh ()
+{
+	// Load elevation data
+	float *elev = ElevationData (&timing.zt);
+	timing.Book(TileStats::ELEV);
+
+	bool shift_origin = (lvl >= 4);
+	int res = mgr->GridRes();
+
+	if (lvl <= 0)
+	{
+		if (!lvl) { // create hemisphere mesh for western or eastern hemispheres
+			mesh = CreateMesh_hemisphere(res, elev, 0.0);
+	//  } else {    // create full sphere mesh
+	//	  // TODO
+		}
+	} else {
+		// create rectangular patch
+		mesh = CreateMesh_quadpatch (res, res, elev, 1.0, 0.0, &texrange, shift_origin, &vtxshift, mgr->GetPlanet()->prm.tilebb_excess);
+	}
+	timing.Book(TileStats::MESH);
 }
 
 // -----------------------------------------------------------------------
@@ -166,24 +390,11 @@ void SurfTile::Load ()
 		}
 	}
 
-	// Load elevation data
-	float *elev = ElevationData ();
-
-	bool shift_origin = (lvl >= 4);
-	int res = mgr->GridRes();
-
-	if (lvl <= 0)
-	{
-		if (!lvl) { // create hemisphere mesh for western or eastern hemispheres
-			mesh = CreateMesh_hemisphere(res, elev, 0.0);
-	//  } else {    // create full sphere mesh
-	//	  // TODO
-		}
-	} else {
-		// create rectangular patch
-		mesh = CreateMesh_quadpatch (res, res, elev, 1.0, 0.0, &texrange, shift_origin, &vtxshift, mgr->GetPlanet()->prm.tilebb_excess);
-	}
+	// Upload the mesh (built by PreLoad, unless the tile was loaded without it)
+	if (!mesh) CreateMesh();
+	if (mesh) mesh->MapVertices(pDev);
 
+	// Labels stay here: they read ancestor labels, which the render thread may delete
 	static const DWORD label_enable = PLN_ENABLE | PLN_LMARK;
 	DWORD plnmode = *(DWORD*)smgr->Client()->GetConfigParam(CFGPRM_PLANETARIUMFLAG);
 	if ((plnmode & label_enable) == label_enable) {
@@ -191,12 +402,36 @@ void SurfTile::Load ()
 	}
 }
 
+// -----------------------------------------------------------------------
+// Decode an elevation payload read from a file into the float grid, in chunks through a small buffer
+
+static void ReadElevationData (FILE *f, const ElevDecodePrm *prm, int ndat, float *elev)
+{
+	BYTE buf[4096];
+	int size = ElevDecodeSize (prm->dtype);
+	if (!size) { // flat tile, no data block
+		ElevDecode (prm, NULL, ndat, NULL, elev);
+		return;
+	}
+	int nchunk = sizeof(buf) / size;
+	for (int i = 0; i < ndat; i += nchunk) {
+		int n = min(nchunk, ndat-i);
+		int nread = (int)fread (buf, size, n, f);
+		for (int j = nread; j < n; j++) { // truncated file: no data, or no modification
+			if (size == 1) buf[j] = (prm->mask ? UCHAR_MAX : 0);
+			else ((INT16*)buf)[j] = (prm->mask ? SHRT_MAX : 0);
+		}
+		ElevDecode (prm, buf, n, NULL, elev+i);
+	}
+}
+
 // -----------------------------------------------------------------------
 
-INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int ilng)
+float *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int ilng, ZTreeTiming *tm)
 {
 	const int ndat = TILE_ELEVSTRIDE*TILE_ELEVSTRIDE;
-	INT16 *e = NULL;
+	bool found = false;
+	float *elev = NULL;
 
 	// Elevation resolution used for "rounding" due to INT16 elevation. 
 	// Technically, should not apply to float based elevation but required due to rounding in physics.
@@ -207,12 +442,17 @@ INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int iln
 	FILE *f;
 	int i;
 
+	// The raw samples are rescaled to the target resolution and offset, and converted to float,
+	// in one pass by ElevDecode. Only the float grid is kept
+	ElevDecodePrm dp;
+	dp.res = float(tgt_res);
+	dp.mask = false;
+
 	// Elevation data
 	if (smgr->DoLoadIndividualFiles(2)) { // try loading from individual tile file
 		sprintf_s (fname, ARRAYSIZE(fname), "%s\\Elev\\%02d\\%06d\\%06d.elv", name, lvl, ilat, ilng);
-		bool found = mgr->GetClient()->TexturePath(fname, path);
-		if (found && !fopen_s(&f, path, "rb")) {
-			e = new INT16[ndat];
+		if (mgr->GetClient()->TexturePath(fname, path) && !fopen_s(&f, path, "rb")) {
+			found = true;
 			elev = new float[ndat];
 			// read the elevation file header
 			fread (&ehdr, sizeof(ELEVFILEHEADER), 1, f);
@@ -222,31 +462,19 @@ INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int iln
 #ifdef ORBITER2016
 			ehdr.scale = 1.0;
 #endif
-			switch (ehdr.dtype) {
-			case 0: // flat tile, defined by offset
-				for (i = 0; i < ndat; i++) e[i] = 0;
-				break;
-			case 8: {
-				UINT8 *tmp = new UINT8[ndat];
-				fread (tmp, sizeof(UINT8), ndat, f);
-				for (i = 0; i < ndat; i++)
-					e[i] = (INT16)tmp[i];
-				delete []tmp;
-				}
-				break;
-			case -16:
-				fread (e, sizeof(INT16), ndat, f);
-				break;
-			}
+			dp.dtype = ehdr.dtype;
+			dp.rescale = (ehdr.scale != tgt_res ? ehdr.scale / tgt_res : 1.0);
+			dp.offset = (ehdr.offset ? (INT16)(ehdr.offset / tgt_res) : 0);
+			ReadElevationData (f, &dp, ndat, elev);
 			fclose (f);
 		}
 	}
-	if (!e && smgr->ZTreeManager(2)) { // try loading from compressed archive
+	if (!found && smgr->ZTreeManager(2)) { // try loading from compressed archive
 		BYTE *buf;
-		DWORD ndata = smgr->ZTreeManager(2)->ReadData(lvl, ilat, ilng, &buf);
+		DWORD ndata = smgr->ZTreeManager(2)->ReadData(lvl, ilat, ilng, &buf, tm);
 		if (ndata) {
 			BYTE *p = buf;
-			e = new INT16[ndat];
+			found = true;
 			elev = new float[ndat];
 			memcpy(&ehdr, p, sizeof(ELEVFILEHEADER));
 			LogClr("Teal", "NewTileA[%s]: Lvl=%d, Scale=%g, Offset=%g", name, lvl-4, ehdr.scale, ehdr.offset);
@@ -255,54 +483,22 @@ INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int iln
 			ehdr.scale = 1.0;
 #endif
 			p += ehdr.hdrsize;
-			switch (ehdr.dtype) {
-			case 0:
-				for (i = 0; i < ndat; i++) e[i] = 0;
-				break;
-			case 8:
-				for (i = 0; i < ndat; i++)
-					e[i] = (INT16)(*p++);
-				break;
-			case -16:
-				memcpy(e, p, ndat*sizeof(INT16));
-				p += ndat*sizeof(INT16);
-				break;
-			}
+			dp.dtype = ehdr.dtype;
+			dp.rescale = (ehdr.scale != tgt_res ? ehdr.scale / tgt_res : 1.0);
+			dp.offset = (ehdr.offset ? (INT16)(ehdr.offset / tgt_res) : 0);
+			ElevDecode (&dp, p, ndat, NULL, elev);
 			smgr->ZTreeManager(2)->ReleaseData(buf);
 		}
 	}
 
-	if (e) {
-	
-		//
-		//for (i = 0; i < ndat; i++) elev[i] = (trunc(float(e[i]) * (ehdr.scale / tgt_res)) + trunc(ehdr.offset / tgt_res)) * tgt_res;
-
-		if (ehdr.scale != tgt_res) { // rescale the data
-			double rescale = ehdr.scale / tgt_res;
-			for (i = 0; i < ndat; i++)
-				e[i] = (INT16)(e[i] * rescale);
-		}
-		if (ehdr.offset) {
-			INT16 sofs = (INT16)(ehdr.offset / tgt_res);
-			for (i = 0; i < ndat; i++)
-				e[i] += sofs;
-		}
-
-		// Convert to float
-		for (i = 0; i < ndat; i++) elev[i] = float(e[i]) * float(tgt_res);	
-	}
-
-	// Elevation mod data
-	if (e) {
+	// Elevation mod data: merged into the grids, except for the masked samples
+	if (found) {
 		bool ok = false;
-		double rescale;
-		INT16 offset;
-		bool do_rescale, do_shift;
 		ELEVFILEHEADER hdr;
+		dp.mask = true;
 		if (smgr->DoLoadIndividualFiles(3)) { // try loading from individual tile file
 			sprintf_s (fname, ARRAYSIZE(fname), "%s\\Elev_mod\\%02d\\%06d\\%06d.elv", name, lvl, ilat, ilng);
-			bool found = mgr->GetClient()->TexturePath(fname, path);
-			if (found && !fopen_s(&f, path, "rb")) {
+			if (mgr->GetClient()->TexturePath(fname, path) && !fopen_s(&f, path, "rb")) {
 				fread (&hdr, sizeof(ELEVFILEHEADER), 1, f);
 				if (hdr.hdrsize != sizeof(ELEVFILEHEADER)) fseek (f, hdr.hdrsize, SEEK_SET);
 				LogClr("Teal", "NewElevMod[%s]: Lvl=%d, Scale=%g, Offset=%g", name, lvl - 4, hdr.scale, hdr.offset);
@@ -310,41 +506,13 @@ INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int iln
 #ifdef ORBITER2016
 				hdr.scale = 1.0;
 #endif
-				rescale = (do_rescale = (hdr.scale != 1.0)) ? hdr.scale : 1.0;
-				offset = (do_shift = (hdr.offset != 0.0)) ? INT16(hdr.offset) : 0;
-
-				switch (hdr.dtype) {
-				case 0: // overwrite the entire tile with a flat offset
-					for (i = 0; i < ndat; i++) e[i] = offset, elev[i] = float(hdr.offset);
-					break;
-				case 8: {
-					const UINT8 mask = UCHAR_MAX;
-					UINT8 *tmp = new UINT8[ndat];
-					fread (tmp, sizeof(UINT8), ndat, f);
-					for (i = 0; i < ndat; i++) {
-						if (tmp[i] != mask) {
-							e[i] = (INT16)(do_rescale ? (INT16)(tmp[i] * rescale) : (INT16)tmp[i]);
-							if (do_shift) e[i] += offset;
-							elev[i] = float(e[i]) * float(tgt_res);
-						}
-					}
-					delete []tmp;
-					}
-					break;
-				case -16: {
-					const INT16 mask = SHRT_MAX;
-					INT16 *tmp = new INT16[ndat];
-					fread (tmp, sizeof(INT16), ndat, f);
-					for (i = 0; i < ndat; i++) {
-						if (tmp[i] != mask) {
-							e[i] = (do_rescale ? (INT16)(tmp[i] * rescale) : tmp[i]);
-							if (do_shift) e[i] += offset;
-							elev[i] = float(e[i]) * float(tgt_res);
-						}
-					}
-					delete []tmp;
-					}
-					break;
+				dp.dtype = hdr.dtype;
+				dp.rescale = hdr.scale;
+				dp.offset = (hdr.offset != 0.0 ? INT16(hdr.offset) : 0);
+				if (hdr.dtype == 0) { // overwrite the entire tile with a flat offset
+					for (i = 0; i < ndat; i++) elev[i] = float(hdr.offset);
+				} else if (ElevDecodeSize (hdr.dtype)) {
+					ReadElevationData (f, &dp, ndat, elev);
 				}
 				fclose(f);
 				ok = true;
@@ -352,51 +520,30 @@ INT16 *SurfTile::ReadElevationFile (const char *name, int lvl, int ilat, int iln
 		}
 		if (!ok && smgr->ZTreeManager(3)) { // try loading from compressed archive
 			BYTE *buf;
-			DWORD ndata = smgr->ZTreeManager(3)->ReadData(lvl, ilat, ilng, &buf);
+			DWORD ndata = smgr->ZTreeManager(3)->ReadData(lvl, ilat, ilng, &buf, tm);
 			if (ndata) {
 				BYTE *p = buf;
-				ELEVFILEHEADER *phdr = (ELEVFILEHEADER*)p;
-				LogClr("Teal", "NewElevModA[%s]: Lvl=%d, Scale=%g, Offset=%g", name, lvl - 4, phdr->scale, phdr->offset);
+				memcpy(&hdr, p, sizeof(ELEVFILEHEADER));
+				LogClr("Teal", "NewElevModA[%s]: Lvl=%d, Scale=%g, Offset=%g", name, lvl - 4, hdr.scale, hdr.offset);
 
 #ifdef ORBITER2016
-				phdr->scale = 1.0;
+				hdr.scale = 1.0;
 #endif
-				p += phdr->hdrsize;
-				rescale = (do_rescale = (phdr->scale != 1.0)) ? phdr->scale : 1.0;
-				offset = (do_shift = (phdr->offset != 0.0)) ? INT16(phdr->offset) : 0;
-
-				switch(phdr->dtype) {
-				case 0:
-					for (i = 0; i < ndat; i++) e[i] = offset, elev[i] = float(phdr->offset);
-					break;
-				case 8: {
-					const UINT8 mask = UCHAR_MAX;
-					for (i = 0; i < ndat; i++) {
-						if (p[i] != mask) {
-							e[i] = (INT16)(do_rescale ? p[i] * rescale : p[i]);
-							if (do_shift) e[i] += offset;
-							elev[i] = float(e[i]) * float(tgt_res);
-						}
-					}
-					} break;
-				case -16: {
-					const INT16 mask = SHRT_MAX;
-					INT16 *buf16 = (INT16*)p;
-					for (i = 0; i < ndat; i++) {
-						if (buf16[i] != mask) {
-							e[i] = (do_rescale ? (INT16)(buf16[i] * rescale) : buf16[i]);
-							if (do_shift) e[i] += offset;
-							elev[i] = float(e[i]) * float(tgt_res);
-						}
-					}
-					} break;
+				p += hdr.hdrsize;
+				dp.dtype = hdr.dtype;
+				dp.rescale = hdr.scale;
+				dp.offset = (hdr.offset != 0.0 ? INT16(hdr.offset) : 0);
+				if (hdr.dtype == 0) {
+					for (i = 0; i < ndat; i++) elev[i] = float(hdr.offset);
+				} else if (ElevDecodeSize (hdr.dtype)) {
+					ElevDecode (&dp, p, ndat, NULL, elev);
 				}
 				smgr->ZTreeManager(3)->ReleaseData(buf);
 			}
 		}
 		if (Config->bFlatsEnabled) FilterElevationGraphics(mgr->GetPlanet()->Object(), lvl - 4, ilat, ilng, elev);
 	}
-	return e;
+	return elev;
 }
 
 // -----------------------------------------------------------------------
@@ -492,7 +639,7 @@ bool SurfTile::InterpolateElevationGrid(const float *in, float *out)
 
 // -----------------------------------------------------------------------
 
-bool SurfTile::LoadElevationData ()
+bool SurfTile::LoadElevationData (ZTreeTiming *tm)
 {
 	// Note: a tile's elevation data are retrieved from its great-grandparent tile. Each tile stores the elevation
 	// data for its area at 8x higher resolution than required by itself, so they can be used by the grandchildren.
@@ -500,24 +647,51 @@ bool SurfTile::LoadElevationData ()
 	// Once a grandparent has loaded its elevation data on request of a grandchild, any other grandchildren's requests
 	// can be served directly without further disk I/O.
 
-	if (elev) return true; // already present
+	if (elevReady) return true; // already present
 
-	has_elevfile = false;
 	int mode = mgr->Cprm().elevMode;
 	if (!mode) return false;
 
+	// Ancestor grids are loaded on demand, from the load threads (PreLoad) as well as from the render
+	// thread (MatchEdges). The first caller loads the grid, others wait for it on this tile only
+	EnterCriticalSection(&elevLock);
+	bool ok = elevReady || LoadElevationGrid(mode, tm);
+	LeaveCriticalSection(&elevLock);
+	return ok;
+}
+
+// -----------------------------------------------------------------------
+
+bool SurfTile::LoadElevationGrid (int mode, ZTreeTiming *tm)
+{
+	// The grid is built in 'grid' and published with elevReady once complete: other
+	// threads read elev and has_elevfile of a tile only after they have seen elevReady
+
+	// Grids are shared through the elevation cache, which also keeps them for a while after the tile is gone
+	ElevCache &ecache = ElevCache::Global();
+	egrid = ecache.Get(mgr->Cbody(), lvl, ilat, ilng);
+	if (egrid) {
+		memcpy(&ehdr, &egrid->hdr, sizeof(ELEVFILEHEADER));
+		elev = egrid->elev;
+		has_elevfile = egrid->file;
+		InterlockedExchange(&elevReady, 1);
+		return true;
+	}
+
 	DWORD phy_lvl = mgr->GetPlanet()->GetPhysicsPatchRes();
 	int ndat = TILE_ELEVSTRIDE*TILE_ELEVSTRIDE;
 
-	elev_file = ReadElevationFile (mgr->CbodyName(), lvl + 4, ilat, ilng);
+	float *grid = ReadElevationFile (mgr->CbodyName(), lvl + 4, ilat, ilng, tm);
+	bool file = (grid != NULL);
 	double tgt_res = mgr->ElevRes();
 
-	if (elev_file) has_elevfile = true;
-	else if (lvl > 0) {
+	if (!file && lvl > 0) {
 
-		// Acquire elev header data from a parent
+		// Acquire elev header data from a parent. Ancestor grids are loaded here rather than taken only if
+		// present: the grid is cached under this tile's position, so it must always come from the same source.
+		// Elevation locks are only taken going up the tree, so this cannot deadlock
 		QuadTreeNode<SurfTile> *parent = node->Parent();
-		if (parent &&  parent->Entry()) memcpy(&ehdr, &parent->Entry()->ehdr, sizeof(ELEVFILEHEADER));
+		if (parent && parent->Entry() && parent->Entry()->LoadElevationData(tm)) memcpy(&ehdr, &parent->Entry()->ehdr, sizeof(ELEVFILEHEADER));
 
 		// construct elevation grid by interpolating ancestor data
 		ELEVHANDLE hElev = mgr->ElevMgr();
@@ -529,11 +703,11 @@ bool SurfTile::LoadElevationData ()
 			int plvl = lvl-1;
 			int pilat = ilat >> 1;
 			int pilng = ilng >> 1;
-			INT16 *pelev_file = 0;
+			const float *pelev = 0;
 			QuadTreeNode<SurfTile> *parent = node->Parent();
-			for (; plvl >= 0; plvl--) { // find ancestor with elevation data
-				if (parent && parent->Entry()->has_elevfile) {
-					pelev_file = parent->Entry()->elev_file;
+			for (; plvl >= 0; plvl--) { // find the nearest ancestor with an elevation file
+				if (parent && parent->Entry()->LoadElevationData(tm) && parent->Entry()->has_elevfile) {
+					pelev = parent->Entry()->elev;
 					break;
 				}
 				if (parent) parent = parent->Parent();
@@ -541,16 +715,21 @@ bool SurfTile::LoadElevationData ()
 				pilng >>= 1;
 			}
 
-			if (!pelev_file) return false;
+			if (!pelev) return false;
 
-			elev = new float[ndat];
-			INT16 *elev_temp = new INT16[ndat];
+			grid = new float[ndat];
+			INT16 *elev_temp = new INT16[ndat*2];
+
+			// The ancestor only keeps the float grid. Decoded samples are float(e)*tgt_res, so ElevEncode
+			// recovers the file data exactly. Flattened areas enter with their nearest samples
+			ElevEncode(pelev, ndat, float(tgt_res), elev_temp);
 
 			// submit ancestor data to elevation manager for interpolation
-			mgr->GetClient()->ElevationGrid(hElev, ilat, ilng, lvl, pilat, pilng, plvl, pelev_file, elev_temp);
+			mgr->GetClient()->ElevationGrid(hElev, ilat, ilng, lvl, pilat, pilng, plvl, elev_temp, elev_temp + ndat);
 
 			// Convert to float
-			for (int i = 0; i < ndat; i++) elev[i] = float(elev_temp[i]) * float(tgt_res);
+			ElevDecodePrm dp = { -16, 1.0, 0, float(tgt_res), false };
+			ElevDecode(&dp, elev_temp + ndat, ndat, NULL, grid);
 
 			delete[] elev_temp;
 		}
@@ -558,22 +737,27 @@ bool SurfTile::LoadElevationData ()
 		// Experimental Linear Interpolation
 		else {
 			QuadTreeNode<SurfTile> *parent = node->Parent();
-			if (parent &&  parent->Entry()->elev) {
-				elev = new float[ndat];
-				InterpolateElevationGrid(parent->Entry()->elev, elev);
+			if (parent && parent->Entry()->LoadElevationData(tm)) {
+				grid = new float[ndat];
+				InterpolateElevationGrid(parent->Entry()->elev, grid);
 			}
 		}
 	}
 
-	if (has_elevfile) LogClr("Teal", "TileCreatedFromFile: Level=%d, ilat=%d, ilng=%d", lvl, ilat, ilng);
+	if (file) LogClr("Teal", "TileCreatedFromFile: Level=%d, ilat=%d, ilng=%d", lvl, ilat, ilng);
 	else LogClr("Teal", "TileInterpolatedFromParent: Level=%d, ilat=%d, ilng=%d", lvl, ilat, ilng);
 
-	return (elev != 0);
+	if (!grid) return false;
+	egrid = ecache.Put(mgr->Cbody(), lvl, ilat, ilng, &ehdr, file, grid);
+	elev = egrid->elev;
+	has_elevfile = file;
+	InterlockedExchange(&elevReady, 1);
+	return true;
 }
 
 // -----------------------------------------------------------------------
 
-float *SurfTile::ElevationData () const
+float *SurfTile::ElevationData (ZTreeTiming *tm) const
 {
 	if (!ggelev) {
 		int ancestor_dlvl = 3;
@@ -585,7 +769,7 @@ float *SurfTile::ElevationData () const
 				ancestor = ancestor->Parent();
 				blockRes >>= 1;
 			}
-			if (ancestor && ancestor->Entry()->LoadElevationData()) {
+			if (ancestor && ancestor->Entry()->LoadElevationData(tm)) {
 				// compute pixel offset into great-grandparent tile set
 				int nblock = TILE_FILERES/blockRes;
 				int mask = nblock-1;
@@ -594,7 +778,7 @@ float *SurfTile::ElevationData () const
 			}
 		} else {
 			SurfTile *ggp = smgr->GlobalTile(lvl - ancestor_dlvl);// +3);
-			if (ggp && ggp->LoadElevationData ()) {
+			if (ggp && ggp->LoadElevationData (tm)) {
 				int blockRes = mgr->GridRes();
 				int nblock = TILE_FILERES/blockRes;
 				int mask = nblock-1;
@@ -1380,21 +1564,24 @@ void TileManager2<SurfTile>::Render (MATRIX4 &dwmat, bool use_zbuf, const vPlane
 	// ------------------------------------------------------------------
 	// TODO: render full sphere for levels < 4
 
-	loader->WaitForMutex();
+	// finish the tiles pre-loaded by the load threads
+	loader->LoadCompleted();
 
-	// update the tree
+	// update the tree, the load queue is locked only while the tree is processed
+	loader->WaitForMutex();
+	SelectTiles (tiletree);
 	for (i = 0; i < 2; i++)
 		ProcessNode (tiletree+i);
+	PrefetchTiles (tiletree);
+	TrimCache ();
+	loader->ReleaseMutex();
 
 	vp->tile_cache = NULL;
 
 	if (scene->GetRenderPass() == RENDERPASS_MAINSCENE) ResetMinMaxElev();
 
 	// render the tree
-	for (i = 0; i < 2; i++)
-		RenderNode (tiletree+i);
-
-	loader->ReleaseMutex();
+	RenderTiles<SurfTile> ();
 
 
 	// Backup the stats and clear counters
@@ -1500,21 +1687,17 @@ void TileManager2<SurfTile>::InitHasIndividualFiles()
 
 // -----------------------------------------------------------------------
 
-template<>
-Tile * TileManager2<SurfTile>::SearchTile (double lng, double lat, int maxlvl, bool bOwntex) const
-{
-	if (lng<0) return SearchTileSub(&tiletree[0], lng, lat, maxlvl, bOwntex);
-	else	   return SearchTileSub(&tiletree[1], lng, lat, maxlvl, bOwntex);
-}
-// -----------------------------------------------------------------------
-
 template<>
 int TileManager2<SurfTile>::GetElevation(double lng, double lat, double *elev, FVECTOR3 *nrm, SurfTile **cache)
 {
 	int rv = 0;
 	loader->WaitForMutex();
-	if (lng<0) rv = tiletree[0].Entry()->GetElevation(lng, lat, elev, nrm, cache);
-	else	   rv = tiletree[1].Entry()->GetElevation(lng, lat, elev, nrm, cache);
+	// start at the tile where a descent through the active tiles would end
+	int lvl = IndexedLevel (TILEINDEX_NLVL-1), ilat, ilng;
+	TileIndex (lng, lat, lvl, &ilat, &ilng);
+	SurfTile *tile = static_cast<SurfTile*>(VisitedTile (lvl, ilat, ilng));
+	if (!tile) tile = tiletree[lng<0 ? 0:1].Entry();
+	rv = tile->GetElevation(lng, lat, elev, nrm, cache);
 	loader->ReleaseMutex();
 	return rv;
 }
@@ -1611,3 +1794,26 @@ bool TileManager2<SurfTile>::HasTileData(int iLng, int iLat, int level, int flag
 
 	return bOk;
 }
+
+// -----------------------------------------------------------------------
+
+template<>
+const ElevGrid *TileManager2<SurfTile>::SeekTileElevation(int iLng, int iLat, int level, int flags)
+{
+	if ((flags & 0xF) != gcTileFlags::ELEVATION) return NULL;
+
+	// grids of tiles dropped from the tree remain in the cache for a while
+	const ElevGrid *grid = ElevCache::Global().Get(obj, level, iLat, iLng);
+	if (grid) return grid;
+
+	// otherwise the tile must be in the tree, it loads its grid on demand
+	SurfTile *tile = NULL;
+	if (level < 0) tile = GlobalTile(level);
+	else {
+		QuadTreeNode<SurfTile> *node = FindNode(level, iLat, iLng);
+		if (node && node->Entry() && node->Entry()->Level() == level) tile = node->Entry();
+	}
+	if (!tile || !tile->LoadElevationData()) return NULL;
+	ElevCache::Global().AddRef(tile->egrid);
+	return tile->egrid;
+}
@@ -10,6 +10,7 @@
 #include "Tilemgr2_imp.hpp"
 #include "TileLabel.h"
 #include "D3D9Pad.h"
+#include <map>
 
 #pragma pack(push,1)
 
@@ -28,13 +29,98 @@ struct ELEVFILEHEADER { // file header for patch elevation data file
 
 #pragma pack(pop)
 
+/**
+ * \brief Decoded elevation grid of a surface tile
+ *
+ * Owned by ElevCache and shared by everyone using the tile position. The
+ * data must not be modified once the grid is in the cache.
+ */
+struct ElevGrid {
+	ELEVFILEHEADER hdr; ///< header of the tile's elevation file (of the ancestor, for interpolated grids)
+	bool  file;         ///< decoded from the tile's own elevation file (not interpolated)
+	float *elev;        ///< elevation [m], TILE_ELEVSTRIDE x TILE_ELEVSTRIDE
+};
+
+/**
+ * \brief Shared cache of decoded elevation grids
+ *
+ * Thread-safe, keyed by (planet, level, ilat, ilng), shared by all planets.
+ * Grids are reference counted: a tile holds its own grid, so the grid is
+ * decoded once for the tile and the grandchildren sampling it, and
+ * SeekTileElevation hands out the same data. Grids nobody holds any more
+ * stay in an LRU list bounded by a byte budget, so that terrain which is
+ * visited again is served without file I/O and decoding.
+ */
+class ElevCache {
+public:
+	struct Stats {
+		DWORD   hits;      ///< lookups served from the cache
+		DWORD   misses;    ///< lookups that had to load the grid
+		DWORD   evictions; ///< unused grids dropped to stay within the budget
+		DWORD   entries;   ///< number of grids
+		DWORD   idle;      ///< number of grids not held by anyone
+		__int64 bytes;     ///< size of all grids [bytes]
+	};
+
+	ElevCache ();
+	~ElevCache ();
+
+	static ElevCache &Global ();
+	// the cache shared by all planets
+
+	void SetBudget (__int64 bytes);
+	// set the memory budget [bytes] (0: grids are deleted as soon as they are unused)
+
+	const ElevGrid *Get (OBJHANDLE body, int lvl, int ilat, int ilng);
+	// find a grid and add a reference to it. Returns NULL if not cached
+
+	const ElevGrid *Put (OBJHANDLE body, int lvl, int ilat, int ilng, const ELEVFILEHEADER *hdr, bool file, float *elev);
+	// store a new grid, taking ownership of 'elev', and return it with a reference.
+	// If the grid was stored meanwhile, 'elev' is deleted and the stored grid is returned
+
+	void AddRef (const ElevGrid *grid);
+
+	void Release (const ElevGrid *grid);
+	// drop a reference. Unused grids are kept within the budget
+
+	void Lend (const ElevGrid *grid);
+	// take over a reference for a grid handed out of the client. The last nLent grids are kept,
+	// a grid is released by the nLent-th Lend after its own, or by Clear
+
+	static const int nLent = 16; ///< number of grids handed out of the client that remain valid
+
+	void Clear ();
+	// release the lent grids and all unused grids, and log the hit ratio
+
+	void GetStats (Stats *stats) const;
+
+private:
+	struct Entry: ElevGrid {
+		std::pair<OBJHANDLE, UINT64> key;
+		int    refs;                      ///< number of holders
+		size_t size;                      ///< size of the grid data [bytes]
+		std::list<Entry*>::iterator pos;  ///< position in the LRU list, if unused
+	};
+	void Trim (__int64 limit);
+	void Delete (Entry *entry);
+
+	std::list<Entry*> lru;                                ///< unused grids, most recently used first
+	std::map<std::pair<OBJHANDLE, UINT64>, Entry*> index; ///< all grids
+	Entry   *lent[nLent];       ///< ring of grids handed out by SeekTileElevation
+	int     nextlent;           ///< slot of the next grid in 'lent'
+	__int64 budget;             ///< memory budget [bytes]
+	__int64 used;               ///< size of all grids [bytes]
+	Stats   stats;
+	mutable CRITICAL_SECTION cs;
+};
+
 /**
  * \brief Planetary surface rendering engine.
  *
  * Planetary surface rendering engine v2, including a simple
  * LOD (level-of-detail) algorithm for surface patch resolution.
  */
-class SurfTile: public Tile {
+class SurfTile: public Tile, public Pooled<SurfTile> {
 	friend class TileManager2Base;
 	template<class SurfTile> friend class TileManager2;
 	friend class TileLabel;
@@ -60,6 +146,9 @@ public:
 	double GetMinElev() const { return ehdr.emin; }		// virtual from Tile::
 	double GetMaxElev() const { return ehdr.emax; }		// virtual from Tile::
 	double GetMeanElev() const { return ehdr.emean; }	// virtual from Tile::
+	const char *LayerName() const { return "Surf"; }	// virtual from Tile::
+	void MemoryUse (size_t *gpu, size_t *sys) const;	// virtual from Tile::
+	void ReleaseSubtree () { if (node) node->DelChildren(); }	// virtual from Tile::
 
 protected:
 	virtual Tile *getParent() const { return node && node->Parent() ? node->Parent()->Entry() : NULL; }
@@ -69,8 +158,10 @@ protected:
 
 	void Load ();
 	void PreLoad ();
-	INT16 *ReadElevationFile (const char *name, int lvl, int ilat, int ilng);
-	bool LoadElevationData ();
+	void CreateMesh ();
+	float *ReadElevationFile (const char *name, int lvl, int ilat, int ilng, ZTreeTiming *tm = NULL);
+	bool LoadElevationData (ZTreeTiming *tm = NULL);
+	bool LoadElevationGrid (int mode, ZTreeTiming *tm);
 	void Render ();
 	void StepIn ();
 	bool IsElevated() { return (ggelev!=NULL); }
@@ -95,7 +186,7 @@ protected:
 private:
 	bool InterpolateElevationGrid(const float *pelev, float *elev);
 	float Interpolate(FMATRIX4 &in, float x, float y);
-	float *ElevationData () const;
+	float *ElevationData (ZTreeTiming *tm = NULL) const;
 	void ComputeElevationData(const float *elev) const;
 	float fixinput(double, int);
 	D3DXVECTOR4 MicroTexRange(SurfTile *pT, int lvl) const;
@@ -104,8 +195,10 @@ private:
 	D3DXVECTOR2 MicroRep[3];
 	DWORD MaxRep;
 	LPDIRECT3DTEXTURE9 ltex;	///< landmask/nightlight texture, if applicable
-	INT16 *elev_file;			///< elevation data [m]
-	float *elev;				///< elevation data [m] (8x subsampled)
+	const ElevGrid *egrid;		///< my decoded elevation grid, shared through ElevCache
+	float *elev;				///< elevation data [m] (8x subsampled, egrid->elev)
+	volatile LONG elevReady;	///< set once elev, egrid and has_elevfile are complete
+	CRITICAL_SECTION elevLock;	///< held while the grid is loaded
 	mutable float *ggelev;		///< pointer to my elevation data in the great-grandparent
 
 	TileLabel *label;			///< surface labels associated with this tile
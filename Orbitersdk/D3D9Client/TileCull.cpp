@@ -0,0 +1,202 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// TileCull.cpp
+// Batch frustum test of the planetary tile bounding boxes
+//
+// The test is the one of Tile::InView: a box is culled if all of its
+// corners are behind the camera (z <= 0), or all of them are on the
+// outer side of the same side plane of the frustum (x/w beyond +-1,
+// with the sign of w folded in, i.e. x beyond +-|w|).
+// Each box is transformed as its centre in double precision plus the
+// corner offsets in single precision. The planes are widened by a bound
+// of the single precision rounding error, so a box the double precision
+// test keeps in view is never culled; boxes within that tolerance of a
+// plane may be kept where the double precision test culls them.
+// ==============================================================
+
+#include "TileCull.h"
+#include <math.h>
+
+// The AVX kernel is compiled when this file is built for AVX (CMake options
+// D3D9CLIENT_TILECULL_AVX, and LODBENCH_AVX for Utils/LodBench)
+#if defined(__AVX__)
+#define TILECULL_AVX
+#include <immintrin.h>
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define TILECULL_SSE2
+#include <emmintrin.h>
+#endif
+
+// relative rounding error bound of the single precision transformation
+// (about 6 roundings of 2^-24 each, with a safety factor)
+static const double cull_eps = 1e-6;
+
+// =======================================================================
+
+void TileCullSetFrame (TileCullFrame *frame, const double m[4][4])
+{
+	frame->lmax = 0.0f;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			frame->m[i][j] = m[i][j];
+			if (i < 3) {
+				frame->l[i][j] = float(m[i][j]);
+				if (fabs(frame->l[i][j]) > frame->lmax) frame->lmax = float(fabs(frame->l[i][j]));
+			}
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void TileCullSetBox (TileCullBox *box, const double corner[8][3])
+{
+	int v, i;
+	for (i = 0; i < 3; i++) {
+		box->c[i] = 0.0;
+		for (v = 0; v < 8; v++) box->c[i] += corner[v][i];
+		box->c[i] *= 0.125;
+	}
+	box->rad = 0.0f;
+	for (v = 0; v < 8; v++) {
+		box->ex[v] = float(corner[v][0] - box->c[0]);
+		box->ey[v] = float(corner[v][1] - box->c[1]);
+		box->ez[v] = float(corner[v][2] - box->c[2]);
+		float r = fabsf(box->ex[v]) + fabsf(box->ey[v]) + fabsf(box->ez[v]);
+		if (r > box->rad) box->rad = r;
+	}
+}
+
+// -----------------------------------------------------------------------
+// Clip coordinates of the box centre and the tolerance of the corner tests
+
+static inline void CullBase (const TileCullFrame *f, const TileCullBox *b, float base[4], float *tol)
+{
+	double bmax = 0.0;
+	for (int j = 0; j < 4; j++) {
+		double d = b->c[0]*f->m[0][j] + b->c[1]*f->m[1][j] + b->c[2]*f->m[2][j] + f->m[3][j];
+		base[j] = float(d);
+		if (fabs(d) > bmax) bmax = fabs(d);
+	}
+	*tol = float(cull_eps * (bmax + double(b->rad) * double(f->lmax)));
+}
+
+// -----------------------------------------------------------------------
+
+static bool CullBoxScalar (const TileCullFrame *f, const TileCullBox *b)
+{
+	float base[4], tol;
+	CullBase (f, b, base, &tol);
+
+	bool bx1 = false, bx2 = false, by1 = false, by2 = false, bz1 = false;
+	for (int v = 0; v < 8; v++) {
+		float p[4];
+		for (int j = 0; j < 4; j++)
+			p[j] = base[j] + b->ex[v]*f->l[0][j] + b->ey[v]*f->l[1][j] + b->ez[v]*f->l[2][j];
+		float aw = fabsf(p[3]) + tol;
+		if (p[2] > -tol) bz1 = true;
+		if (p[0] > -aw) bx1 = true;
+		if (p[0] <  aw) bx2 = true;
+		if (p[1] > -aw) by1 = true;
+		if (p[1] <  aw) by2 = true;
+	}
+	return bx1 && bx2 && by1 && by2 && bz1;
+}
+
+// -----------------------------------------------------------------------
+
+#if defined(TILECULL_SSE2)
+
+static bool CullBoxSSE2 (const TileCullFrame *f, const TileCullBox *b)
+{
+	float base[4], tol;
+	CullBase (f, b, base, &tol);
+
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 t = _mm_set1_ps(tol), nt = _mm_set1_ps(-tol);
+	__m128 mz = _mm_setzero_ps(), mx1 = mz, mx2 = mz, my1 = mz, my2 = mz;
+
+	for (int k = 0; k < 8; k += 4) { // four corners at a time
+		__m128 ex = _mm_loadu_ps(b->ex+k), ey = _mm_loadu_ps(b->ey+k), ez = _mm_loadu_ps(b->ez+k);
+		__m128 p[4];
+		for (int j = 0; j < 4; j++) {
+			p[j] = _mm_add_ps(_mm_add_ps(_mm_set1_ps(base[j]), _mm_mul_ps(ex, _mm_set1_ps(f->l[0][j]))),
+				_mm_add_ps(_mm_mul_ps(ey, _mm_set1_ps(f->l[1][j])), _mm_mul_ps(ez, _mm_set1_ps(f->l[2][j]))));
+		}
+		__m128 aw = _mm_add_ps(_mm_andnot_ps(sign, p[3]), t);
+		__m128 naw = _mm_xor_ps(aw, sign);
+		mz  = _mm_or_ps(mz,  _mm_cmpgt_ps(p[2], nt));
+		mx1 = _mm_or_ps(mx1, _mm_cmpgt_ps(p[0], naw));
+		mx2 = _mm_or_ps(mx2, _mm_cmplt_ps(p[0], aw));
+		my1 = _mm_or_ps(my1, _mm_cmpgt_ps(p[1], naw));
+		my2 = _mm_or_ps(my2, _mm_cmplt_ps(p[1], aw));
+	}
+	return _mm_movemask_ps(mz) && _mm_movemask_ps(mx1) && _mm_movemask_ps(mx2) &&
+		_mm_movemask_ps(my1) && _mm_movemask_ps(my2);
+}
+
+#elif defined(TILECULL_AVX)
+
+static bool CullBoxAVX (const TileCullFrame *f, const TileCullBox *b)
+{
+	float base[4], tol;
+	CullBase (f, b, base, &tol);
+
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 ex = _mm256_loadu_ps(b->ex), ey = _mm256_loadu_ps(b->ey), ez = _mm256_loadu_ps(b->ez);
+	__m256 p[4];
+	for (int j = 0; j < 4; j++) { // all eight corners at once
+		p[j] = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(base[j]), _mm256_mul_ps(ex, _mm256_set1_ps(f->l[0][j]))),
+			_mm256_add_ps(_mm256_mul_ps(ey, _mm256_set1_ps(f->l[1][j])), _mm256_mul_ps(ez, _mm256_set1_ps(f->l[2][j]))));
+	}
+	__m256 aw = _mm256_add_ps(_mm256_andnot_ps(sign, p[3]), _mm256_set1_ps(tol));
+	__m256 naw = _mm256_xor_ps(aw, sign);
+	return _mm256_movemask_ps(_mm256_cmp_ps(p[2], _mm256_set1_ps(-tol), _CMP_GT_OQ)) &&
+		_mm256_movemask_ps(_mm256_cmp_ps(p[0], naw, _CMP_GT_OQ)) &&
+		_mm256_movemask_ps(_mm256_cmp_ps(p[0], aw, _CMP_LT_OQ)) &&
+		_mm256_movemask_ps(_mm256_cmp_ps(p[1], naw, _CMP_GT_OQ)) &&
+		_mm256_movemask_ps(_mm256_cmp_ps(p[1], aw, _CMP_LT_OQ));
+}
+
+#endif
+
+// =======================================================================
+
+void TileCull (const TileCullFrame *frame, const TileCullBox *const *box, int n, bool *inview)
+{
+	for (int i = 0; i < n; i++) {
+#if defined(TILECULL_AVX)
+		inview[i] = CullBoxAVX (frame, box[i]);
+#elif defined(TILECULL_SSE2)
+		inview[i] = CullBoxSSE2 (frame, box[i]);
+#else
+		inview[i] = CullBoxScalar (frame, box[i]);
+#endif
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void TileCullScalar (const TileCullFrame *frame, const TileCullBox *const *box, int n, bool *inview)
+{
+	for (int i = 0; i < n; i++)
+		inview[i] = CullBoxScalar (frame, box[i]);
+}
+
+// -----------------------------------------------------------------------
+
+const char *TileCullKernel ()
+{
+#if defined(TILECULL_AVX)
+	return "AVX";
+#elif defined(TILECULL_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
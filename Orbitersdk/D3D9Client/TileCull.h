@@ -0,0 +1,61 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// TileCull.h
+// Batch frustum test of the planetary tile bounding boxes
+//
+// Self-contained (no Orbiter or DirectX dependencies), so the
+// kernel can be checked and timed outside of the client.
+// ==============================================================
+
+#ifndef __TILECULL_H
+#define __TILECULL_H
+
+/**
+ * \brief Bounding box of a tile in the planet frame
+ *
+ * The corners are stored relative to the box centre in single precision,
+ * one array per axis, so that a vector register holds the same coordinate
+ * of four (SSE) or eight (AVX) corners. The centre stays in double
+ * precision: it is up to a planet radius away from the planet centre,
+ * while the corner offsets are no larger than the tile.
+ */
+struct TileCullBox {
+	double c[3];                ///< box centre in the planet frame [m]
+	float  ex[8], ey[8], ez[8]; ///< corners relative to the centre [m]
+	float  rad;                 ///< largest |ex|+|ey|+|ez| of the corners [m]
+};
+
+/**
+ * \brief Transformation from the planet frame into clip space
+ *
+ * Set up once per pass from the product of the planet's world matrix and
+ * the view-projection matrix (row vectors, clip = (p,1) * m).
+ */
+struct TileCullFrame {
+	double m[4][4];  ///< planet frame to clip space
+	float  l[3][4];  ///< linear part of m
+	float  lmax;     ///< largest |l|
+};
+
+void TileCullSetFrame (TileCullFrame *frame, const double m[4][4]);
+// set up the clip transformation of a pass
+
+void TileCullSetBox (TileCullBox *box, const double corner[8][3]);
+// set up a bounding box from its corners in the planet frame
+
+void TileCull (const TileCullFrame *frame, const TileCullBox *const *box, int n, bool *inview);
+// frustum test of n boxes with the fastest kernel available, inview[i] is false if box[i]
+// is entirely outside of the view frustum
+
+void TileCullScalar (const TileCullFrame *frame, const TileCullBox *const *box, int n, bool *inview);
+// the same without vector instructions
+
+const char *TileCullKernel ();
+// name of the kernel used by TileCull ("AVX", "SSE2" or "scalar")
+
+#endif // !__TILECULL_H
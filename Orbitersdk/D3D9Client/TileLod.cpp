@@ -0,0 +1,76 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// TileLod.cpp
+// Level-of-detail metric of the planetary tile quadtrees
+// ==============================================================
+
+#include "TileLod.h"
+#include <math.h>
+
+// =======================================================================
+
+double TileLodViewAp (double cdist, double minalt)
+{
+	double d = (cdist > 1.0+minalt ? cdist : 1.0+minalt);
+	return acos (1.0/d);
+}
+
+// -----------------------------------------------------------------------
+
+double TileLodAngle (int lvl, double cosa)
+{
+	static const double rad0 = sqrt(2.0)*acos(0.0); // half diagonal of a level 0 tile
+	return acos (cosa) - rad0/(double)(1 << lvl);
+}
+
+// -----------------------------------------------------------------------
+
+int TileLodTarget (const TileLodParam *prm, int lvl, int ilat, double maxelev, double adist, double cdist, double viewap,
+	double *tdist, double *margin)
+{
+	int nlat = 1 << lvl;
+	double bias = prm->bias;
+	if (ilat < nlat/6 || ilat >= nlat-nlat/6) {		// lower resolution at the poles
+		bias -= 1.0;
+		if (ilat < nlat/12 || ilat >= nlat-nlat/12)
+			bias -= 1.0;
+	}
+
+	double erad = 1.0 + maxelev/prm->radius; // radius of unit sphere plus elevation
+	if (adist < 0.0) { // if we are above the tile, use altitude for distance measurement
+		*tdist = cdist - erad;
+		if (*tdist < 0.0) *tdist = 0.0;
+	} else { // use distance to closest tile edge
+		double h = erad*sin(adist);
+		double a = cdist - erad*cos(adist);
+		double x = a*a + h*h;
+		*tdist = (x > 0.0) ? sqrt(x) : 0.0;
+	}
+
+	bias -=  2.0 * sqrt((adist > 0.0 ? adist : 0.0) / viewap);
+	int maxlvl = prm->maxlvl;
+
+	double apr = *tdist * prm->tanap * prm->rscale;
+	if (apr < 1e-6) {
+		if (margin) *margin = 0.0;
+		return maxlvl;
+	}
+	double flvl = bias - log(apr)*TileLodResScale;
+	// the tile splits if its target level is above its own level
+	if (margin) *margin = (lvl < maxlvl ? fabs(flvl - (lvl+1)) : 1e10);
+	int tgt = (int)flvl;
+	return (tgt < 0 ? 0 : tgt > maxlvl ? maxlvl : tgt);
+}
+
+// -----------------------------------------------------------------------
+
+TileLodStep TileLodDecide (int lvl, bool horizon, bool inview, int tgt)
+{
+	if (horizon || !inview) return (lvl ? TILELOD_HIDE : TILELOD_RENDER);
+	return (lvl < tgt ? TILELOD_DESCEND : TILELOD_RENDER);
+}
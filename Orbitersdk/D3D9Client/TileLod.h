@@ -0,0 +1,62 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// ==============================================================
+// TileLod.h
+// Level-of-detail metric of the planetary tile quadtrees
+//
+// Self-contained (no Orbiter or DirectX dependencies), so the LOD
+// selection can be replayed and timed outside of the client
+// (see Utils/LodBench, which shares the metric and TileLodDecide
+// with TileManager2Base::ProcessNode).
+// ==============================================================
+
+#ifndef __TILELOD_H
+#define __TILELOD_H
+
+const double TileLodResScale = 1.1; ///< resolution scale with distance
+
+/**
+ * \brief What the quadtree traversal does with a tile
+ */
+enum TileLodStep {
+	TILELOD_HIDE,    ///< invisible: not rendered, its subtree may be released
+	TILELOD_RENDER,  ///< rendered at its own resolution
+	TILELOD_DESCEND  ///< rendered through its subtiles, once they are all loaded
+};
+
+/**
+ * \brief Parameters of the LOD metric which don't depend on the tile or the
+ *   camera position
+ */
+struct TileLodParam {
+	double bias;    ///< resolution bias (2 to 6, default 4)
+	double tanap;   ///< tangent of the camera aperture
+	double rscale;  ///< resolution scale (1400 / viewport height)
+	double radius;  ///< planet radius [m]
+	int    maxlvl;  ///< highest tile level
+};
+
+double TileLodViewAp (double cdist, double minalt);
+// aperture of the cap visible from a camera at distance 'cdist' [planet radii], for a camera
+// no lower than 'minalt' [planet radii]
+
+double TileLodAngle (int lvl, double cosa);
+// angular distance between the camera and the closest corner of a tile at level 'lvl', given
+// the cosine of the angle between camera and tile centre (negative: the camera is above the tile)
+
+int TileLodTarget (const TileLodParam *prm, int lvl, int ilat, double maxelev, double adist, double cdist, double viewap,
+	double *tdist, double *margin = 0);
+// target resolution level of a tile at angular distance 'adist' from a camera at 'cdist' [planet
+// radii] with visible cap aperture 'viewap'. Returns the tile distance in 'tdist' [planet radii],
+// and in 'margin' how far (in levels) the metric is from changing the tile's split decision
+
+TileLodStep TileLodDecide (int lvl, bool horizon, bool inview, int tgt);
+// step of a tile at level 'lvl' from its horizon and frustum tests and its target level. Tiles
+// beyond the horizon or outside of the view frustum are hidden, except for the roots (level 0),
+// which are rendered at their own resolution
+
+#endif // !__TILELOD_H
@@ -0,0 +1,170 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// =======================================================================
+// TileStats.cpp
+// Per-stage latency statistics of the asynchronous planetary tile loader
+// =======================================================================
+
+#include "TileStats.h"
+#include <math.h>
+
+static const char *stagename[TileStats::NSTAGE] = {
+	"Queue", "Read", "Inflate", "Decode", "Elev", "Mesh", "Upload", "Render", "Total"
+};
+
+// =======================================================================
+// Histogram buckets: bucket 0 holds samples below 1us, bucket b>0 the
+// range [2^((b-1)/4), 2^(b/4)) us.
+
+static int Bucket (double us)
+{
+	if (us < 1.0) return 0;
+	int b = 1 + int(4.0 * log(us) / log(2.0));
+	return (b < TILESTAT_NBUCKET ? b : TILESTAT_NBUCKET-1);
+}
+
+static double BucketValue (int b)
+{
+	return (b ? pow(2.0, (b-0.5)*0.25) : 0.5); // geometric centre
+}
+
+// =======================================================================
+
+TileStats::TileStats ()
+{
+	memset(total, 0, sizeof(total));
+	InitializeCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+TileStats::~TileStats ()
+{
+	Reset();
+	DeleteCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+TileStats &TileStats::Global ()
+{
+	static TileStats stats;
+	return stats;
+}
+
+// -----------------------------------------------------------------------
+
+const char *TileStats::StageName (int stage)
+{
+	return (stage >= 0 && stage < NSTAGE ? stagename[stage] : "");
+}
+
+// -----------------------------------------------------------------------
+
+void TileStats::Add (Hist &h, double us)
+{
+	if (us < 0.0) us = 0.0;
+	h.n[Bucket(us)]++;
+	h.count++;
+	h.sum += us;
+	if (us > h.max) h.max = us;
+}
+
+// -----------------------------------------------------------------------
+
+void TileStats::Evaluate (const Hist &h, Percentiles *pc)
+{
+	pc->count = h.count;
+	pc->p50 = pc->p95 = pc->p99 = pc->mean = pc->max = 0.0;
+	if (!h.count) return;
+
+	const double frac[3] = {0.50, 0.95, 0.99};
+	double *res[3] = {&pc->p50, &pc->p95, &pc->p99};
+	DWORD sum = 0;
+	for (int b = 0, i = 0; b < TILESTAT_NBUCKET && i < 3; b++) {
+		sum += h.n[b];
+		while (i < 3 && sum >= frac[i]*h.count) {
+			*res[i++] = min(BucketValue(b), h.max);
+		}
+	}
+	pc->mean = h.sum / h.count;
+	pc->max = h.max;
+}
+
+// -----------------------------------------------------------------------
+
+void TileStats::Submit (const char *planet, const char *layer, int lvl, const float *dt)
+{
+	if (lvl < 0) return;
+	if (lvl >= TILESTAT_NLVL) lvl = TILESTAT_NLVL-1;
+
+	std::string key = std::string(planet) + "/" + layer;
+
+	EnterCriticalSection(&cs);
+	Layer *&l = layers[key];
+	if (!l) {
+		l = new Layer;
+		memset(l, 0, sizeof(Layer));
+	}
+	for (int i = 0; i < NSTAGE; i++) {
+		Add(l->h[lvl][i], dt[i]);
+		Add(total[i], dt[i]);
+	}
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void TileStats::Get (int stage, Percentiles *pc) const
+{
+	EnterCriticalSection(&cs);
+	Evaluate(total[stage], pc);
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+bool TileStats::WriteCSV (const char *fname) const
+{
+	FILE *f;
+	if (fopen_s(&f, fname, "w")) {
+		LogErr("TileStats: Failed to open %s", fname);
+		return false;
+	}
+	fprintf(f, "planet,layer,level,stage,count,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+
+	EnterCriticalSection(&cs);
+	for (auto it = layers.begin(); it != layers.end(); ++it) {
+		size_t sep = it->first.find('/');
+		std::string planet = it->first.substr(0, sep), layer = it->first.substr(sep+1);
+		for (int lvl = 0; lvl < TILESTAT_NLVL; lvl++) {
+			for (int i = 0; i < NSTAGE; i++) {
+				Percentiles pc;
+				Evaluate(it->second->h[lvl][i], &pc);
+				if (!pc.count) continue;
+				fprintf(f, "%s,%s,%d,%s,%u,%.3f,%.3f,%.3f,%.3f,%.3f\n", planet.c_str(), layer.c_str(), lvl+4, stagename[i],
+					pc.count, pc.mean*1e-3, pc.p50*1e-3, pc.p95*1e-3, pc.p99*1e-3, pc.max*1e-3);
+			}
+		}
+	}
+	LeaveCriticalSection(&cs);
+
+	fclose(f);
+	LogAlw("TileStats: Tile load latencies written to %s", fname);
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+void TileStats::Reset ()
+{
+	EnterCriticalSection(&cs);
+	for (auto it = layers.begin(); it != layers.end(); ++it) delete it->second;
+	layers.clear();
+	memset(total, 0, sizeof(total));
+	LeaveCriticalSection(&cs);
+}
@@ -0,0 +1,133 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// =======================================================================
+// TileStats.h
+// Per-stage latency statistics of the asynchronous planetary tile loader
+// =======================================================================
+
+#ifndef __TILESTATS_H
+#define __TILESTATS_H
+
+#include <windows.h>
+#include <map>
+#include <string>
+#include "ZTreeMgr.h"
+#include "Log.h"
+
+#define TILESTAT_NLVL    32  ///< tile levels tracked per planet
+#define TILESTAT_NBUCKET 112 ///< histogram buckets per stage (4 per octave, 1us...225s)
+
+// =======================================================================
+/**
+ * \brief Latency histograms of the tile load pipeline
+ *
+ * Every tile that went through the load queue reports the time it spent
+ * in each stage once it is rendered for the first time. The samples are
+ * binned into logarithmic histograms per planet, layer, level and stage,
+ * from which the control panel shows percentiles and WriteCSV dumps a
+ * table for offline analysis.
+ */
+class TileStats {
+public:
+	enum Stage {
+		QUEUE,   ///< load request until a loader thread picks the tile up
+		READ,    ///< archive reads (or page-ins of a mapped archive)
+		INFLATE, ///< archive decompression
+		DECODE,  ///< texture decoding, including reads of individual tile files
+		ELEV,    ///< elevation data (reads of individual files, interpolation, conversion)
+		MESH,    ///< mesh construction in system memory
+		UPLOAD,  ///< texture and vertex buffer creation on the render thread
+		RENDER,  ///< end of upload until the tile is first rendered
+		TOTAL,   ///< load request until the tile is first rendered
+		NSTAGE
+	};
+
+	struct Percentiles {
+		DWORD  count;         ///< number of samples
+		double p50, p95, p99; ///< [us]
+		double mean, max;     ///< [us]
+	};
+
+	TileStats ();
+	~TileStats ();
+
+	static TileStats &Global ();
+	// the statistics shared by all planets
+
+	static const char *StageName (int stage);
+
+	void Submit (const char *planet, const char *layer, int lvl, const float *dt);
+	// add the stage durations dt[NSTAGE] [us] of one tile
+
+	void Get (int stage, Percentiles *pc) const;
+	// percentiles of a stage over all planets, layers and levels
+
+	bool WriteCSV (const char *fname) const;
+	// write the percentiles of every planet, layer, level and stage to a CSV file
+
+	void Reset ();
+
+private:
+	struct Hist {
+		DWORD  n[TILESTAT_NBUCKET];
+		DWORD  count;
+		double sum, max;
+	};
+	struct Layer {
+		Hist h[TILESTAT_NLVL][NSTAGE];
+	};
+
+	static void Add (Hist &h, double us);
+	static void Evaluate (const Hist &h, Percentiles *pc);
+
+	std::map<std::string, Layer*> layers; ///< keyed by "planet/layer"
+	Hist total[NSTAGE];                    ///< all planets, layers and levels
+	mutable CRITICAL_SECTION cs;
+};
+
+
+// =======================================================================
+/**
+ * \brief Timestamps and stage durations of a single tile load
+ *
+ * A stage is timed from the previous Book() or Mark() call (or the
+ * request) to the next Book(). Archive read and inflate times accumulated
+ * in 'zt' during a stage are taken out of it and reported as READ and
+ * INFLATE instead.
+ */
+struct TileTiming {
+	double treq;               ///< time of the load request [us], 0 if the tile wasn't queued
+	double tmark;              ///< start of the running stage [us]
+	double zmark;              ///< archive time at tmark [us]
+	double tload;              ///< end of the upload [us], 0 once reported
+	ZTreeTiming zt;            ///< archive time of this load
+	float dt[TileStats::NSTAGE]; ///< stage durations [us]
+
+	TileTiming () { memset(this, 0, sizeof(TileTiming)); }
+
+	void Request ()
+	{
+		memset(this, 0, sizeof(TileTiming));
+		treq = tmark = D3D9GetTime();
+	}
+
+	void Mark ()
+	{
+		tmark = D3D9GetTime();
+		zmark = zt.read + zt.inflate;
+	}
+
+	void Book (int stage)
+	{
+		double t = D3D9GetTime(), z = zt.read + zt.inflate;
+		dt[stage] += float(t - tmark - (z - zmark));
+		tmark = t;
+		zmark = z;
+	}
+};
+
+#endif // !__TILESTATS_H
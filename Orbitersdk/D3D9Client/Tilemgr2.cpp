@@ -16,12 +16,14 @@
 #include "D3D9Catalog.h"
 #include "Scene.h"
 #include "OapiExtension.h"
+#include "DebugControls.h"
 
 #include <stack>
 
 // =======================================================================
 // Externals
 static TEXCRDRANGE2 fullrange = {0,1,0,1};
+extern DWORD TextureSizeInBytes(LPDIRECT3DTEXTURE9 pTex);
 
 int SURF_MAX_PATCHLEVEL2 = 18; // move this somewhere else
 
@@ -35,6 +37,9 @@ Tile::Tile (TileManager2Base *_mgr, int _lvl, int _ilat, int _ilng)
   texrange(fullrange), microrange(fullrange), overlayrange(fullrange), cnt(Centre()),
   mesh(NULL), tex(NULL), pPreSrf(NULL), pPreMsk(NULL), overlay(NULL),
   FrameId(0),
+  qidx(-1), qnext(NULL), qframe(0), qprio(0.0f),
+  lprev(NULL), lnext(NULL), parked(false), pgpu(0), psys(0), pass(0),
+  lodpass(0), lodhorizon(false), lodinview(false), lodtgt(-1), lodprio(0.0f), lodepoch(0), cullok(false),
   state(Invalid),
   edgeok(false), owntex (true), ownoverlay(false)
 {
@@ -45,12 +50,31 @@ Tile::Tile (TileManager2Base *_mgr, int _lvl, int _ilat, int _ilng)
 	Extents(&bnd.minlat, &bnd.maxlat, &bnd.minlng, &bnd.maxlng);
 	D3D9Stats.TilesAllocated++;
 	bMipmaps = false;
+	if (lvl >= 0) mgr->IndexTile (this);
+
+	// tile frame in the planet frame: the camera independent part of WorldMatrix
+	lcos = 1.0, lsin = 0.0;
+	loff = _V(0,0,0);
+	if (lvl > 0) {
+		int nlat = 1 << lvl;
+		int nlng = 2 << lvl;
+		double lat, lng = PI2 * (double)ilng/(double)nlng + PI;
+		lsin = sin(lng), lcos = cos(lng);
+		if (nlat > 8) {
+			if (ilat < nlat/2) lat = PI * (double)(nlat/2-ilat-1)/(double)nlat;
+			else               lat = PI * (double)(nlat/2-ilat)/(double)nlat;
+			double s = mgr->CbodySize();
+			loff = _V(s*cos(lng)*cos(lat), s*sin(lat), s*sin(lng)*cos(lat));
+		}
+	}
 }
 
 // -----------------------------------------------------------------------
 
 Tile::~Tile ()
 {
+	if (parked) TileManager2Base::Unpark (this);
+	if (lvl >= 0) mgr->UnindexTile (this);
 	state = Invalid;
 	if (mesh) delete mesh;
 
@@ -134,6 +158,31 @@ bool Tile::PreDelete ()
 
 // -----------------------------------------------------------------------
 
+void Tile::MemoryUse (size_t *gpu, size_t *sys) const
+{
+	if (tex && owntex) *gpu += TextureSizeInBytes (tex);
+	if (mesh) {
+		*gpu += mesh->nv_cur * sizeof(VERTEX_2TEX) + mesh->nf_cur * 3 * sizeof(WORD);
+		if (mesh->vtx) *sys += mesh->nv * sizeof(VERTEX_2TEX);
+		if (mesh->idx) *sys += mesh->nf * 3 * sizeof(WORD);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void Tile::ReportTiming ()
+{
+	double t = D3D9GetTime();
+	timing.dt[TileStats::READ] = float(timing.zt.read);
+	timing.dt[TileStats::INFLATE] = float(timing.zt.inflate);
+	timing.dt[TileStats::RENDER] = float(t - timing.tload);
+	timing.dt[TileStats::TOTAL] = float(t - timing.treq);
+	TileStats::Global().Submit (mgr->CbodyName(), LayerName(), lvl, timing.dt);
+	timing.tload = 0.0; // report once
+}
+
+// -----------------------------------------------------------------------
+
 bool Tile::GetParentSubTexRange (TEXCRDRANGE2 *subrange)
 {
 	Tile *parent = getParent();
@@ -624,7 +673,6 @@ VBMESH *Tile::CreateMesh_quadpatch (int grdlat, int grdlng, float *elev, double
 	mesh->Box[7] = _V(tmul (R, _V(tpmax.x, tpmax.y, tpmax.z)) + pref);
 
 	mesh->ComputeSphere();
-	mesh->MapVertices(TileManager2Base::pDev);
 
 	return mesh;
 }
@@ -787,38 +835,71 @@ VBMESH *Tile::CreateMesh_hemisphere (int grd, float *elev, double globelev)
 	mesh->nv  = nVtx;
 	mesh->idx = Idx;
 	mesh->nf  = nIdx/3;
-	mesh->MapVertices (TileManager2Base::pDev);
 	return mesh;
 }
 
 // =======================================================================
 // =======================================================================
 
-int TileLoader::nqueue = 0;
-int TileLoader::queue_in = 0;
-int TileLoader::queue_out = 0;
+std::vector<Tile*> TileLoader::queue;
+size_t TileLoader::maxqueue = 0;
+Tile * volatile TileLoader::done = NULL;
+volatile LONG TileLoader::nflight = 0;
+volatile LONG TileLoader::nready = 0;
+volatile LONG TileLoader::maxready = 16;
 HANDLE TileLoader::hLoadMutex = 0;
-struct TileLoader::QUEUEDESC TileLoader::queue[MAXQUEUE2] = {0};
 
 TileLoader::TileLoader (const oapi::D3D9Client *gclient)
 	: gc(gclient)
-	, hStopThread(CreateEvent(NULL, FALSE, FALSE, NULL))
+	, nLoadThreads(0)
+	, hStopThread(CreateEvent(NULL, TRUE, FALSE, NULL))
+	, hWork(CreateEvent(NULL, FALSE, FALSE, NULL))
+	, hReady(CreateEvent(NULL, TRUE, TRUE, NULL))
+	, ready(NULL), readytail(NULL)
+	, budgetframe(0), nupload(0)
+	, tframe(0.0), tbase(0.0), budget(2000.0), spent(0.0), tilecost(0.0)
 	, load_frequency(Config->PlanetLoadFrequency)
 {
 	DWORD id;
 
 	// Initialize statics
-	nqueue = queue_in = queue_out = 0;
+	queue.clear();
+	done = NULL;
+	nflight = 0;
+	nready = 0;
+	maxready = 16;
+	maxqueue = (size_t)Config->TileLoadQueueSize;
+	queue.reserve(maxqueue ? maxqueue : 256);
 	hLoadMutex = CreateMutex (0, FALSE, NULL);
-	hLoadThread = CreateThread (NULL, 32768, Load_ThreadProc, this, 0, &id);
+
+	// One thread per spare core by default. PreLoad (file I/O, inflate, DDS parsing)
+	// runs in parallel, the device bound Load() remains serialised by hLoadMutex.
+	int nthreads = Config->TileLoadThreads;
+	if (nthreads <= 0) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		nthreads = (int)si.dwNumberOfProcessors - 1;
+	}
+	nthreads = max(1, min(MAXLOADTHREADS, nthreads));
+
+	WaitForMutex(); // threads read nLoadThreads
+	for (int i = 0; i < nthreads; i++) {
+		hLoadThread[nLoadThreads] = CreateThread (NULL, 32768, Load_ThreadProc, this, 0, &id);
+		if (hLoadThread[nLoadThreads]) nLoadThreads++;
+	}
+	ReleaseMutex();
+	LogAlw("TileLoader: %d load threads", nLoadThreads);
 }
 
 // -----------------------------------------------------------------------
 
 TileLoader::~TileLoader ()
 {
-	if (hLoadThread) LogErr("TileLoader() Not Yet ShutDown()");
+	if (nLoadThreads) LogErr("TileLoader() Not Yet ShutDown()");
 	TerminateLoadThread();
+	CloseHandle (hStopThread);
+	CloseHandle (hWork);
+	CloseHandle (hReady);
 	CloseHandle (hLoadMutex);
 	hLoadMutex = NULL;
 }
@@ -827,7 +908,7 @@ TileLoader::~TileLoader ()
 
 bool TileLoader::ShutDown()
 {
-	if (hLoadThread) {
+	if (nLoadThreads) {
 		TerminateLoadThread();
 		return true;
 	}
@@ -838,53 +919,115 @@ bool TileLoader::ShutDown()
 
 void TileLoader::TerminateLoadThread()
 {
-	if (hLoadThread) {
-		// Signal thread to stop and wait for it to happen
+	if (nLoadThreads) {
+		// Signal threads to stop and wait for it to happen
 		SetEvent(hStopThread);
-		WaitForSingleObject(hLoadThread, INFINITE); //4000);
+		WaitForMultipleObjects(nLoadThreads, hLoadThread, TRUE, INFINITE);
 		// Clean up for next run
 		ResetEvent(hStopThread);
-		CloseHandle(hLoadThread);
-		hLoadThread = NULL;
+		for (int i = 0; i < nLoadThreads; i++) {
+			CloseHandle(hLoadThread[i]);
+			hLoadThread[i] = NULL;
+		}
+		nLoadThreads = 0;
 	}
 }
 
 // -----------------------------------------------------------------------
 
-bool TileLoader::LoadTileAsync (Tile *tile)
+void TileLoader::HeapUp (int i)
 {
-	// Note: the queue should probably be sorted according to tile level
+	Tile *tile = queue[i];
+	while (i > 0) {
+		int parent = (i-1) >> 1;
+		if (!Before (tile, queue[parent])) break;
+		queue[i] = queue[parent];
+		queue[i]->qidx = i;
+		i = parent;
+	}
+	queue[i] = tile;
+	tile->qidx = i;
+}
 
-	int i, j;
+// -----------------------------------------------------------------------
 
-	// Check if request is already present
-	for (i = 0; i < nqueue; i++) {
-		j = (i+queue_out) % MAXQUEUE2;
-		if (queue[j].tile == tile)
-			return false;
+void TileLoader::HeapDown (int i)
+{
+	int n = (int)queue.size();
+	Tile *tile = queue[i];
+	for (;;) {
+		int child = 2*i+1;
+		if (child >= n) break;
+		if (child+1 < n && Before (queue[child+1], queue[child])) child++;
+		if (!Before (queue[child], tile)) break;
+		queue[i] = queue[child];
+		queue[i]->qidx = i;
+		i = child;
 	}
+	queue[i] = tile;
+	tile->qidx = i;
+}
 
-	if (nqueue == MAXQUEUE2) { // queue full
-		int maxlvl, maxlvl_idx = 0;
-		for (i = 1, maxlvl = queue[0].tile->lvl; i < nqueue; i++)
-			if (queue[i].tile->lvl > maxlvl)
-				maxlvl = queue[i].tile->lvl, maxlvl_idx = i;
-		if (maxlvl > tile->lvl) { // replace the highest level queued tile (load from lowest to highest)
-			queue[maxlvl_idx].tile->state = Tile::Invalid;
-			queue[maxlvl_idx].tile = tile;
-			tile->state = Tile::InQueue;
-		} else {
-			tile->state = Tile::Invalid;
-		}
+// -----------------------------------------------------------------------
+
+Tile *TileLoader::HeapRemove (int i)
+{
+	Tile *tile = queue[i];
+	Tile *last = queue.back();
+	queue.pop_back();
+	if (last != tile) {
+		queue[i] = last;
+		last->qidx = i;
+		if (i > 0 && Before (last, queue[(i-1) >> 1])) HeapUp (i);
+		else HeapDown (i);
+	}
+	tile->qidx = -1;
+	return tile;
+}
+
+// -----------------------------------------------------------------------
+
+Tile *TileLoader::Dequeue ()
+{
+	return queue.empty() ? NULL : HeapRemove (0);
+}
+
+// -----------------------------------------------------------------------
+
+bool TileLoader::LoadTileAsync (Tile *tile, float prio)
+{
+	DWORD frame = gc->GetScene()->GetFrameId();
+
+	if (tile->state == Tile::InQueue) { // already queued: re-prioritise
+		bool up = (frame != tile->qframe || prio > tile->qprio);
+		tile->qframe = frame;
+		tile->qprio = prio;
+		if (up) HeapUp (tile->qidx);
+		else HeapDown (tile->qidx);
 		return false;
 	}
 
+	tile->qframe = frame;
+	tile->qprio = prio;
+	tile->timing.Request();
+
+	if (maxqueue && queue.size() >= maxqueue) { // queue full
+		// the least urgent request is one of the leaves
+		int i, n = (int)queue.size(), minidx = n/2;
+		for (i = minidx+1; i < n; i++)
+			if (Before (queue[minidx], queue[i])) minidx = i;
+		if (!Before (tile, queue[minidx])) {
+			tile->state = Tile::Invalid; // try again next frame
+			return false;
+		}
+		HeapRemove (minidx)->state = Tile::Invalid;
+	}
+
 	// add tile to load queue
-	QUEUEDESC *qd = queue+queue_in;
-	qd->tile = tile;
+	queue.push_back (tile);
 	tile->state = Tile::InQueue;
-	nqueue++;
-	queue_in = (queue_in+1) % MAXQUEUE2;
+	HeapUp ((int)queue.size()-1);
+	SetEvent (hWork);
 	return true;
 }
 
@@ -892,101 +1035,137 @@ bool TileLoader::LoadTileAsync (Tile *tile)
 
 void TileLoader::Unqueue (TileManager2Base *mgr)
 {
-	bool locked = false; // whether a mutex semaphore was taken
-
-	bool found;
-	do {
-		int i, j;
-		found = false;
-		for (i = 0; i < nqueue; ++i) {
-			j = (queue_out+i) % MAXQUEUE2;
-			if (queue[j].tile->mgr == mgr) {
-				if (!locked) {
-					WaitForMutex();
-					locked = true;
-				}
-				if (i) {
-					queue[j].tile = queue[queue_out].tile;
-				}
-				queue_out = (queue_out+1) % MAXQUEUE2;
-				nqueue--;
-				found = true;
-				break;
-			}
-		}
-	} while (found);
-
-	if (locked) {
-		ReleaseMutex(); // ...if mutex was taken
+	WaitForMutex();
+	size_t i, n = 0;
+	for (i = 0; i < queue.size(); i++) {
+		if (queue[i]->mgr == mgr) queue[i]->qidx = -1, queue[i]->state = Tile::Invalid;
+		else queue[n++] = queue[i];
+	}
+	if (n < queue.size()) {
+		queue.resize(n);
+		for (i = n/2; i-- > 0; ) HeapDown ((int)i); // rebuild the heap
+		for (i = 0; i < n; i++) queue[i]->qidx = (int)i;
 	}
+	ReleaseMutex();
 }
 
 // -----------------------------------------------------------------------
 
 bool TileLoader::Unqueue (Tile *tile)
 {
-	if (tile->state != Tile::InQueue) return false;
+	if (tile->state != Tile::InQueue || tile->qidx < 0) return false;
 
-	int i, j;
-	for (i = 0; i < nqueue; i++) {
-		j = (queue_out+i) % MAXQUEUE2;
-		if (queue[j].tile == tile) {
-			WaitForMutex ();
-			if (i) {
-				queue[j].tile = queue[queue_out].tile;
-			}
-			queue_out = (queue_out+1) % MAXQUEUE2;
-			nqueue--;
-			ReleaseMutex ();
-			return true;
-		}
-	}
-	return false;
+	WaitForMutex ();
+	HeapRemove (tile->qidx)->state = Tile::Invalid;
+	ReleaseMutex ();
+	return true;
 }
 
 // -----------------------------------------------------------------------
-#ifdef UNDEF
-DWORD WINAPI TileLoader::Load_ThreadProc (void *data)
+
+void TileLoader::Publish (Tile *tile)
 {
-	TileLoader *loader = (TileLoader*)data;
-	DWORD idle = 1000/loader->load_frequency;
-	Tile *tile;
-	bool load;
+	Tile *head;
+	do {
+		head = done;
+		tile->qnext = head;
+	} while (InterlockedCompareExchangePointer ((PVOID volatile*)&done, tile, head) != head);
+	InterlockedIncrement (&nready);
+}
 
-	while (WAIT_OBJECT_0 != WaitForSingleObject(loader->hStopThread, idle)) {
+// -----------------------------------------------------------------------
 
-		WaitForMutex();
+void TileLoader::UpdateBudget (DWORD frame)
+{
+	if (frame == budgetframe) return;
+
+	double t = D3D9GetTime();
+	double dt = t - tframe;
+	if (tframe && dt < 1e6) { // ignore pauses
+		// Frame time target: as configured, or a little above what the frame needs without
+		// uploads (but at least 60 Hz), so the uploads only use the headroom
+		tbase = tbase ? tbase + 0.05*(dt - spent - tbase) : dt - spent;
+		double target = (Config->TileFrameTime > 0 ? Config->TileFrameTime*1e3 : max(1e6/60.0, 1.25*tbase));
+		if (dt > target) budget *= 0.5; // over budget: back off quickly
+		else budget += 250.0;           // headroom: allow a little more each frame
+		budget = min(budget, max(0.0, target - tbase));
+	}
+	budgetframe = frame;
+	tframe = t;
+	spent = 0.0;
+	nupload = 0;
+
+	// let the load threads run a few frames worth of uploads ahead, not more
+	int perframe = (tilecost > 0.0 ? int(budget/tilecost) : 4);
+	maxready = max(16, 4*perframe);
+}
 
-		if (load = (nqueue > 0)) {
-			tile = queue[queue_out].tile;
-			_ASSERT(TILE_STATE_OK(tile));			// THIS IS TRIGGERED OFTEN
-			if (tile->state == Tile::InQueue) {
-				tile->state = Tile::Loading; // lock tile and its ancestor tree
-			} else {
-				load = false;
-			}
-			queue_out = (queue_out+1) % MAXQUEUE2; // remove from queue
-			nqueue--;
+// -----------------------------------------------------------------------
+
+int TileLoader::LoadCompleted (bool bAll)
+{
+	if (!bAll) UpdateBudget (gc->GetScene()->GetFrameId());
+
+	if (done) {
+		// Take the whole list at once. There is a single consumer, so no ABA hazard.
+		Tile *list = (Tile*)InterlockedExchangePointer ((PVOID volatile*)&done, NULL);
+
+		// restore publishing order and append to the ready list
+		Tile *tile, *next, *fifo = NULL, *last = list;
+		for (tile = list; tile; tile = next) {
+			next = tile->qnext;
+			tile->qnext = fifo;
+			fifo = tile;
 		}
+		if (readytail) readytail->qnext = fifo;
+		else ready = fifo;
+		readytail = last;
+	}
 
-		ReleaseMutex();
+	// Upload within the frame's budget, but at least one tile per frame
+	int n = 0;
+	while (ready) {
+		if (!bAll && nupload && spent + tilecost > budget) break;
+		Tile *tile = ready;
+		ready = tile->qnext;
+		if (!ready) readytail = NULL;
+		tile->qnext = NULL;
+
+		tile->timing.Mark();
+		double t0 = tile->timing.tmark;
+		tile->Load(); // Create the actual tile texture from a pre-loaded data
+		tile->timing.Book (TileStats::UPLOAD);
+		tile->timing.tload = tile->timing.tmark; // RenderTiles reports the load
+		tile->state = Tile::Inactive; // unlock tile
+		InterlockedDecrement (&nready);
+
+		double cost = tile->timing.tload - t0;
+		tilecost = (tilecost > 0.0 ? tilecost + 0.2*(cost - tilecost) : cost);
+		spent += cost;
+		nupload++, n++;
+	}
+	if (nready < maxready) SetEvent (hReady);
+
+	D3D9Stats.Surf.Uploads += n;
+	D3D9Stats.Surf.Ready = (DWORD)nready;
+	D3D9Stats.Surf.UploadBudget = float(budget*1e-3);
+	return n;
+}
 
-		if (load) {
-			tile->PreLoad(); // Preload data from harddrive to system memory without a Mutex
+// -----------------------------------------------------------------------
 
-			WaitForMutex();
-			tile->Load(); // Create the actual tile texture from a pre-loaded data
-			tile->state = Tile::Inactive; // unlock tile
-			ReleaseMutex();
+void TileLoader::Flush (TileManager2Base *mgr)
+{
+	Unqueue (mgr);
 
-		}
-		else {
-			Sleep(1);
-		}
+	// Tiles of 'mgr' may still be pre-loading. Loaded tiles of other managers are
+	// simply finished early.
+	while (nflight) {
+		LoadCompleted (true);
+		Sleep (1);
 	}
-	return 0;
+	LoadCompleted (true);
 }
-#endif
 
 // -----------------------------------------------------------------------
 
@@ -995,37 +1174,47 @@ DWORD WINAPI TileLoader::Load_ThreadProc (void *data)
 	const int tile_packet_size = 8; // max number of tiles to process from queue
 	TileLoader *loader = (TileLoader*)data;
 	DWORD idle = 1000/loader->load_frequency;
+	HANDLE hWait[2] = { loader->hStopThread, loader->hWork };
+	HANDLE hWaitReady[2] = { loader->hStopThread, loader->hReady };
 	Tile *tile[tile_packet_size];
-	int nload, i;
+	int npacket, nload, i;
 
 	LogAlw("TileLoader::Load thread started");
 
-	bool bFirstRun = true;
-	while (bFirstRun || WAIT_OBJECT_0 != WaitForSingleObject(loader->hStopThread, idle))
-	{
-		bFirstRun = false;
+	for (;;) {
+		if (nready >= maxready) {
+			// the render thread is behind with the uploads: wait until it catches up
+			ResetEvent (loader->hReady);
+			if (nready >= maxready) {
+				if (WAIT_OBJECT_0 == WaitForMultipleObjects(2, hWaitReady, FALSE, idle)) break;
+				continue;
+			}
+		}
 
 		WaitForMutex ();
-		for (nload = 0; nqueue > 0 && nload < tile_packet_size; nload++) {
-			tile[nload] = queue[queue_out].tile;
+		// share the queue between the threads rather than letting one thread take it all
+		npacket = (int)(queue.size() + loader->nLoadThreads - 1) / loader->nLoadThreads;
+		if (npacket > tile_packet_size) npacket = tile_packet_size;
+		for (nload = 0; nload < npacket && (tile[nload] = Dequeue()); nload++)
 			tile[nload]->state = Tile::Loading; // lock tile and its ancestor tree
-			queue_out = (queue_out+1) % MAXQUEUE2; // remove from queue
-			nqueue--;
-		}
+		InterlockedExchangeAdd (&nflight, nload);
+		if (!queue.empty()) SetEvent (loader->hWork); // wake up the next thread
 		ReleaseMutex ();
 
 		if (nload) {
-			for (i = 0; i < nload; i++)
-				tile[i]->PreLoad(); // load/create the tile
-
-			WaitForMutex ();
+			// Pre-load without the mutex and hand the tiles over to the render thread,
+			// which creates the device resources in LoadCompleted()
 			for (i = 0; i < nload; i++) {
-				tile[i]->Load();
-				tile[i]->state = Tile::Inactive; // unlock tile
+				tile[i]->timing.Book (TileStats::QUEUE);
+				tile[i]->PreLoad();
+				Publish (tile[i]);
+				InterlockedDecrement (&nflight);
 			}
-			ReleaseMutex ();
+
+			if (WAIT_OBJECT_0 == WaitForSingleObject(loader->hStopThread, 0)) break;
 		} else {
-			Sleep (idle);
+			// nothing to do: sleep until tiles are queued, poll at the load frequency
+			if (WAIT_OBJECT_0 == WaitForMultipleObjects(2, hWait, FALSE, idle)) break;
 		}
 	}
 
@@ -1036,6 +1225,95 @@ DWORD WINAPI TileLoader::Load_ThreadProc (void *data)
 // =======================================================================
 // =======================================================================
 
+TileLodPool::TileLodPool (int nthreads)
+	: njobs(0), next(0), nleft(0), nThreads(0)
+	, hStop(CreateEvent (NULL, TRUE, FALSE, NULL))
+	, hGo(CreateSemaphore (NULL, 0, MAXLODTHREADS, NULL))
+	, hDone(CreateEvent (NULL, FALSE, FALSE, NULL))
+{
+	DWORD id;
+	nthreads = max(0, min(MAXLODTHREADS, nthreads));
+	for (int i = 0; i < nthreads; i++) {
+		hThread[nThreads] = CreateThread (NULL, 65536, Lod_ThreadProc, this, 0, &id);
+		if (hThread[nThreads]) nThreads++;
+	}
+	jobs.reserve(256);
+	LogAlw("TileLodPool: %d worker threads", nThreads);
+}
+
+// -----------------------------------------------------------------------
+
+TileLodPool::~TileLodPool ()
+{
+	ShutDown();
+	CloseHandle (hStop);
+	CloseHandle (hGo);
+	CloseHandle (hDone);
+}
+
+// -----------------------------------------------------------------------
+
+void TileLodPool::ShutDown ()
+{
+	if (nThreads) {
+		SetEvent(hStop);
+		WaitForMultipleObjects(nThreads, hThread, TRUE, INFINITE);
+		ResetEvent(hStop);
+		for (int i = 0; i < nThreads; i++) {
+			CloseHandle(hThread[i]);
+			hThread[i] = NULL;
+		}
+		nThreads = 0;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void TileLodPool::Run ()
+{
+	njobs = (LONG)jobs.size();
+	next = 0;
+	if (nThreads && njobs > 1) {
+		// every worker takes one count of the semaphore, the last one to finish signals
+		// hDone. No worker touches the batch after that.
+		nleft = nThreads;
+		ReleaseSemaphore (hGo, nThreads, NULL);
+		Work();
+		WaitForSingleObject (hDone, INFINITE);
+	} else {
+		Work();
+	}
+	jobs.clear();
+}
+
+// -----------------------------------------------------------------------
+
+void TileLodPool::Work ()
+{
+	LONG i;
+	while ((i = InterlockedIncrement(&next) - 1) < njobs) {
+		const Job &job = jobs[i];
+		job.fn (job.mgr, job.node);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+DWORD WINAPI TileLodPool::Lod_ThreadProc (void *data)
+{
+	TileLodPool *pool = (TileLodPool*)data;
+	HANDLE hWait[2] = { pool->hStop, pool->hGo };
+
+	while (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) == WAIT_OBJECT_0+1) {
+		pool->Work();
+		if (!InterlockedDecrement(&pool->nleft)) SetEvent(pool->hDone);
+	}
+	return 0;
+}
+
+// =======================================================================
+// =======================================================================
+
 TileManager2Base::ConfigPrm TileManager2Base::cprm = {
 	2,                  // elevInterpol
 	false,				// bSpecular
@@ -1047,6 +1325,11 @@ TileLoader *TileManager2Base::loader = NULL;
 double TileManager2Base::resolutionBias = 4.0;
 double TileManager2Base::resolutionScale = 1.0;
 bool TileManager2Base::bTileLoadThread = true;
+TileLodPool *TileManager2Base::lodpool = NULL;
+Tile *TileManager2Base::parkhead = NULL;
+Tile *TileManager2Base::parktail = NULL;
+size_t TileManager2Base::parkgpu = 0;
+size_t TileManager2Base::parksys = 0;
 HFONT TileManager2Base::hFont = NULL;
 
 // -----------------------------------------------------------------------
@@ -1056,6 +1339,13 @@ TileManager2Base::TileManager2Base (const vPlanet *vplanet, int _maxres, int _gr
 {
 	// set persistent parameters
 	prm.maxlvl = max (0, _maxres-4);
+	camhist.n = camhist.head = 0;
+	pass = 0;
+	memset (nindexed, 0, sizeof(nindexed));
+	lodepoch = 1;
+	lodtanap = lodbias = lodscale = 0.0;
+	lodmaxlvl = -1;
+	memset (&cullframe, 0, sizeof(cullframe));
 	obj = vp->Object();
 	obj_size = oapiGetSize (obj);
 	oapiGetObjectName (obj, cbody_name, 256);
@@ -1113,7 +1403,12 @@ void TileManager2Base::GlobalInit (class oapi::D3D9Client *gclient)
 	cprm.tileLoadFlags = Config->PlanetTileLoadFlags;
 	bTileLoadThread = *(bool*)gclient->GetConfigParam(CFGPRM_TILELOADTHREAD);
 
+	ZTreeMgr::SetMapping(Config->TileArchiveMapping != 0);
+	ZTreeCache::Global().SetBudget((__int64)Config->TileArchiveCache << 20);
+
 	loader = new TileLoader (gc);
+	if (Config->TileLodThreads) lodpool = new TileLodPool (Config->TileLodThreads);
+	LogAlw("Tile frustum test: %s", TileCullKernel());
 
 	hFont  = CreateFont(42, 0, 0, 0, 600, false, false, 0, 0, 0, 2, CLEARTYPE_QUALITY, 49, "Arial");
 }
@@ -1122,6 +1417,8 @@ void TileManager2Base::GlobalInit (class oapi::D3D9Client *gclient)
 
 bool TileManager2Base::ShutDown()
 {
+	ZTreePrefetch::Global().ShutDown();
+	if (lodpool) lodpool->ShutDown();
 	return loader->ShutDown();
 }
 
@@ -1131,6 +1428,7 @@ void TileManager2Base::GlobalExit ()
 {
 	DeleteObject(hFont); hFont = NULL;
 	delete loader;
+	delete lodpool; lodpool = NULL;
 }
 
 // -----------------------------------------------------------------------
@@ -1164,12 +1462,335 @@ void TileManager2Base::SetRenderPrm (MATRIX4 &dwmat, double prerot, bool use_zbu
 	prm.sdir = tmul (prm.grot, -obj_pos);  // sun's direction in planet frame
 	normalise (prm.sdir);
 	// Add 5km threshold to allow slight camera movement with out causing surface tiles to unload
-	prm.viewap = acos (1.0/(max ((cdist+5e3) / obj_size, 1.0+minalt)));
+	prm.viewap = TileLodViewAp ((cdist+5e3) / obj_size, minalt);
 	prm.scale = 1.0;
 }
 
 // -----------------------------------------------------------------------
 
+int TileManager2Base::TargetLevel (const Tile *tile, double adist, double cdist, double viewap, double *tdist, double *margin) const
+{
+	TileLodParam lp;
+	lp.bias = DebugControls::resbias;			// 2 to 6, default 4
+	lp.tanap = GetScene()->GetTanAp();
+	lp.rscale = resolutionScale;
+	lp.radius = obj_size;
+	lp.maxlvl = prm.maxlvl;
+	//if (DebugControls::IsEquEnabled()) lp.maxlvl += 2;
+	return TileLodTarget (&lp, tile->lvl, tile->ilat, tile->GetMaxElev(), adist, cdist, viewap, tdist, margin);
+}
+
+// -----------------------------------------------------------------------
+
+MATRIX4 TileManager2Base::TileWorldMatrix (const Tile *tile) const
+{
+	// mul(lrot, prm.dwmat), with the tile origin offset rotated into place by the rows of dwmat
+	const MATRIX4 &W = prm.dwmat;
+	double c = tile->lcos, s = tile->lsin;
+	const VECTOR3 &d = tile->loff;
+	MATRIX4 M;
+	M.m11 = c*W.m11 + s*W.m31;  M.m12 = c*W.m12 + s*W.m32;  M.m13 = c*W.m13 + s*W.m33;  M.m14 = c*W.m14 + s*W.m34;
+	M.m21 = W.m21;              M.m22 = W.m22;              M.m23 = W.m23;              M.m24 = W.m24;
+	M.m31 = c*W.m31 - s*W.m11;  M.m32 = c*W.m32 - s*W.m12;  M.m33 = c*W.m33 - s*W.m13;  M.m34 = c*W.m34 - s*W.m14;
+	M.m41 = d.x*W.m11 + d.y*W.m21 + d.z*W.m31 + W.m41;
+	M.m42 = d.x*W.m12 + d.y*W.m22 + d.z*W.m32 + W.m42;
+	M.m43 = d.x*W.m13 + d.y*W.m23 + d.z*W.m33 + W.m43;
+	M.m44 = d.x*W.m14 + d.y*W.m24 + d.z*W.m34 + W.m44;
+	return M;
+}
+
+// -----------------------------------------------------------------------
+
+bool TileManager2Base::LodValid (const Tile *tile) const
+{
+	if (tile->lodepoch != lodepoch) return false;
+
+	// The angular distance of the tile changes by no more than the angle 'theta' between the
+	// old and new camera directions (bounded by its chord), the tile distance by no more than
+	// the camera displacement D (it is the distance to a fixed cap)
+	VECTOR3 dc = prm.cdir - tile->lodcdir;
+	double theta = PI05 * sqrt(dotp (dc, dc));
+	double dviewap = fabs(prm.viewap - tile->lodviewap);
+	if (theta + dviewap >= tile->lodhmargin) return false;
+	if (tile->lodhorizon) return true;
+
+	double D = length (prm.cdir*prm.cdist - tile->lodcdir*tile->lodcdist);
+	if (D >= tile->lodtdist) return false;
+
+	// bound of the change of the level metric: 2*sqrt(adist/viewap) and TileLodResScale*log(tdist)
+	double dlvl = 2.0 * (sqrt(theta/prm.viewap) + sqrt(tile->lodadist)*fabs(1.0/sqrt(prm.viewap) - 1.0/sqrt(tile->lodviewap)))
+		+ TileLodResScale * D/(tile->lodtdist - D);
+	return dlvl < tile->lodlmargin;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::EvaluateTile (Tile *tile, bool bcull)
+{
+	int lvl = tile->lvl;
+	int nlat = 1 << lvl;
+
+	if (Config->TileLodIncremental) tile->dmWorld = TileWorldMatrix(tile);
+	else tile->dmWorld = WorldMatrix(tile->ilng, 2*nlat, tile->ilat, nlat);
+	MATRIX4toD3DMATRIX(tile->dmWorld, tile->mWorld);
+
+	// The horizon and split decisions of the last full evaluation hold as long as the camera
+	// hasn't moved enough to cross either threshold
+	if (!Config->TileLodIncremental || !LodValid (tile)) {
+		// check if patch is visible from camera position
+		double adist = TileLodAngle (lvl, dotp (prm.cdir, tile->cnt)); // angle between closest tile corner and camera
+		tile->lodhorizon = (adist >= prm.viewap);
+		tile->lodhmargin = fabs(adist - prm.viewap);
+
+		// Compute target resolution level based on tile distance
+		if (!tile->lodhorizon) {
+			double tdist;
+			tile->lodtgt = TargetLevel (tile, adist, prm.cdist, prm.viewap, &tdist, &tile->lodlmargin);
+			// Resolution deficit (log2 of the screen-space error) first, closer tiles break ties
+			tile->lodprio = float(tile->lodtgt - lvl) + float(1.0 / (1.0 + tdist));
+			tile->lodadist = max(0.0, adist);
+			tile->lodtdist = tdist;
+		} else {
+			tile->lodtgt = -1;
+			tile->lodprio = 0.0f;
+		}
+		tile->lodcdir = prm.cdir;
+		tile->lodcdist = prm.cdist;
+		tile->lodviewap = prm.viewap;
+		tile->lodepoch = lodepoch;
+	}
+
+	tile->lodpass = pass;
+
+	// Check if patch bounding box intersects viewport (the view direction may change any time)
+	if (bcull) CullTiles (&tile, 1);
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::CullTiles (Tile *const *tile, int n)
+{
+	const TileCullBox *box[16];
+	bool inview[16];
+	Tile *test[16];
+	int i, j, ntest = 0;
+
+	for (i = 0; i <= n; i++) {
+		if (ntest == 16 || (i == n && ntest)) {
+			TileCull (&cullframe, box, ntest, inview);
+			for (j = 0; j < ntest; j++) test[j]->lodinview = inview[j];
+			ntest = 0;
+		}
+		if (i == n) break;
+
+		Tile *t = tile[i];
+		if (t->lodhorizon) t->lodinview = false;
+		else if (!t->lvl || !t->mesh) t->lodinview = true; // as Tile::InView
+		else {
+			if (!t->cullok) {
+				// mesh bounding box in the planet frame (the tile frame is fixed, see TileWorldMatrix)
+				double corner[8][3];
+				for (j = 0; j < 8; j++) {
+					const VECTOR4 &b = t->mesh->Box[j];
+					corner[j][0] = t->lcos*b.x - t->lsin*b.z + t->loff.x;
+					corner[j][1] = b.y + t->loff.y;
+					corner[j][2] = t->lsin*b.x + t->lcos*b.z + t->loff.z;
+				}
+				TileCullSetBox (&t->cullbox, corner);
+				t->cullok = true;
+			}
+			test[ntest] = t;
+			box[ntest++] = &t->cullbox;
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::Park (Tile *tile)
+{
+	tile->lprev = NULL;
+	tile->lnext = parkhead;
+	if (parkhead) parkhead->lprev = tile;
+	else parktail = tile;
+	parkhead = tile;
+	tile->parked = true;
+	parkgpu += tile->pgpu;
+	parksys += tile->psys;
+	D3D9Stats.TilesParked++;
+	D3D9Stats.ParkedGPU = (DWORD)parkgpu;
+	D3D9Stats.ParkedSys = (DWORD)parksys;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::Unpark (Tile *tile)
+{
+	if (tile->lprev) tile->lprev->lnext = tile->lnext;
+	else parkhead = tile->lnext;
+	if (tile->lnext) tile->lnext->lprev = tile->lprev;
+	else parktail = tile->lprev;
+	tile->lprev = tile->lnext = NULL;
+	tile->parked = false;
+	parkgpu -= tile->pgpu;
+	parksys -= tile->psys;
+	D3D9Stats.TilesParked--;
+	D3D9Stats.ParkedGPU = (DWORD)parkgpu;
+	D3D9Stats.ParkedSys = (DWORD)parksys;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::TrimCache ()
+{
+	size_t maxgpu = size_t(Config->TileCacheGPU) << 20;
+	size_t maxsys = size_t(Config->TileCacheSys) << 20; // 0: no limit
+	if (parkgpu <= maxgpu && (!maxsys || parksys <= maxsys)) return;
+
+	// Over budget: trim to 90%, so that this doesn't run again next frame. Subtrees still
+	// near the view go last, a camera panning back and forth finds them in place.
+	size_t lowgpu = maxgpu / 10 * 9, lowsys = maxsys / 10 * 9;
+	for (int pass = 0; pass < 2; pass++) {
+		Tile *tile, *prev;
+		for (tile = parktail; tile && (parkgpu > lowgpu || (maxsys && parksys > lowsys)); tile = prev) {
+			prev = tile->lprev;
+			if (!pass) {
+				const RenderPrm &p = tile->mgr->prm;
+				double adist = TileLodAngle (tile->lvl, dotp (p.cdir, tile->cnt));
+				if (adist < 1.25*p.viewap) continue;
+			}
+			Unpark (tile);
+			tile->ReleaseSubtree ();
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
+static inline UINT64 SpreadBits (DWORD x)
+{
+	UINT64 v = x;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+	v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+	v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+	v = (v | (v << 2))  & 0x3333333333333333ull;
+	v = (v | (v << 1))  & 0x5555555555555555ull;
+	return v;
+}
+
+UINT64 TileManager2Base::TileKey (int lvl, int ilat, int ilng)
+{
+	// interleaved ilng (lvl+1 bits) and ilat (lvl bits), below a marker bit giving the level
+	return (UINT64(1) << (2*lvl+1)) | SpreadBits(ilng) | (SpreadBits(ilat) << 1);
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::IndexTile (Tile *tile)
+{
+	if (tile->lvl >= TILEINDEX_NLVL) return;
+	Tile *&entry = tileindex[TileKey (tile->lvl, tile->ilat, tile->ilng)];
+	if (!entry) nindexed[tile->lvl]++;
+	entry = tile;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::UnindexTile (Tile *tile)
+{
+	if (tile->lvl >= TILEINDEX_NLVL) return;
+	auto it = tileindex.find (TileKey (tile->lvl, tile->ilat, tile->ilng));
+	if (it != tileindex.end() && it->second == tile) {
+		tileindex.erase (it);
+		nindexed[tile->lvl]--;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+Tile *TileManager2Base::IndexedTile (int lvl, int ilat, int ilng) const
+{
+	if (lvl < 0 || lvl >= TILEINDEX_NLVL) return NULL;
+	auto it = tileindex.find (TileKey (lvl, ilat, ilng));
+	return (it != tileindex.end() ? it->second : NULL);
+}
+
+// -----------------------------------------------------------------------
+
+int TileManager2Base::IndexedLevel (int maxlvl) const
+{
+	int lvl = min (maxlvl, TILEINDEX_NLVL-1);
+	while (lvl > 0 && !nindexed[lvl]) lvl--;
+	return lvl;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::TileIndex (double lng, double lat, int lvl, int *ilat, int *ilng)
+{
+	int nlat = 1 << lvl;
+	int nlng = 2 << lvl;
+	*ilat = max (0, min (nlat-1, int((PI05 - lat) / PI * nlat)));
+	*ilng = max (0, min (nlng-1, int((lng + PI) / PI2 * nlng)));
+}
+
+// -----------------------------------------------------------------------
+
+Tile *TileManager2Base::VisitedTile (int lvl, int ilat, int ilng) const
+{
+	// The tiles visited by the latest pass form the active part of the tree, the finest of them
+	// is where a descent from the root through the active tiles ends. Tiles that weren't visited
+	// may still carry an active state from an earlier pass.
+	for (int l = IndexedLevel (lvl); l >= 0; l--) {
+		Tile *tile = IndexedTile (l, ilat >> (lvl-l), ilng >> (lvl-l));
+		if (tile && tile->pass == pass) return tile;
+	}
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+
+void TileManager2Base::RecordCamera ()
+{
+	double t = oapiGetSysTime();
+	VECTOR3 pos = prm.cdir * prm.cdist;
+
+	if (camhist.n) {
+		int last = (camhist.head + CAMHISTORY - 1) % CAMHISTORY;
+		if (t <= camhist.t[last]) return; // same frame
+		// restart after a pause or a camera jump (view change, focus switch)
+		if (t - camhist.t[last] > 1.0 || length(pos - camhist.pos[last]) > 0.1 * prm.cdist) camhist.n = 0;
+	}
+	camhist.t[camhist.head] = t;
+	camhist.pos[camhist.head] = pos;
+	camhist.head = (camhist.head + 1) % CAMHISTORY;
+	if (camhist.n < CAMHISTORY) camhist.n++;
+}
+
+// -----------------------------------------------------------------------
+
+bool TileManager2Base::PredictCamera (double dt, VECTOR3 *cdir, double *cdist) const
+{
+	if (camhist.n < 2) return false;
+
+	// mean velocity over the history window
+	int last  = (camhist.head + CAMHISTORY - 1) % CAMHISTORY;
+	int first = (camhist.head + CAMHISTORY - camhist.n) % CAMHISTORY;
+	double t = camhist.t[last] - camhist.t[first];
+	if (t <= 0.0) return false;
+	VECTOR3 step = (camhist.pos[last] - camhist.pos[first]) * (dt / t);
+	if (length(step) * obj_size < 1.0) return false; // less than a metre
+
+	VECTOR3 pos = camhist.pos[last] + step;
+	double d = length(pos);
+	if (d < 1e-6) return false;
+	*cdir = pos / d;
+	*cdist = max(d, 1.0); // not below the surface
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
 void TileManager2Base::ResetMinMaxElev()
 {
 	min_elev = 0.0;
@@ -1225,10 +1846,11 @@ MATRIX4 TileManager2Base::WorldMatrix (int ilng, int nlng, int ilat, int nlat)
 		double dx = s*cos(lng)*cos(lat); // the offsets between sphere centre and tile corner
 		double dy = s*sin(lat);
 		double dz = s*sin(lng)*cos(lat);
-		prm.dwmat_tmp.m41 = (dx*prm.grot.m11 + dy*prm.grot.m12 + dz*prm.grot.m13 + prm.cpos.x) * (float)prm.scale;
-		prm.dwmat_tmp.m42 = (dx*prm.grot.m21 + dy*prm.grot.m22 + dz*prm.grot.m23 + prm.cpos.y) * (float)prm.scale;
-		prm.dwmat_tmp.m43 = (dx*prm.grot.m31 + dy*prm.grot.m32 + dz*prm.grot.m33 + prm.cpos.z) * (float)prm.scale;
-		return mul(lrot,prm.dwmat_tmp);
+		MATRIX4 dwmat = prm.dwmat_tmp;   // local copy, the LOD workers call this concurrently
+		dwmat.m41 = (dx*prm.grot.m11 + dy*prm.grot.m12 + dz*prm.grot.m13 + prm.cpos.x) * (float)prm.scale;
+		dwmat.m42 = (dx*prm.grot.m21 + dy*prm.grot.m22 + dz*prm.grot.m23 + prm.cpos.y) * (float)prm.scale;
+		dwmat.m43 = (dx*prm.grot.m31 + dy*prm.grot.m32 + dz*prm.grot.m33 + prm.cpos.z) * (float)prm.scale;
+		return mul(lrot,dwmat);
 	}
 }
 
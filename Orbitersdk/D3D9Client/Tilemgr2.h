@@ -21,12 +21,19 @@
 #include "D3D9Pad.h"
 #include "Qtree.h"
 #include "ZTreeMgr.h"
+#include "TileStats.h"
+#include "TileCull.h"
+#include "TileLod.h"
 #include <stack>
 #include <vector>
 #include <list>
+#include <unordered_map>
 
 #define NPOOLS 32
-#define MAXQUEUE2 20
+#define MAXLOADTHREADS 16
+#define MAXLODTHREADS 8
+#define CAMHISTORY 8
+#define TILEINDEX_NLVL 31  // tile levels covered by the tile index (64 bit Morton codes)
 
 #define TILE_VALID  0x0001
 #define TILE_ACTIVE 0x0002
@@ -63,6 +70,8 @@ typedef union {
 	};
 } TILEBOUNDS;
 
+struct ElevGrid;
+
 // =======================================================================
 
 /**
@@ -91,6 +100,9 @@ public:
 	bool PreDelete();
 	// Prepare tile for deletion. Return false if tile is locked
 
+	void ReportTiming();
+	// Submit the stage latencies of the tile's last asynchronous load to TileStats
+
 	bool InView (const MATRIX4 &transform);
 	// tile in view of camera, given by transformation matrix 'transform'?
 
@@ -143,7 +155,15 @@ protected:
 	virtual double GetMinElev() const = 0;
 	virtual double GetMaxElev() const = 0;
 	virtual double GetMeanElev() const = 0;
-	
+
+	virtual const char *LayerName() const = 0;
+	// Layer name used in the load statistics
+
+	virtual void MemoryUse (size_t *gpu, size_t *sys) const;
+	// Add the tile's video and system memory [bytes] to *gpu and *sys
+
+	virtual void ReleaseSubtree () = 0;
+	// Delete the tiles below this one (locked tiles stay)
 
 	/**
 	 * \brief Preloades a surface tile data into a system memory from a tile loader thread
@@ -151,7 +171,7 @@ protected:
 	virtual void PreLoad() = 0;
 
 	/**
-	 * \brief Construct a surface tile textures from a preloaded data /see virtual bool PreLoad()
+	 * \brief Construct a surface tile textures and upload the mesh from a preloaded data /see virtual bool PreLoad()
 	 */
 	virtual void Load () = 0;
 
@@ -161,10 +181,10 @@ protected:
 
 	VBMESH *CreateMesh_quadpatch (int grdlat, int grdlng, float *elev=0, double elev_scale = 1.0, double globelev=0.0,
 		const TEXCRDRANGE2 *range=0, bool shift_origin=false, VECTOR3 *shift=0, double bb_excess=0.0);
-	// Creates a quadrilateral patch mesh
+	// Creates a quadrilateral patch mesh in system memory (upload with VBMESH::MapVertices)
 
 	VBMESH *CreateMesh_hemisphere (int grd, float *elev=0, double globelev=0.0);
-	// Creates a hemisphere mesh for eastern or western hemisphere at resolution level 4
+	// Creates a hemisphere mesh for eastern or western hemisphere at resolution level 4 (system memory)
 
 	TileManager2Base *mgr;     // the manager this tile is associated with
 	int lvl;                   // tile resolution level
@@ -189,6 +209,32 @@ protected:
 	TileState state;           // tile load/active/render state flags
 	int lngnbr_lvl, latnbr_lvl, dianbr_lvl; // neighbour levels to which edges have been adapted
 	DWORD FrameId;
+	int qidx;                  // position in the loader's priority queue, -1 if not queued
+	Tile *qnext;               // next tile in the loader's completion list
+	DWORD qframe;              // frame of the latest load request
+	float qprio;               // load priority of the latest request (higher loads first)
+	TileTiming timing;         // stage timestamps of the latest asynchronous load
+	Tile *lprev, *lnext;       // neighbours in the list of parked subtrees
+	bool parked;               // root of a parked (inactive, cached) subtree
+	size_t pgpu, psys;         // memory held by the parked subtree [bytes]
+	DWORD pass;                // latest ProcessNode pass that visited the tile
+	DWORD lodpass;             // pass the LOD values below were evaluated for
+	bool lodhorizon;           // beyond the horizon
+	bool lodinview;            // intersects the view frustum
+	int lodtgt;                // target resolution level (if not beyond the horizon)
+	float lodprio;             // load priority of the subtiles (if not beyond the horizon)
+	DWORD lodepoch;            // LOD parameter set of the last full evaluation, 0: none
+	VECTOR3 lodcdir;           // camera direction at the last full evaluation
+	double lodcdist;           // camera distance at the last full evaluation [planet radii]
+	double lodviewap;          // visible cap aperture at the last full evaluation
+	double lodadist;           // angular distance of the tile (>= 0) at the last full evaluation
+	double lodtdist;           // tile distance at the last full evaluation [planet radii]
+	double lodhmargin;         // margin of the horizon decision [rad]
+	double lodlmargin;         // margin of the split decision [levels]
+	double lcos, lsin;         // tile frame: rotation about the planet axis
+	VECTOR3 loff;              // tile frame: origin in the planet frame [m]
+	TileCullBox cullbox;       // mesh bounding box in the planet frame, for the frustum test
+	bool cullok;               // cullbox is set up
 	float width;			   // tile width [rad] (widest section i.e base)
 	float height;			   // tile height [rad]
 	
@@ -211,7 +257,11 @@ class TileLoader {
 public:
 	explicit TileLoader (const oapi::D3D9Client *gclient);
 	~TileLoader ();
-	bool LoadTileAsync (Tile *tile);
+	bool LoadTileAsync (Tile *tile, float prio = 0.0f);
+	// queue a tile for loading, or refresh its priority if it is queued already.
+	// Tiles requested in the current frame load first, then by decreasing 'prio'
+	// (caller must own hLoadMutex)
+
 	bool ShutDown ();
 
 	bool Unqueue (Tile *tile);
@@ -220,20 +270,59 @@ public:
 	void Unqueue (TileManager2Base *mgr);
 	// removes all tiles of a manager from the load queue (caller must own hLoadMutex)
 
+	int LoadCompleted (bool bAll = false);
+	// render thread: finish (Tile::Load) tiles pre-loaded by the load threads, as many as
+	// the frame's upload budget allows (all of them if bAll). Returns the number of tiles finished
+
+	void Flush (TileManager2Base *mgr);
+	// render thread: unqueue the manager's tiles and wait for the ones in flight, so that
+	// none of its tiles is left locked (call before deleting the tree)
+
 	inline static DWORD WaitForMutex() { return ::WaitForSingleObject (hLoadMutex, INFINITE); }
 	inline static BOOL ReleaseMutex() { return ::ReleaseMutex (hLoadMutex); }
 
 private:
-	void TerminateLoadThread(); // Terminates the Load thread
-
-	static struct QUEUEDESC {
-		Tile *tile;
-	} queue[MAXQUEUE2];
+	void TerminateLoadThread(); // Terminates the Load threads
+
+	// Load queue: binary max-heap of tiles, each tile knows its own heap slot (Tile::qidx)
+	static inline bool Before (const Tile *a, const Tile *b)
+	{
+		return a->qframe != b->qframe ? (int)(a->qframe - b->qframe) > 0 : a->qprio > b->qprio;
+	}
+	static void HeapUp (int i);
+	static void HeapDown (int i);
+	static Tile *HeapRemove (int i);
+	static Tile *Dequeue ();
+
+	static std::vector<Tile*> queue;
+	static size_t maxqueue; // queue capacity, 0 = unbounded
+
+	// Completion list: lock-free LIFO of pre-loaded tiles (linked through Tile::qnext),
+	// pushed by the load threads and emptied in one swap by the render thread
+	static void Publish (Tile *tile);
+	static Tile * volatile done;
+	static volatile LONG nflight; // tiles taken from the queue but not published yet
+	static volatile LONG nready;  // tiles published but not uploaded yet
+	static volatile LONG maxready; // load threads pause while nready is at this limit
+
+	// Upload throttling (render thread only): the time spent in Tile::Load per frame
+	// adapts to the frame time, the tiles over budget wait in the ready list
+	void UpdateBudget (DWORD frame);
+	Tile *ready, *readytail; // FIFO of tiles taken from the completion list, not uploaded yet
+	DWORD budgetframe;  // frame the budget was last updated for
+	int   nupload;      // tiles uploaded in budgetframe
+	double tframe;      // start of budgetframe [us]
+	double tbase;       // frame time without uploads, slow average [us]
+	double budget;      // upload time allowed per frame [us]
+	double spent;       // upload time spent in budgetframe [us]
+	double tilecost;    // upload time per tile, average [us]
 
 	const oapi::D3D9Client *gc; // the client
-	static int nqueue, queue_in, queue_out;
-	HANDLE hLoadThread; // Load ThreadProc handle
-	HANDLE hStopThread; // Thread kill signal handle
+	HANDLE hLoadThread[MAXLOADTHREADS]; // Load ThreadProc handles
+	int nLoadThreads;   // number of running load threads
+	HANDLE hStopThread; // Thread kill signal handle (manual reset, seen by all threads)
+	HANDLE hWork;       // signalled when tiles are queued
+	HANDLE hReady;      // set while the ready list has room (manual reset)
 	static HANDLE hLoadMutex;
 	static DWORD WINAPI Load_ThreadProc (void*);
 	int load_frequency;
@@ -241,6 +330,53 @@ private:
 
 // =======================================================================
 
+/**
+ * \brief Worker threads of the LOD selection pass
+ *
+ * Runs a batch of jobs (quadtree subtrees to evaluate) on the worker threads
+ * and the calling thread, and returns when all of them are done.
+ */
+class TileLodPool {
+public:
+	typedef void (*JobFunc)(TileManager2Base *mgr, void *node);
+
+	explicit TileLodPool (int nthreads);
+	~TileLodPool ();
+
+	inline void Add (JobFunc fn, TileManager2Base *mgr, void *node)
+	{ Job job = { fn, mgr, node }; jobs.push_back (job); }
+	// add a job to the next batch
+
+	void Run ();
+	// run the batch and wait for it to complete
+
+	void ShutDown ();
+	// stop the worker threads, later batches run on the calling thread
+
+	inline int Threads () const { return nThreads; }
+
+private:
+	struct Job {
+		JobFunc fn;
+		TileManager2Base *mgr;
+		void *node;
+	};
+	void Work ();
+
+	std::vector<Job> jobs;     // the batch
+	volatile LONG njobs;       // size of the running batch
+	volatile LONG next;        // next job to take
+	volatile LONG nleft;       // workers that haven't finished with the batch
+	HANDLE hThread[MAXLODTHREADS];
+	int nThreads;
+	HANDLE hStop;              // stop signal (manual reset)
+	HANDLE hGo;                // semaphore, one count per worker and batch
+	HANDLE hDone;              // set by the last worker done with the batch
+	static DWORD WINAPI Lod_ThreadProc (void*);
+};
+
+// =======================================================================
+
 
 namespace eElevMode {
 	const int DontCare = 0x0;
@@ -334,14 +470,27 @@ public:
 
 
 	template<class TileType>
-	QuadTreeNode<TileType> *FindNode (QuadTreeNode<TileType> root[2], int lvl, int ilat, int ilng);
-	// Returns the node at the specified position, or 0 if it doesn't exist
+	QuadTreeNode<TileType> *FindNode (int lvl, int ilat, int ilng) const;
+	// Returns the node at the specified position, or its closest active ancestor.
+	// Returns 0 if the position is hidden by an invisible ancestor.
+
+	template<class TileType>
+	void SelectTiles (QuadTreeNode<TileType> root[2]);
+	// start a new ProcessNode pass, and evaluate the LOD of the tiles it will visit on the
+	// LOD worker threads (caller must own hLoadMutex)
 
 	template<class TileType>
 	void ProcessNode (QuadTreeNode<TileType> *node);
+	// update the tree and collect the tiles to render in the render list
 
 	template<class TileType>
-	void RenderNode (QuadTreeNode<TileType> *node);
+	void PrefetchTiles (QuadTreeNode<TileType> root[2]);
+	// queue the tiles needed by the camera positions extrapolated from its recent motion
+	// (main render pass only, caller must own hLoadMutex)
+
+	template<class TileType>
+	void RenderTiles ();
+	// render the tiles of the render list
 
 	template<class TileType>
 	void QueryTiles(QuadTreeNode<TileType> *node, std::list<Tile*> &tiles);
@@ -385,9 +534,95 @@ protected:
 	MATRIX4 WorldMatrix(Tile *tile);
 
 	template<class TileType>
-	QuadTreeNode<TileType> *LoadChildNode (QuadTreeNode<TileType> *node, int idx);
+	QuadTreeNode<TileType> *LoadChildNode (QuadTreeNode<TileType> *node, int idx, float prio = 0.0f);
 	// loads one of the four subnodes of 'node', given by 'idx'
 
+	void EvaluateTile (Tile *tile, bool bcull = true);
+	// LOD selection for a tile: world matrix, visibility and target level (Tile::lod*).
+	// Without 'bcull' the frustum test is left to a following CullTiles call
+
+	void CullTiles (Tile *const *tile, int n);
+	// frustum test of n evaluated tiles in one batch (Tile::lodinview)
+
+	template<class TileType>
+	void EvaluateNodes (QuadTreeNode<TileType> *const *node, int n);
+	// EvaluateTile for n nodes, with their frustum tests batched
+
+	template<class TileType>
+	bool Descends (QuadTreeNode<TileType> *node) const;
+	// whether ProcessNode continues with the subtiles of an evaluated node
+
+	template<class TileType>
+	void SelectNode (QuadTreeNode<TileType> *node);
+	// evaluate the part of the subtree below an evaluated node ProcessNode will visit, without changing the tree
+
+	template<class TileType>
+	static void SelectJob (TileManager2Base *mgr, void *node)
+	{ mgr->SelectNode (static_cast<QuadTreeNode<TileType>*>(node)); }
+
+	int TargetLevel (const Tile *tile, double adist, double cdist, double viewap, double *tdist, double *margin = NULL) const;
+	// LOD metric: target resolution level for a tile at angular distance 'adist' from a camera at
+	// 'cdist' [planet radii] with visible cap aperture 'viewap'. Returns the tile distance in 'tdist',
+	// and in 'margin' how far (in levels) the metric is from changing the tile's split decision
+
+	MATRIX4 TileWorldMatrix (const Tile *tile) const;
+	// world matrix of a tile, from its planet frame transformation (same as WorldMatrix(tile))
+
+	bool LodValid (const Tile *tile) const;
+	// whether the camera moved too little since the tile's last full LOD evaluation for its
+	// horizon and split decisions to change
+
+	void RecordCamera ();
+	// append the current camera position to the motion history
+
+	bool PredictCamera (double dt, VECTOR3 *cdir, double *cdist) const;
+	// extrapolate the camera position 'dt' seconds ahead, false if the camera is (nearly) at rest
+
+	template<class TileType>
+	void PrefetchNode (QuadTreeNode<TileType> *node, const VECTOR3 &cdir, double cdist, double viewap, float prio_ofs, int &nreq);
+
+	// Subtree retention: instead of deleting the subtree of a tile that went out of view or
+	// was coarsened, its tiles are deactivated and the subtree is parked in an LRU list shared
+	// by all planets. Parked subtrees are reused when the tile refines again, and deleted
+	// (least recently parked first) only when the cache exceeds its memory budget.
+	template<class TileType>
+	void ReleaseSubtree (QuadTreeNode<TileType> *node);
+	// park the subtree below 'node', or delete it if the cache is disabled
+
+	template<class TileType>
+	void DeactivateSubtree (QuadTreeNode<TileType> *node, size_t *gpu, size_t *sys);
+
+	static void Park (Tile *tile);
+	static void Unpark (Tile *tile);
+	static void TrimCache ();
+	// delete parked subtrees until the cache is within its budget (caller must own hLoadMutex)
+
+	// Tile index: all tiles of the quadtree, keyed by the Morton code of (lvl, ilat, ilng), so
+	// that point queries and neighbour lookups don't need to descend the tree from the root.
+	// Tiles add and remove themselves on construction and deletion.
+	static UINT64 TileKey (int lvl, int ilat, int ilng);
+	void IndexTile (Tile *tile);
+	void UnindexTile (Tile *tile);
+
+	Tile *IndexedTile (int lvl, int ilat, int ilng) const;
+	// the tile at the specified position, or NULL if it doesn't exist
+
+	Tile *VisitedTile (int lvl, int ilat, int ilng) const;
+	// the finest tile visited by the latest ProcessNode pass at or above the specified position
+
+	int IndexedLevel (int maxlvl) const;
+	// the highest tile level <= maxlvl present in the tree
+
+	static void TileIndex (double lng, double lat, int lvl, int *ilat, int *ilng);
+	// indices of the tile at level 'lvl' containing the point 'lng', 'lat'
+
+	DWORD pass;                      // ProcessNode pass counter, see Tile::pass
+	DWORD lodepoch;                  // LOD parameter set, changes with any LOD parameter but the camera position
+	double lodtanap, lodbias, lodscale; // LOD parameters of lodepoch
+	int lodmaxlvl;
+	TileCullFrame cullframe;         // planet frame to clip space of the current pass
+	std::vector<Tile*> renderlist;   // tiles to render (ForRender) or step in (Active), ancestors first
+
 	double obj_size;                 // planet radius
 	double min_elev;				 // minimum renderred elevation
 	double max_elev;				 // maximum renderred elevation
@@ -399,6 +634,11 @@ private:
 	char cbody_name[256];
 	ELEVHANDLE emgr;                 // elevation data query handle
 	int gridRes;                     // mesh grid resolution. must be multiple of 2. Default: 64 for surfaces, 32 for clouds
+	struct {
+		double t[CAMHISTORY];        // sample times (system time) [s]
+		VECTOR3 pos[CAMHISTORY];     // camera positions in the planet frame [planet radii]
+		int n, head;                 // number of samples, next slot
+	} camhist;
 	double elevRes;                  // target elevation resolution
 
 	DWORD VtxPoolSize[NPOOLS];
@@ -406,10 +646,16 @@ private:
 	std::stack<LPDIRECT3DVERTEXBUFFER9> VtxPool[NPOOLS];
 	std::stack<LPDIRECT3DINDEXBUFFER9> IdxPool[NPOOLS];
 
+	std::unordered_map<UINT64, Tile*> tileindex; // see IndexTile
+	DWORD nindexed[TILEINDEX_NLVL];  // number of indexed tiles per level
+
 	static HFONT hFont;
 	static double resolutionBias;
 	static double resolutionScale;
 	static bool bTileLoadThread;     // load tiles on separate thread
+	static TileLodPool *lodpool;     // LOD selection workers, NULL if disabled
+	static Tile *parkhead, *parktail; // parked subtrees, most recently parked first
+	static size_t parkgpu, parksys;  // memory held by the parked subtrees [bytes]
 };
 
 // =======================================================================
@@ -434,9 +680,9 @@ public:
 	void RenderLabels(D3D9Pad *skp, oapi::Font **labelfont, int *fontidx);
 	void SetSubtreeLabels(QuadTreeNode<TileType> *node, bool activate);
 
-	QuadTreeNode<TileType> *FindNode (int lvl, int ilat, int ilng)
-	{ return TileManager2Base::FindNode<TileType> (tiletree, lvl, ilat, ilng); }
-	// Returns the node at the specified position, or 0 if it doesn't exist
+	QuadTreeNode<TileType> *FindNode (int lvl, int ilat, int ilng) const
+	{ return TileManager2Base::FindNode<TileType> (lvl, ilat, ilng); }
+	// Returns the node at the specified position, or its closest active ancestor
 
 	Tile *SearchTile (double lng, double lat, int maxlvl, bool bOwntex) const;
 
@@ -461,6 +707,9 @@ public:
 	// Check if tile texture exists
 	bool HasTileData(int iLng, int iLat, int level, int flags = 3);
 
+	// Decoded elevation grid of a tile, with a reference held for the caller
+	const ElevGrid *SeekTileElevation(int iLng, int iLat, int level, int flags = gcTileFlags::ELEVATION);
+
 protected:
 	TileType *globtile[3];              // full-sphere tiles for resolution levels 1-3
 	QuadTreeNode<TileType> tiletree[2]; // quadtree roots for western and eastern hemisphere
@@ -474,7 +723,6 @@ protected:
 
 	void LoadZTrees();
 	void InitHasIndividualFiles();
-	Tile *SearchTileSub (const QuadTreeNode<TileType> *node, double lng, double lat, int maxlvl, bool bOwntex) const;
 };
 
 #endif // !__TILEMGR2_H
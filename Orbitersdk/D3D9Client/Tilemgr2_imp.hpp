@@ -20,35 +20,23 @@
 // -----------------------------------------------------------------------
 
 template<class TileType>
-QuadTreeNode<TileType> *TileManager2Base::FindNode (QuadTreeNode<TileType> root[2], int lvl, int ilat, int ilng)
+QuadTreeNode<TileType> *TileManager2Base::FindNode (int lvl, int ilat, int ilng) const
 {
-	int i, sublat, sublng, subidx;
-
 	// wrap at longitude += 180
 	int nlng = 2 << lvl;
 	if (ilng < 0) ilng += nlng;
 	else if (ilng >= nlng) ilng -= nlng;
 
-	// Find the level-0 root
-	QuadTreeNode<TileType> *node = root + ((ilng >> lvl) & 1);
-	for (i = lvl-1; i >= 0; i--) {
-		if (node->Entry()->state == Tile::Invisible) return 0; // tile invisible
-		sublat = (ilat >> i) & 1;
-		sublng = (ilng >> i) & 1;
-		subidx = sublat*2+sublng;
-		if (node->Child(subidx) && (node->Child(subidx)->Entry()->state & TILE_ACTIVE)) {
-			node = node->Child(subidx);
-		} else {
-			break;
-		}
-	}
-	return node;
+	Tile *tile = VisitedTile (lvl, ilat, ilng);
+	if (!tile) return 0;
+	if (tile->lvl < lvl && tile->state == Tile::Invisible) return 0; // tile invisible
+	return static_cast<TileType*>(tile)->GetNode();
 }
 
 // -----------------------------------------------------------------------
 
 template<class TileType>
-QuadTreeNode<TileType> *TileManager2Base::LoadChildNode (QuadTreeNode<TileType> *node, int idx)
+QuadTreeNode<TileType> *TileManager2Base::LoadChildNode (QuadTreeNode<TileType> *node, int idx, float prio)
 {
 	TileType *parent = node->Entry();
 	int lvl = parent->lvl+1;
@@ -57,7 +45,7 @@ QuadTreeNode<TileType> *TileManager2Base::LoadChildNode (QuadTreeNode<TileType>
 	TileType *tile = new TileType (this, lvl, ilat, ilng);
 	QuadTreeNode<TileType> *child = node->AddChild (idx, tile);
 	if (bTileLoadThread)
-		loader->LoadTileAsync (tile);
+		loader->LoadTileAsync (tile, prio);
 	else {
 		tile->PreLoad();
 		tile->Load();
@@ -89,88 +77,38 @@ void TileManager2Base::ProcessNode (QuadTreeNode<TileType> *node)
 {
 	if (bFreeze) return;
 
-	static const double res_scale = 1.1; // resolution scale with distance
-
 	const Scene *scene = GetScene();
 
 	Tile *tile = node->Entry();
 	tile->state = Tile::ForRender;
+	tile->pass = pass;
 	tile->edgeok = false;
 	int lvl = tile->lvl;
-	int ilng = tile->ilng;
-	int ilat = tile->ilat;
-	int nlng = 2 << lvl;
-	int nlat = 1 << lvl;
-	bool bstepdown = true;
-	double bias = DebugControls::resbias;			// 2 to 6, default 4
-	if (ilat < nlat/6 || ilat >= nlat-nlat/6) {		// lower resolution at the poles
-		bias -= 1.0;
-		if (ilat < nlat/12 || ilat >= nlat-nlat/12)
-			bias -= 1.0;
-	}
 
 	bool bNoRelease = false;
 	
 	// Override TileDeletion for forced elevated rendering of asteroids/comets/small moons
 	if (ElevMode == eElevMode::ForcedElevated) bNoRelease = true;
-	
-	tile->dmWorld = WorldMatrix(ilng, nlng, ilat, nlat);
-	MATRIX4toD3DMATRIX(tile->dmWorld, tile->mWorld);
-
-	// check if patch is visible from camera position
-	VECTOR3 &cnt = tile->cnt;                   // tile centre in unit planet frame
-	static const double rad0 = sqrt(2.0)*PI05;
-	double rad = rad0/(double)nlat;
-	double alpha = acos (dotp (prm.cdir, cnt)); // angle between tile centre and camera from planet centre
-	double adist = alpha - rad;                 // angle between closest tile corner and camera
-	if (adist >= prm.viewap) {
-		if (lvl == 0)
-			bstepdown = false;                // force render at lowest resolution
-		else {
-			if (!bNoRelease) node->DelChildren ();             // remove the sub-tree
-			tile->state = Tile::Invisible;
-			return;                           // no need to continue
-		}
-	}
 
-	// Check if patch bounding box intersects viewport
-	MATRIX4 transform = mul (tile->dmWorld, prm.dviewproj);
-	if (!tile->InView (transform)) {
-		if (lvl == 0)
-			bstepdown = false;
-		else {
-			// Keep a tile allocated as long as the tile can be seen from a current camera position.
-			// We have multible views and only the active (current) view is checked here.
-			if (Config->EnvMapMode == 0 && Config->CustomCamMode == 0 && !bNoRelease) node->DelChildren();  // remove the sub-tree
-			tile->state = Tile::Invisible;
-			return;
-		}
+	// LOD selection, unless the LOD workers did it already
+	if (tile->lodpass != pass) EvaluateTile (tile);
+
+	// Hide the patch if it is beyond the horizon or its bounding box is outside of the viewport
+	// (level 0 is rendered at lowest resolution instead), otherwise step down to the target
+	// resolution level based on tile distance. Utils/LodBench replays this decision
+	TileLodStep step = TileLodDecide (lvl, tile->lodhorizon, tile->lodinview, tile->lodtgt);
+	if (step == TILELOD_HIDE) {
+		// Keep a tile allocated as long as the tile can be seen from a current camera position.
+		// We have multible views and only the active (current) view is checked here.
+		bool keep = bNoRelease || (!tile->lodhorizon && (Config->EnvMapMode || Config->CustomCamMode));
+		if (!keep) ReleaseSubtree (node);  // remove the sub-tree
+		tile->state = Tile::Invisible;
+		return;                            // no need to continue
 	}
+	bool bstepdown = (step == TILELOD_DESCEND);
 
-	int tgtres = -1;
-
-	// Compute target resolution level based on tile distance
-	if (bstepdown) {
-		double tdist;
-		double erad = 1.0 + tile->GetMaxElev()/obj_size; // radius of unit sphere plus elevation
-		if (adist < 0.0) { // if we are above the tile, use altitude for distance measurement
-			tdist = prm.cdist - erad;
-			if (tdist < 0.0) tdist = 0.0;
-		} else { // use distance to closest tile edge
-			double h = erad*sin(adist);
-			double a = prm.cdist - erad*cos(adist);
-			double x = a*a + h*h;
-			tdist = (x > 0.0) ? sqrt(x) : 0.0;
-		}
-
-		bias -=  2.0 * sqrt(max(0,adist) / prm.viewap);
-		int maxlvl = prm.maxlvl;
-		//if (DebugControls::IsEquEnabled()) maxlvl += 2;
-
-		double apr = tdist * scene->GetTanAp() * resolutionScale;
-		tgtres = (apr < 1e-6 ? maxlvl : max(0, min(maxlvl, (int)(bias - log(apr)*res_scale))));
-		bstepdown = (lvl < tgtres);
-	}
+	// load priority of missing subtiles
+	float loadprio = (tile->lodhorizon || !tile->lodinview ? 0.0f : tile->lodprio);
 	
 	if (!bstepdown) {
 		// Count the tile elevation stats
@@ -185,60 +123,275 @@ void TileManager2Base::ProcessNode (QuadTreeNode<TileType> *node)
 	
 	// Recursion to next level: subdivide into 2x2 patch
 	if (bstepdown) {
+		if (tile->parked) Unpark (tile); // the parked subtree is in use again
 		bool subcomplete = true;
 		int i, idx;
 		// check if all 4 subtiles are available already, and queue any missing for loading
 		for (idx = 0; idx < 4; idx++) {
 			QuadTreeNode<TileType> *child = node->Child(idx);
 			if (!child)
-				child = LoadChildNode (node, idx);
-			else if (child->Entry()->state == Tile::Invalid)
-				loader->LoadTileAsync (child->Entry());
+				child = LoadChildNode (node, idx, loadprio);
+			else if (child->Entry()->state == Tile::Invalid || child->Entry()->state == Tile::InQueue)
+				loader->LoadTileAsync (child->Entry(), loadprio); // queue, or refresh the priority
 			Tile::TileState state = child->Entry()->state;
 			if (!(state & TILE_VALID))
 				subcomplete = false;
 		}
 		if (subcomplete) {
 			tile->state = Tile::Active;
+			renderlist.push_back (tile); // before its subtiles
 			for (i = 0; i < 4; i++)
 				ProcessNode (node->Child(i));
 			return; // otherwise render at current resolution until all subtiles are available
 		}
 	}
 
-	if (!bstepdown) {
+	renderlist.push_back (tile);
+
+	if (!bstepdown && scene->GetRenderPass()==RENDERPASS_MAINSCENE) {
+		if (Config->TileCacheGPU) ReleaseSubtree (node); // park the finer tiles
 		// Delete tile and sub-tree if the tile has not been needeed for a while
-		if (scene->GetRenderPass()==RENDERPASS_MAINSCENE && (scene->GetFrameId()-tile->FrameId)>64) node->DelChildren ();
+		else if ((scene->GetFrameId()-tile->FrameId)>64) node->DelChildren ();
 	}
 }
 
 // -----------------------------------------------------------------------
 
 template<class TileType>
-void TileManager2Base::RenderNode (QuadTreeNode<TileType> *node)
+bool TileManager2Base::Descends (QuadTreeNode<TileType> *node) const
 {
-	TileType *tile = node->Entry();
-	const Scene *scene = GetScene();
+	// same decision as ProcessNode, on the values of EvaluateTile
+	Tile *tile = node->Entry();
+	TileLodStep step = TileLodDecide (tile->lvl, tile->lodhorizon, tile->lodinview, tile->lodtgt);
+	if (step == TILELOD_HIDE) return false;
+	if (step == TILELOD_RENDER) {
+		if (!((ElevMode == eElevMode::ForcedElevated) && (tile->IsElevated() == false))) return false;
+	}
+	for (int i = 0; i < 4; i++) {
+		const QuadTreeNode<TileType> *child = node->Child(i);
+		if (!child || !(child->Entry()->state & TILE_VALID)) return false; // ProcessNode renders this tile
+	}
+	return true;
+}
 
-	if (tile->state == Tile::ForRender) {
-		int lvl = tile->lvl;
-		tile->MatchEdges ();
-		SetWorldMatrix (tile->mWorld);
-		tile->StepIn ();
-		tile->Render ();
-		tile->FrameId = scene->GetFrameId();		// Keep a record about when this tile is actually rendered.
-		D3D9Stats.Surf.Tiles[lvl]++;
-		D3D9Stats.Surf.Verts += tile->mesh->nv;
-
-	} else if (tile->state == Tile::Active) {
-		tile->StepIn ();
-		for (int i = 0; i < 4; i++) {
-			if (node->Child(i)) {
-				if (node->Child(i)->Entry() && (node->Child(i)->Entry()->state & TILE_ACTIVE)) {
-					RenderNode (node->Child (i));	// step down into subtree
-				}
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::EvaluateNodes (QuadTreeNode<TileType> *const *node, int n)
+{
+	Tile *tile[16];
+	for (int i0 = 0; i0 < n; i0 += 16) {
+		int m = min(16, n-i0);
+		for (int i = 0; i < m; i++)
+			EvaluateTile (tile[i] = node[i0+i]->Entry(), false);
+		CullTiles (tile, m);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::SelectNode (QuadTreeNode<TileType> *node)
+{
+	// the node itself is evaluated already, its subtiles are evaluated together
+	if (Descends (node)) {
+		QuadTreeNode<TileType> *child[4];
+		for (int i = 0; i < 4; i++)
+			child[i] = node->Child(i);
+		EvaluateNodes (child, 4);
+		for (int i = 0; i < 4; i++)
+			SelectNode (child[i]);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::SelectTiles (QuadTreeNode<TileType> root[2])
+{
+	if (bFreeze) return; // keep the tree and the render list of the last pass
+
+	pass++;
+	renderlist.clear();
+
+	// clip space transformation for the frustum tests of this pass
+	MATRIX4 P = mul (prm.dwmat, prm.dviewproj);
+	const double m[4][4] = {
+		{P.m11, P.m12, P.m13, P.m14},
+		{P.m21, P.m22, P.m23, P.m24},
+		{P.m31, P.m32, P.m33, P.m34},
+		{P.m41, P.m42, P.m43, P.m44}
+	};
+	TileCullSetFrame (&cullframe, m);
+
+	// a new parameter set invalidates the LOD decisions kept by the tiles
+	double tanap = GetScene()->GetTanAp();
+	if (tanap != lodtanap || DebugControls::resbias != lodbias || resolutionScale != lodscale || prm.maxlvl != lodmaxlvl) {
+		lodtanap = tanap;
+		lodbias = DebugControls::resbias;
+		lodscale = resolutionScale;
+		lodmaxlvl = prm.maxlvl;
+		if (!++lodepoch) lodepoch = 1;
+	}
+	if (!lodpool) return; // ProcessNode evaluates the tiles itself
+
+	// Expand the part of the tree ProcessNode will visit breadth-first on this thread,
+	// until there are enough subtrees to keep the workers busy. Their evaluation is
+	// independent from each other, and only writes to the tiles themselves.
+	size_t target = 4 * (lodpool->Threads() + 1);
+	std::vector<QuadTreeNode<TileType>*> front, next;
+	front.push_back (root);
+	front.push_back (root+1);
+	EvaluateNodes (&front[0], (int)front.size());
+	while (!front.empty() && front.size() < target) {
+		next.clear();
+		for (size_t n = 0; n < front.size(); n++) {
+			if (Descends (front[n])) {
+				for (int i = 0; i < 4; i++)
+					next.push_back (front[n]->Child(i));
 			}
 		}
+		if (!next.empty()) EvaluateNodes (&next[0], (int)next.size());
+		front.swap (next);
+	}
+	for (size_t n = 0; n < front.size(); n++)
+		lodpool->Add (SelectJob<TileType>, this, front[n]);
+	lodpool->Run ();
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::ReleaseSubtree (QuadTreeNode<TileType> *node)
+{
+	if (!Config->TileCacheGPU) {
+		node->DelChildren ();
+		return;
+	}
+
+	Tile *tile = node->Entry();
+	if (tile->parked) return; // parked already
+
+	size_t gpu = 0, sys = 0;
+	bool any = false;
+	for (int i = 0; i < 4; i++) {
+		if (node->Child(i)) {
+			DeactivateSubtree (node->Child(i), &gpu, &sys);
+			any = true;
+		}
+	}
+	if (any) {
+		tile->pgpu = gpu;
+		tile->psys = sys;
+		Park (tile);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::DeactivateSubtree (QuadTreeNode<TileType> *node, size_t *gpu, size_t *sys)
+{
+	Tile *tile = node->Entry();
+	if (tile->parked) Unpark (tile); // merged into the enclosing subtree
+	if (tile->state & TILE_VALID) tile->state = Tile::Inactive;
+	else if (tile->state == Tile::InQueue) loader->Unqueue (tile); // out of view: don't load it into the parked memory
+	tile->MemoryUse (gpu, sys);
+	for (int i = 0; i < 4; i++) {
+		if (node->Child(i)) DeactivateSubtree (node->Child(i), gpu, sys);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::PrefetchTiles (QuadTreeNode<TileType> root[2])
+{
+	if (bFreeze || !bTileLoadThread) return;
+	if (GetScene()->GetRenderPass() != RENDERPASS_MAINSCENE) return;
+
+	RecordCamera();
+	if (Config->TilePrefetchTime <= 0.0) return;
+
+	// Two predicted camera states, half and full look-ahead. Their requests sort behind
+	// everything the current view needs, the nearer prediction first.
+	const int nstep = 2;
+	int nreq = 0;
+	for (int k = 1; k <= nstep; k++) {
+		VECTOR3 cdir;
+		double cdist;
+		if (!PredictCamera (Config->TilePrefetchTime * k / nstep, &cdir, &cdist)) return;
+		const double minalt = max(0.002, prm.rprm->horizon_excess);
+		double viewap = TileLodViewAp (cdist, minalt);
+		for (int i = 0; i < 2; i++)
+			PrefetchNode (root+i, cdir, cdist, viewap, -100.0f*k, nreq);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::PrefetchNode (QuadTreeNode<TileType> *node, const VECTOR3 &cdir, double cdist, double viewap, float prio_ofs, int &nreq)
+{
+	const int maxreq = 32; // max requests per frame
+
+	Tile *tile = node->Entry();
+	if (!(tile->state & TILE_VALID) || nreq >= maxreq) return;
+
+	int lvl = tile->lvl;
+	double adist = TileLodAngle (lvl, dotp (cdir, tile->cnt));
+	if (adist >= viewap) return; // beyond the predicted horizon
+
+	double tdist;
+	int tgtres = TargetLevel (tile, adist, cdist, viewap, &tdist);
+	if (lvl >= tgtres) return;
+
+	float prio = float(tgtres - lvl) + float(1.0 / (1.0 + tdist)) + prio_ofs;
+	DWORD frame = GetScene()->GetFrameId();
+
+	for (int idx = 0; idx < 4 && nreq < maxreq; idx++) {
+		QuadTreeNode<TileType> *child = node->Child(idx);
+		if (!child) {
+			LoadChildNode (node, idx, prio);
+			nreq++;
+		} else {
+			Tile *ctile = child->Entry();
+			// don't demote tiles the current view has asked for in this frame
+			if (ctile->state == Tile::Invalid || (ctile->state == Tile::InQueue && ctile->qframe != frame)) {
+				loader->LoadTileAsync (ctile, prio);
+				nreq++;
+			} else {
+				PrefetchNode (child, cdir, cdist, viewap, prio_ofs, nreq);
+			}
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
+template<class TileType>
+void TileManager2Base::RenderTiles ()
+{
+	const Scene *scene = GetScene();
+
+	for (size_t n = 0; n < renderlist.size(); n++) {
+		TileType *tile = static_cast<TileType*>(renderlist[n]);
+
+		if (tile->state == Tile::ForRender) {
+			int lvl = tile->lvl;
+			tile->MatchEdges ();
+			SetWorldMatrix (tile->mWorld);
+			tile->StepIn ();
+			tile->Render ();
+			tile->FrameId = scene->GetFrameId();		// Keep a record about when this tile is actually rendered.
+			D3D9Stats.Surf.Tiles[lvl]++;
+			D3D9Stats.Surf.Verts += tile->mesh->nv;
+			if (!tile->owntex) D3D9Stats.Surf.SubTex++;
+			if (tile->timing.tload) tile->ReportTiming(); // first frame after an asynchronous load
+
+		} else if (tile->state == Tile::Active) {
+			tile->StepIn ();	// the subtiles follow in the list
+		}
 	}
 }
 
@@ -293,6 +446,8 @@ TileManager2<TileType>::TileManager2 (const vPlanet *vplanet, int _maxres, int _
 template<class TileType>
 TileManager2<TileType>::~TileManager2 ()
 {
+	if (loader) loader->Flush(this); // release tiles locked by the loader
+
 	for (int i = 0; i < 2; i++)
 		tiletree[i].DelChildren();
 	for (int i = 0; i < 3; i++)
@@ -342,25 +497,23 @@ void TileManager2<TileType>::CheckCoverage (const QuadTreeNode<TileType> *node,
 // -----------------------------------------------------------------------
 
 template<class TileType>
-Tile *TileManager2<TileType>::SearchTileSub (const QuadTreeNode<TileType> *node, double lng, double lat, int maxlvl, bool bOwntex) const
+Tile *TileManager2<TileType>::SearchTile (double lng, double lat, int maxlvl, bool bOwntex) const
 {
-	Tile *t = node->Entry();
-
-	if (!t) return NULL;
-	if (!t->HasOwnTex() && bOwntex) return NULL;
-	if ((t->State()&TILE_VALID)==0) return NULL;
-	if (t->Level()==maxlvl) return t;
-
-	int i = 0;
-	if (lng > (t->bnd.minlng + t->bnd.maxlng)*0.5) i++;
-	if (lat < (t->bnd.minlat + t->bnd.maxlat)*0.5) i += 2;
-
-	const QuadTreeNode<TileType> *next = node->Child(i);
-	if (next) {
-		Tile *check = SearchTileSub(next, lng, lat, maxlvl, bOwntex);
-		if (check) return check;
+	// Valid tiles only have valid ancestors, so the finest valid tile at the position is where
+	// a descent from the root would end
+	int ilat, ilng;
+	for (int lvl = IndexedLevel (maxlvl); lvl >= 0; lvl--) {
+		TileIndex (lng, lat, lvl, &ilat, &ilng);
+		TileType *t = static_cast<TileType*>(IndexedTile (lvl, ilat, ilng));
+		if (!t || !(t->State() & TILE_VALID)) continue;
+		if (bOwntex) {
+			// the descent stops above the first tile without a texture of its own
+			for (const QuadTreeNode<TileType> *n = t->GetNode(); n; n = n->Parent())
+				if (!n->Entry()->HasOwnTex()) t = (n->Parent() ? n->Parent()->Entry() : NULL);
+		}
+		return t;
 	}
-	return t;
+	return NULL;
 }
 
 #endif // !__TILEMGR2_IMP_HPP
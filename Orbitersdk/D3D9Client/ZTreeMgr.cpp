@@ -14,7 +14,61 @@
 // --------------------------------------------------------------
 
 #include "ZTreeMgr.h"
+#include "Log.h"
+#include <algorithm>
+
+#ifdef ZTREE_STANDALONE
+#include <zlib.h>		// command-line tools: no Orbiter core to inflate for us
+#else
 #include "OrbiterAPI.h"
+#endif
+#ifdef ZTREE_LZ4
+#include <lz4.h>
+#endif
+#ifdef ZTREE_ZSTD
+#include <zstd.h>
+#endif
+
+// =======================================================================
+// High resolution clock for ZTreeTiming [us]
+
+static double ZTreeClock ()
+{
+	LARGE_INTEGER t, f;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&f);
+	return double(t.QuadPart) * 1e6 / double(f.QuadPart);
+}
+
+// =======================================================================
+// Read a block from an absolute file position. The offset is passed with
+// each call, so concurrent reads on the same handle don't interfere.
+
+static bool ReadAt (HANDLE h, __int64 ofs, void *buf, DWORD nbuf)
+{
+	OVERLAPPED ov;
+	DWORD nread = 0;
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)(ofs & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD)(ofs >> 32);
+	return ReadFile(h, buf, nbuf, &nread, &ov) && nread == nbuf;
+}
+
+// =======================================================================
+// PrefetchVirtualMemory is only available from Windows 8 on, so it is looked
+// up at runtime. Without it, mapped ranges are warmed by the prefetch worker.
+
+struct PrefetchRange {
+	void   *VirtualAddress;
+	SIZE_T NumberOfBytes;
+};
+typedef BOOL (WINAPI *PREFETCHVIRTUALMEMORY)(HANDLE hProcess, ULONG_PTR n, PrefetchRange *ranges, ULONG flags);
+
+static PREFETCHVIRTUALMEMORY GetPrefetchVirtualMemory ()
+{
+	static PREFETCHVIRTUALMEMORY proc = (PREFETCHVIRTUALMEMORY)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+	return proc;
+}
 
 // =======================================================================
 // File header for compressed tree files
@@ -53,6 +107,18 @@ bool TreeFileHeader::fread (FILE *f)
 	return true;
 }
 
+// -----------------------------------------------------------------------
+
+bool TreeFileHeader::read (const BYTE *buf, __int64 nbuf)
+{
+	const DWORD *hdr = (const DWORD*)buf;
+
+	if (nbuf < (__int64)sizeof(TreeFileHeader)) { return false; }
+	if (hdr[0] != magic || hdr[1] != size) { return false; }
+	memcpy(this, buf, sizeof(TreeFileHeader));
+	return true;
+}
+
 // =======================================================================
 // Tree table of contents
 
@@ -84,9 +150,426 @@ size_t TreeTOC::fread (DWORD size, FILE *f)
 	return ::fread(tree, sizeof(TreeNode), size, f);
 }
 
+// -----------------------------------------------------------------------
+
+size_t TreeTOC::fwrite (FILE *f) const
+{
+	return ::fwrite(tree, sizeof(TreeNode), ntree, f);
+}
+
+// -----------------------------------------------------------------------
+
+bool TreeTOC::read (DWORD size, HANDLE h, __int64 ofs)
+{
+	if (ntreebuf != size) {
+		TreeNode *tmp = new TreeNode[size];
+		if (ntreebuf) { delete []tree; }
+		tree = tmp;
+		ntree = ntreebuf = size;
+	}
+	return ReadAt(h, ofs, tree, size*sizeof(TreeNode));
+}
+
+// -----------------------------------------------------------------------
+
+void TreeTOC::attach (const TreeNode *nodes, DWORD size)
+{
+	// Use the node array in place (e.g. a mapped view). The array is not owned.
+	if (ntreebuf) { delete []tree; }
+	tree = (TreeNode*)nodes;
+	ntree = size;
+	ntreebuf = 0;
+}
+
+// -----------------------------------------------------------------------
+
+bool TreeTOC::valid () const
+{
+	__int64 prev = 0;
+	for (DWORD i = 0; i < ntree; i++) {
+		if (tree[i].pos < prev || tree[i].pos > totlength) return false;
+		prev = tree[i].pos;
+	}
+	return true;
+}
+
+// =======================================================================
+// Payload codecs for compressed tree files
+
+const char *ZTreeCodec::Name (DWORD codec)
+{
+	static const char *name[NTYPE] = { "zlib", "lz4", "zstd" };
+	return codec < NTYPE ? name[codec] : "unknown";
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeCodec::Supported (DWORD codec)
+{
+	switch (codec) {
+	case ZLIB: return true;
+#ifdef ZTREE_LZ4
+	case LZ4:  return true;
+#endif
+#ifdef ZTREE_ZSTD
+	case ZSTD: return true;
+#endif
+	default:   return false;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeCodec::Decode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp)
+{
+	switch (codec) {
+	case ZLIB: {
+#ifdef ZTREE_STANDALONE
+		uLongf ndata = noutp;
+		return uncompress(outp, &ndata, inp, ninp) == Z_OK ? (DWORD)ndata : 0;
+#else
+		return oapiInflate(inp, ninp, outp, noutp);
+#endif
+	}
+#ifdef ZTREE_LZ4
+	case LZ4: {
+		int ndata = LZ4_decompress_safe((const char*)inp, (char*)outp, (int)ninp, (int)noutp);
+		return ndata > 0 ? (DWORD)ndata : 0;
+	}
+#endif
+#ifdef ZTREE_ZSTD
+	case ZSTD: {
+		size_t ndata = ZSTD_decompress(outp, noutp, inp, ninp);
+		return ZSTD_isError(ndata) ? 0 : (DWORD)ndata;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+#ifdef ZTREE_STANDALONE
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeCodec::EncodeBound (DWORD codec, DWORD ninp)
+{
+	switch (codec) {
+	case ZLIB: return (DWORD)compressBound(ninp);
+#ifdef ZTREE_LZ4
+	case LZ4:  return (DWORD)LZ4_compressBound((int)ninp);
+#endif
+#ifdef ZTREE_ZSTD
+	case ZSTD: return (DWORD)ZSTD_compressBound(ninp);
+#endif
+	default:   return 0;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeCodec::Encode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp, int level)
+{
+	switch (codec) {
+	case ZLIB: {
+		uLongf ndata = noutp;
+		return compress2(outp, &ndata, inp, ninp, level < 0 ? Z_BEST_COMPRESSION : level) == Z_OK ? (DWORD)ndata : 0;
+	}
+#ifdef ZTREE_LZ4
+	case LZ4: {
+		// level is ignored: high-compression mode would need lz4hc, and decoding
+		// is equally fast either way
+		int ndata = LZ4_compress_default((const char*)inp, (char*)outp, (int)ninp, (int)noutp);
+		return ndata > 0 ? (DWORD)ndata : 0;
+	}
+#endif
+#ifdef ZTREE_ZSTD
+	case ZSTD: {
+		size_t ndata = ZSTD_compress(outp, noutp, inp, ninp, level < 0 ? 19 : level);
+		return ZSTD_isError(ndata) ? 0 : (DWORD)ndata;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+#endif // ZTREE_STANDALONE
+
+// =======================================================================
+// Shared cache of inflated tree node data
+
+ZTreeCache::ZTreeCache () :
+	budget(0), used(0)
+{
+	memset(&stats, 0, sizeof(Stats));
+	InitializeCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ZTreeCache::~ZTreeCache ()
+{
+	Trim(0);
+	DeleteCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ZTreeCache &ZTreeCache::Global ()
+{
+	static ZTreeCache cache;
+	return cache;
+}
+
+// -----------------------------------------------------------------------
+
+BYTE *ZTreeCache::Alloc (DWORD ndata)
+{
+	Block *b = (Block*)new BYTE[sizeof(Block) + ndata];
+	b->refs = 1;
+	return (BYTE*)(b+1);
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::Release (BYTE *data)
+{
+	Block *b = (Block*)data - 1;
+	if (!InterlockedDecrement(&b->refs)) {
+		delete [](BYTE*)b;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::SetBudget (__int64 bytes)
+{
+	EnterCriticalSection(&cs);
+	budget = bytes;
+	Trim(budget);
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeCache::Get (DWORD archive, DWORD idx, BYTE **outp)
+{
+	UINT64 key = ((UINT64)archive << 32) | idx;
+	DWORD ndata = 0;
+
+	EnterCriticalSection(&cs);
+	if (budget) {
+		auto it = index.find(key);
+		if (it != index.end()) {
+			lru.splice(lru.begin(), lru, it->second); // move to front
+			const Entry &e = *it->second;
+			InterlockedIncrement(&((Block*)e.data - 1)->refs);
+			*outp = e.data;
+			ndata = e.ndata;
+			stats.hits++;
+		} else {
+			stats.misses++;
+		}
+	}
+	LeaveCriticalSection(&cs);
+	return ndata;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::Put (DWORD archive, DWORD idx, BYTE *data, DWORD ndata)
+{
+	UINT64 key = ((UINT64)archive << 32) | idx;
+
+	EnterCriticalSection(&cs);
+	if ((__int64)ndata <= budget && index.find(key) == index.end()) { // another thread may have stored it meanwhile
+		Trim(budget - ndata);
+		InterlockedIncrement(&((Block*)data - 1)->refs);
+		Entry e = { key, data, ndata };
+		lru.push_front(e);
+		index[key] = lru.begin();
+		used += ndata;
+	}
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::Purge (DWORD archive)
+{
+	EnterCriticalSection(&cs);
+	for (auto it = lru.begin(); it != lru.end();) {
+		if ((DWORD)(it->key >> 32) == archive) {
+			used -= it->ndata;
+			Release(it->data);
+			index.erase(it->key);
+			it = lru.erase(it);
+		} else ++it;
+	}
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::GetStats (Stats *s) const
+{
+	EnterCriticalSection(&cs);
+	*s = stats;
+	s->entries = (DWORD)lru.size();
+	s->bytes = used;
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeCache::Trim (__int64 limit)
+{
+	// caller must own the critical section
+	while (used > limit && !lru.empty()) {
+		Entry &e = lru.back();
+		used -= e.ndata;
+		Release(e.data);
+		index.erase(e.key);
+		lru.pop_back();
+		stats.evictions++;
+	}
+}
+
+// =======================================================================
+// Background readahead for tree files
+
+ZTreePrefetch::ZTreePrefetch () :
+	busy(NULL), hThread(NULL), bStop(false)
+{
+	hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ZTreePrefetch::~ZTreePrefetch ()
+{
+	ShutDown();
+	CloseHandle(hWake);
+	DeleteCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+ZTreePrefetch &ZTreePrefetch::Global ()
+{
+	static ZTreePrefetch prefetch;
+	return prefetch;
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreePrefetch::ShutDown ()
+{
+	if (!hThread) {
+		return false;
+	}
+	EnterCriticalSection(&cs);
+	queue.clear();
+	bStop = true;
+	LeaveCriticalSection(&cs);
+
+	SetEvent(hWake);
+	WaitForSingleObject(hThread, INFINITE);
+	CloseHandle(hThread);
+	hThread = NULL;
+	bStop = false;
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreePrefetch::Pending () const
+{
+	EnterCriticalSection(&cs);
+	DWORD n = (DWORD)queue.size();
+	LeaveCriticalSection(&cs);
+	return n;
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreePrefetch::Queue (ZTreeMgr *mgr, __int64 ofs, DWORD size)
+{
+	EnterCriticalSection(&cs);
+	if (queue.size() >= ZTREE_PREFETCHQUEUE) { // readahead is only a hint: drop it
+		LeaveCriticalSection(&cs);
+		return false;
+	}
+	if (!hThread) {
+		DWORD id;
+		hThread = CreateThread(NULL, 0, Prefetch_ThreadProc, this, 0, &id);
+	}
+	Request rq = { mgr, ofs, size };
+	queue.push_back(rq);
+	LeaveCriticalSection(&cs);
+
+	SetEvent(hWake);
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreePrefetch::Purge (const ZTreeMgr *mgr)
+{
+	EnterCriticalSection(&cs);
+	queue.erase(std::remove_if(queue.begin(), queue.end(), [mgr](const Request &rq) { return rq.mgr == mgr; }), queue.end());
+	while (busy == mgr) { // the worker is reading from this archive right now
+		LeaveCriticalSection(&cs);
+		Sleep(1);
+		EnterCriticalSection(&cs);
+	}
+	LeaveCriticalSection(&cs);
+}
+
+// -----------------------------------------------------------------------
+
+DWORD WINAPI ZTreePrefetch::Prefetch_ThreadProc (void *data)
+{
+	ZTreePrefetch *pf = (ZTreePrefetch*)data;
+
+	while (WaitForSingleObject(pf->hWake, INFINITE) == WAIT_OBJECT_0 && !pf->bStop) {
+		for (;;) {
+			EnterCriticalSection(&pf->cs);
+			if (pf->bStop || pf->queue.empty()) {
+				LeaveCriticalSection(&pf->cs);
+				break;
+			}
+			Request rq = pf->queue.front();
+			pf->queue.pop_front();
+			pf->busy = rq.mgr;
+			LeaveCriticalSection(&pf->cs);
+
+			rq.mgr->Warm(rq.ofs, rq.size);
+
+			EnterCriticalSection(&pf->cs);
+			pf->busy = NULL;
+			LeaveCriticalSection(&pf->cs);
+		}
+	}
+	return 0;
+}
+
 // =======================================================================
 // ZTreeMgr class: manage a single layer tree for a planet
 
+bool ZTreeMgr::bMapping = true;
+
+// -----------------------------------------------------------------------
+
+void ZTreeMgr::SetMapping (bool enable)
+{
+	bMapping = enable;
+}
+
+// -----------------------------------------------------------------------
+
 ZTreeMgr *ZTreeMgr::CreateFromFile (const char *PlanetPath, Layer _layer)
 {
 	ZTreeMgr *mgr = new ZTreeMgr(PlanetPath, _layer);
@@ -100,20 +583,30 @@ ZTreeMgr *ZTreeMgr::CreateFromFile (const char *PlanetPath, Layer _layer)
 // -----------------------------------------------------------------------
 
 ZTreeMgr::ZTreeMgr (const char *PlanetPath, Layer _layer) :
-	layer(_layer), treef(NULL)
+	layer(_layer),
+	hFile(INVALID_HANDLE_VALUE), hMap(NULL), view(NULL), viewsize(0),
+	codec(ZTreeCodec::ZLIB), nodeidx(NULL)
 {
+	static volatile LONG nextId = 0;
+	archiveId = (DWORD)InterlockedIncrement(&nextId);
+
 	int len = lstrlen(PlanetPath) + 1;
 	path = new char[len];
 	strcpy_s(path, len, PlanetPath);
-	OpenArchive();
+	if (OpenArchive()) {
+		BuildIndex();
+	}
 }
 
 // -----------------------------------------------------------------------
 
 ZTreeMgr::~ZTreeMgr ()
 {
+	ZTreeCache::Global().Purge(archiveId);
+	ZTreePrefetch::Global().Purge(this);
 	delete []path;
-	if (treef) { fclose(treef); }
+	delete []nodeidx;
+	CloseArchive();
 }
 
 // -----------------------------------------------------------------------
@@ -123,15 +616,29 @@ bool ZTreeMgr::OpenArchive ()
 	const char *name[6] = { "Surf", "Mask", "Elev", "Elev_mod", "Label", "Cloud" };
 	char fname[MAX_PATH];
 	sprintf_s (fname, MAX_PATH, "%s\\Archive\\%s.tree", path, name[layer]);
-	if (fopen_s(&treef, fname, "rb")) {
+
+	hFile = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
 		return false;
 	}
-	TreeFileHeader tfh;
-	if (!tfh.fread(treef)) {
-		fclose(treef);
-		treef = NULL;
+
+	if (!(bMapping && OpenMapping(fname)) && !OpenPositional()) {
+		CloseArchive();
 		return false;
 	}
+
+	if (!ZTreeCodec::Supported(codec)) {
+		LogErr("ZTreeMgr: [%s] uses the %s codec, which this build does not support", fname, ZTreeCodec::Name(codec));
+		CloseArchive();
+		return false;
+	}
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeMgr::ReadHeader (const TreeFileHeader &tfh)
+{
 	rootPos1 = tfh.rootPos1;
 	rootPos2 = tfh.rootPos2;
 	rootPos3 = tfh.rootPos3;
@@ -139,37 +646,165 @@ bool ZTreeMgr::OpenArchive ()
 		rootPos4[i] = tfh.rootPos4[i];
 	}
 	dofs = (__int64)tfh.dataOfs;
+	codec = tfh.Codec();
+}
+
+// -----------------------------------------------------------------------
 
-	if (!toc.fread(tfh.nodeCount, treef)) {
-		fclose(treef);
-		treef = NULL;
+bool ZTreeMgr::OpenPositional ()
+{
+	// Positional-read backend. Every read carries its own file offset, so there is
+	// no shared stream position and ReadData can be called from several threads.
+	BYTE hdr[sizeof(TreeFileHeader)];
+	TreeFileHeader tfh;
+	if (!ReadAt(hFile, 0, hdr, sizeof(hdr)) || !tfh.read(hdr, sizeof(hdr))) {
+		return false;
+	}
+	ReadHeader(tfh);
+
+	if (!toc.read(tfh.nodeCount, hFile, sizeof(TreeFileHeader))) {
+		return false;
+	}
+	toc.totlength = tfh.dataLength;
+
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeMgr::OpenMapping (const char *fname)
+{
+	// Map the entire tree-file once. The TOC and the deflated node data are then
+	// read in place. Fails (and the caller falls back to positional reads) if the
+	// view doesn't fit into the address space, e.g. multi-GB archives in a 32-bit process.
+	LARGE_INTEGER fsize;
+
+	if (!GetFileSizeEx(hFile, &fsize) || (ULONGLONG)fsize.QuadPart > (ULONGLONG)((SIZE_T)-1)) {
+		return false;
+	}
+	hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!hMap) {
+		return false;
+	}
+	view = (const BYTE*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		LogAlw("ZTreeMgr: Unable to map [%s] (%llu bytes), using positional reads", fname, (ULONGLONG)fsize.QuadPart);
+		CloseMapping();
 		return false;
 	}
+	viewsize = fsize.QuadPart;
+
+	TreeFileHeader tfh;
+	__int64 tocofs = sizeof(TreeFileHeader);
+	if (!tfh.read(view, viewsize)
+		|| tocofs + (__int64)tfh.nodeCount * (__int64)sizeof(TreeNode) > viewsize
+		|| (__int64)tfh.dataOfs + tfh.dataLength > viewsize) {
+		CloseMapping();
+		return false;
+	}
+	ReadHeader(tfh);
+
+	toc.attach((const TreeNode*)(view + tocofs), tfh.nodeCount);
 	toc.totlength = tfh.dataLength;
 
+	// Nodes are inflated straight out of the view, with no read that could fail on
+	// a corrupt node position
+	if (!toc.valid()) {
+		LogErr("ZTreeMgr: [%s] has node positions outside of the data block, using positional reads", fname);
+		CloseMapping();
+		return false;
+	}
+
 	return true;
 }
 
 // -----------------------------------------------------------------------
 
+void ZTreeMgr::CloseMapping ()
+{
+	if (view) {
+		toc.attach(NULL, 0);
+		UnmapViewOfFile(view);
+		view = NULL;
+	}
+	if (hMap) {
+		CloseHandle(hMap);
+		hMap = NULL;
+	}
+	viewsize = 0;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeMgr::CloseArchive ()
+{
+	CloseMapping();
+	toc.attach(NULL, 0);
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+		hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeMgr::BuildIndex ()
+{
+	// Flatten the upper part of the tree into one row-major table per level
+	// (level L has 2^(L-4) x 2^(L-3) entries), so that lookups don't have to
+	// walk down from the root for every tile of every layer.
+	int lvl, n = 0;
+	for (lvl = 4; lvl <= ZTREE_INDEXLVL; lvl++) {
+		idxofs[lvl] = n;
+		n += (1 << (lvl-4)) * (2 << (lvl-4));
+	}
+	nodeidx = new DWORD[n];
+
+	DWORD *tab = nodeidx + idxofs[4];
+	tab[0] = rootPos4[0];
+	tab[1] = rootPos4[1];
+
+	for (lvl = 5; lvl <= ZTREE_INDEXLVL; lvl++) {
+		const DWORD *ptab = nodeidx + idxofs[lvl-1];
+		int nlat = 1 << (lvl-4), nlng = 2 << (lvl-4);
+		tab = nodeidx + idxofs[lvl];
+		for (int ilat = 0; ilat < nlat; ilat++) {
+			for (int ilng = 0; ilng < nlng; ilng++) {
+				DWORD pidx = ptab[(ilat/2)*(nlng/2) + ilng/2];
+				*tab++ = (pidx == (DWORD)-1 || pidx >= toc.size() ? (DWORD)-1 : toc[pidx].child[((ilat&1) << 1) + (ilng&1)]);
+			}
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
 DWORD ZTreeMgr::Idx (int lvl, int ilat, int ilng)
 {
-	if (lvl <= 4) {
-		return (lvl == 1 ? rootPos1 : lvl == 2 ? rootPos2 : lvl == 3 ? rootPos3 : rootPos4[ilng]);
-	} else {
-		int plvl = lvl-1;
-		int pilat = ilat/2;
-		int pilng = ilng/2;
-		DWORD pidx = Idx(plvl, pilat, pilng);
-		if (pidx == (DWORD)-1) { return pidx; }
-		int cidx = ((ilat&1) << 1) + (ilng&1);
-		return toc[pidx].child[cidx];
+	if (lvl < 4) {
+		return (lvl == 1 ? rootPos1 : lvl == 2 ? rootPos2 : lvl == 3 ? rootPos3 : (DWORD)-1);
 	}
+	if (!nodeidx) { return (DWORD)-1; }
+
+	int dlvl = lvl - ZTREE_INDEXLVL;
+	if (dlvl < 0) dlvl = 0;
+	int tlvl = lvl - dlvl;
+	int tlat = ilat >> dlvl, tlng = ilng >> dlvl;
+	int nlat = 1 << (tlvl-4), nlng = 2 << (tlvl-4);
+	if (tlat < 0 || tlat >= nlat || tlng < 0 || tlng >= nlng) { return (DWORD)-1; }
+
+	DWORD idx = nodeidx[idxofs[tlvl] + tlat*nlng + tlng];
+
+	// descend from the deepest indexed ancestor
+	for (int i = dlvl-1; i >= 0 && idx != (DWORD)-1; i--) {
+		idx = toc[idx].child[(((ilat >> i)&1) << 1) + ((ilng >> i)&1)];
+	}
+	return idx;
 }
 
 // -----------------------------------------------------------------------
 
-DWORD ZTreeMgr::ReadData (DWORD idx, BYTE **outp)
+DWORD ZTreeMgr::ReadData (DWORD idx, BYTE **outp, ZTreeTiming *tm)
 {
 	if (idx == (DWORD)-1) { return 0; } // sanity check
 
@@ -178,21 +813,41 @@ DWORD ZTreeMgr::ReadData (DWORD idx, BYTE **outp)
 		return 0;
 	}
 
-	if (_fseeki64(treef, toc[idx].pos+dofs, SEEK_SET)) {
-		return 0;
+	DWORD ndata = ZTreeCache::Global().Get(archiveId, idx, outp);
+	if (ndata) {
+		return ndata;
 	}
 
-	DWORD zsize = NodeSizeDeflated(idx);
-	BYTE *zbuf = new BYTE[zsize];
-	fread(zbuf, 1, zsize, treef);
+	BYTE *ebuf = ZTreeCache::Alloc(esize);
+	double t0 = (tm ? ZTreeClock() : 0.0), t1 = t0;
 
-	BYTE *ebuf = new BYTE[esize];
+	if (view) {
+		// inflate straight out of the mapped view: no seek, no copy
+		if (tm) { // page the range in first, so the page faults don't count as inflate time
+			Warm(dofs + toc[idx].pos, NodeSizeDeflated(idx));
+			t1 = ZTreeClock();
+		}
+		ndata = Inflate(view + dofs + toc[idx].pos, NodeSizeDeflated(idx), ebuf, esize);
+	} else {
+		DWORD zsize = NodeSizeDeflated(idx);
+		BYTE *zbuf = new BYTE[zsize];
+		if (ReadAt(hFile, toc[idx].pos+dofs, zbuf, zsize)) {
+			if (tm) t1 = ZTreeClock();
+			ndata = Inflate(zbuf, zsize, ebuf, esize);
+		}
+		delete []zbuf;
+	}
 
-	DWORD ndata = Inflate(zbuf, zsize, ebuf, esize);
-	delete []zbuf;
+	if (tm) {
+		double t2 = ZTreeClock();
+		tm->read += t1 - t0;
+		tm->inflate += t2 - t1;
+	}
 
-	if (!ndata) {
-		delete []ebuf;
+	if (ndata) {
+		ZTreeCache::Global().Put(archiveId, idx, ebuf, ndata);
+	} else {
+		ZTreeCache::Release(ebuf);
 		ebuf = 0;
 	}
 	*outp = ebuf;
@@ -201,14 +856,93 @@ DWORD ZTreeMgr::ReadData (DWORD idx, BYTE **outp)
 
 // -----------------------------------------------------------------------
 
+DWORD ZTreeMgr::Prefetch (int lvl, int ilat, int ilng, int depth)
+{
+	DWORD idx = Idx(lvl, ilat, ilng);
+	if (idx == (DWORD)-1) { return 0; }
+
+	// collect the subtree breadth first, so a truncated request keeps the upper levels
+	DWORD node[ZTREE_PREFETCHMAX];
+	int   ndep[ZTREE_PREFETCHMAX];
+	DWORD i, n = 0, nrange = 0;
+	node[n] = idx, ndep[n++] = 0;
+	for (i = 0; i < n; i++) {
+		if (ndep[i] >= depth) continue;
+		for (int c = 0; c < 4 && n < ZTREE_PREFETCHMAX; c++) {
+			DWORD cidx = toc[node[i]].child[c];
+			if (cidx < toc.size()) node[n] = cidx, ndep[n++] = ndep[i]+1;
+		}
+	}
+
+	// file ranges of the nodes with data, merged where they are contiguous
+	// (siblings are, in archives written by "ZTreeTool reorder")
+	struct Range { __int64 ofs; __int64 size; } range[ZTREE_PREFETCHMAX];
+	DWORD nnode = 0;
+	for (i = 0; i < n; i++) {
+		if (!NodeSizeInflated(node[i])) continue;
+		range[nrange].ofs = dofs + toc[node[i]].pos;
+		range[nrange++].size = NodeSizeDeflated(node[i]);
+		nnode++;
+	}
+	std::sort(range, range+nrange, [](const Range &a, const Range &b) { return a.ofs < b.ofs; });
+	for (n = 0, i = 1; i < nrange; i++) {
+		__int64 end = range[i].ofs + range[i].size;
+		if (range[i].ofs <= range[n].ofs + range[n].size) {
+			if (end > range[n].ofs + range[n].size) range[n].size = end - range[n].ofs;
+		} else {
+			range[++n] = range[i];
+		}
+	}
+	if (nrange) nrange = n+1;
+
+	PREFETCHVIRTUALMEMORY PrefetchVirtualMemory = (view ? GetPrefetchVirtualMemory() : NULL);
+	if (PrefetchVirtualMemory) {
+		// let the memory manager page the view in, asynchronously
+		PrefetchRange pr[ZTREE_PREFETCHMAX];
+		for (i = 0; i < nrange; i++) {
+			pr[i].VirtualAddress = (void*)(view + range[i].ofs);
+			pr[i].NumberOfBytes = (SIZE_T)range[i].size;
+		}
+		if (nrange) PrefetchVirtualMemory(GetCurrentProcess(), nrange, pr, 0);
+	} else {
+		for (i = 0; i < nrange; i++) {
+			if (!ZTreePrefetch::Global().Queue(this, range[i].ofs, (DWORD)range[i].size)) break;
+		}
+	}
+	return nnode;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeMgr::Warm (__int64 ofs, DWORD size)
+{
+	if (view) {
+		// touch every page of the range
+		volatile BYTE sum = 0;
+		const BYTE *p = view + ofs, *end = view + ofs + size;
+		for (; p < end; p += 4096) sum += *p;
+		if (size) sum += end[-1];
+	} else {
+		// read through a scratch buffer: the data stays in the OS file cache
+		const DWORD chunk = 65536;
+		BYTE *buf = new BYTE[chunk];
+		for (DWORD done = 0; done < size; done += chunk) {
+			if (!ReadAt(hFile, ofs + done, buf, size - done < chunk ? size - done : chunk)) break;
+		}
+		delete []buf;
+	}
+}
+
+// -----------------------------------------------------------------------
+
 DWORD ZTreeMgr::Inflate (const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp)
 {
-	return oapiInflate(inp, ninp, outp, noutp);
+	return ZTreeCodec::Decode(codec, inp, ninp, outp, noutp);
 }
 
 // -----------------------------------------------------------------------
 
 void ZTreeMgr::ReleaseData (BYTE *data)
 {
-	delete []data;
+	if (data) ZTreeCache::Release(data);
 }
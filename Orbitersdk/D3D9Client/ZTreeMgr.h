@@ -18,10 +18,22 @@
 
 #include <iostream>
 #include <windows.h>
+#include <deque>
+#include <list>
+#include <unordered_map>
 
 /// \defgroup ztree Z-Tree management for tile archive access
 /// @{
 
+class ZTreeMgr;
+
+#define ZTREE_INDEXLVL 10 ///< deepest tree level covered by the dense node index
+
+#define ZTREE_CODEC_MASK 0x000F ///< TreeFileHeader::flags bits holding the payload codec (see ZTreeCodec::Type)
+
+#define ZTREE_PREFETCHMAX 256    ///< max. number of nodes requested by a single ZTreeMgr::Prefetch call
+#define ZTREE_PREFETCHQUEUE 1024 ///< max. number of pending readahead requests
+
 // =======================================================================
 /**
  * \brief Tree node structure
@@ -43,12 +55,17 @@ struct TreeNode {
  */
 class TreeFileHeader {
 	friend class ZTreeMgr;
+	friend class ZTreeTool;
 
 public:
 	TreeFileHeader ();
 
-	inline	size_t fwrite (FILE *f);
-			bool   fread (FILE *f);
+	size_t fwrite (FILE *f);
+	bool   fread (FILE *f);
+	bool   read (const BYTE *buf, __int64 nbuf);
+
+	inline DWORD Codec () const { return flags & ZTREE_CODEC_MASK; }
+	// payload codec of the archive (ZTreeCodec::Type)
 
 private:
 	DWORD   magic;       ///< file ID and version
@@ -70,12 +87,19 @@ private:
  */
 class TreeTOC {
 	friend class ZTreeMgr;
+	friend class ZTreeTool;
 
 public:
 	TreeTOC ();
 	~TreeTOC ();
 
 	size_t fread (DWORD size, FILE *f);
+	size_t fwrite (FILE *f) const;
+	bool   read (DWORD size, HANDLE h, __int64 ofs);
+	void   attach (const TreeNode *nodes, DWORD size);
+	bool   valid () const;
+	// true if the node positions are non-decreasing and within the data block, i.e. every
+	// node's deflated range lies inside the data block
 	DWORD size () const { return ntree; }
 	inline const TreeNode &operator[] (int idx) const { return tree[idx]; }
 
@@ -87,16 +111,177 @@ public:
 private:
 	TreeNode *tree;     ///< array containing all tree node entries
 	DWORD    ntree;     ///< number of entries
-	DWORD    ntreebuf;  ///< array size
+	DWORD    ntreebuf;  ///< array size (0: array is not owned, e.g. a mapped view)
 	__int64  totlength; ///< total data size (deflated)
 };
 
 
+// =======================================================================
+/**
+ * \brief Payload codecs for compressed tree files
+ *
+ * The codec is stored per archive in TreeFileHeader::flags. zlib is what
+ * Orbiter ships and is always available. LZ4 and Zstd trade some file size
+ * for much faster decoding and are compiled in with ZTREE_LZ4 and ZTREE_ZSTD.
+ */
+class ZTreeCodec {
+public:
+	enum Type { ZLIB = 0, LZ4 = 1, ZSTD = 2, NTYPE };
+
+	static const char *Name (DWORD codec);
+	static bool Supported (DWORD codec);
+	// true if this build can decode archives using 'codec'
+
+	static DWORD Decode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp);
+	// decode a node into a buffer of its inflated size. Returns the data size, or 0 on failure
+
+#ifdef ZTREE_STANDALONE
+	static DWORD EncodeBound (DWORD codec, DWORD ninp);
+	// worst-case encoded size of 'ninp' bytes
+
+	static DWORD Encode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp, int level = -1);
+	// encode a node (level < 0: codec default). Returns the encoded size, or 0 on failure
+#endif
+};
+
+
+// =======================================================================
+/**
+ * \brief Shared cache of inflated tree node data
+ *
+ * Thread-safe LRU cache keyed by (archive, node index), bounded by a byte
+ * budget. Tiles dropped by the quadtree and reloaded a moment later are
+ * served from here instead of being inflated again.
+ *
+ * Node buffers are reference counted and shared between the cache and its
+ * readers, so a hit hands out the cached buffer itself. An evicted buffer
+ * lives on until its last reader releases it.
+ */
+class ZTreeCache {
+public:
+	struct Stats {
+		DWORD   hits;      ///< lookups served from the cache
+		DWORD   misses;    ///< lookups that had to inflate the node
+		DWORD   evictions; ///< entries dropped to stay within the budget
+		DWORD   entries;   ///< number of cached nodes
+		__int64 bytes;     ///< size of the cached data [bytes]
+	};
+
+	ZTreeCache ();
+	~ZTreeCache ();
+
+	static ZTreeCache &Global ();
+	// the cache shared by all archives
+
+	void SetBudget (__int64 bytes);
+	// set the memory budget [bytes] (0 disables the cache)
+
+	static BYTE *Alloc (DWORD ndata);
+	// allocate a node buffer holding one reference
+
+	static void Release (BYTE *data);
+	// drop a reference to a node buffer, and free it with the last one
+
+	DWORD Get (DWORD archive, DWORD idx, BYTE **outp);
+	// add a reference to a cached node buffer. Returns the data size, or 0 if not cached
+
+	void Put (DWORD archive, DWORD idx, BYTE *data, DWORD ndata);
+	// share a node buffer from Alloc with the cache, evicting the least recently used nodes as required
+
+	void Purge (DWORD archive);
+	// remove all nodes of an archive
+
+	void GetStats (Stats *stats) const;
+
+private:
+	struct Entry {
+		UINT64 key;
+		BYTE   *data;   ///< node buffer, holding one reference
+		DWORD  ndata;
+	};
+	struct Block {           // node buffer header, followed by the data
+		volatile LONG refs;  ///< reference count
+		DWORD  pad[3];       ///< keeps the data 16-byte aligned
+	};
+	void Trim (__int64 limit);
+
+	std::list<Entry> lru;       ///< cached nodes, most recently used first
+	std::unordered_map<UINT64, std::list<Entry>::iterator> index;
+	__int64 budget;             ///< memory budget [bytes]
+	__int64 used;               ///< cached data size [bytes]
+	Stats   stats;
+	mutable CRITICAL_SECTION cs;
+};
+
+
+// =======================================================================
+/**
+ * \brief Background readahead for tree files
+ *
+ * A single worker thread shared by all archives. It pulls queued file
+ * ranges into memory (page cache, or the pages of a mapped view) so that
+ * a later ZTreeMgr::ReadData doesn't wait for the disk.
+ */
+class ZTreePrefetch {
+	friend class ZTreeMgr;
+
+public:
+	ZTreePrefetch ();
+	~ZTreePrefetch ();
+
+	static ZTreePrefetch &Global ();
+	// the readahead worker shared by all archives
+
+	bool ShutDown ();
+	// stop the worker thread and drop pending requests. It restarts on the next request
+
+	DWORD Pending () const;
+	// number of queued requests
+
+protected:
+	bool Queue (ZTreeMgr *mgr, __int64 ofs, DWORD size);
+	// queue a file range of an archive. Returns false if the queue is full
+
+	void Purge (const ZTreeMgr *mgr);
+	// drop all requests of an archive, and wait for one in progress
+
+private:
+	struct Request {
+		ZTreeMgr *mgr;
+		__int64   ofs;   ///< file offset
+		DWORD     size;  ///< range size [bytes]
+	};
+	static DWORD WINAPI Prefetch_ThreadProc (void *data);
+
+	std::deque<Request> queue;
+	const ZTreeMgr *busy;  ///< archive the worker is currently reading from
+	HANDLE hThread;        ///< worker thread handle
+	HANDLE hWake;          ///< signalled when requests are queued, or to stop the thread
+	volatile bool bStop;   ///< thread kill flag
+	mutable CRITICAL_SECTION cs;
+};
+
+
+// =======================================================================
+/**
+ * \brief Time spent inside ZTreeMgr::ReadData, accumulated over calls [us]
+ *
+ * Cache hits add nothing. For mapped archives 'read' is the time needed to
+ * page the node's range of the view in.
+ */
+struct ZTreeTiming {
+	double read;    ///< file reads or page-ins
+	double inflate; ///< payload decompression
+};
+
+
 // =======================================================================
 /**
  * \brief ZTreeMgr class: manage a single layer tree for a planet
  */
 class ZTreeMgr {
+	friend class ZTreePrefetch;
+
 public:
 	enum Layer { LAYER_SURF, LAYER_MASK, LAYER_ELEV, LAYER_ELEVMOD, LAYER_LABEL, LAYER_CLOUD };
 	static ZTreeMgr *CreateFromFile (const char *PlanetPath, Layer _layer);
@@ -112,31 +297,66 @@ public:
 
 	DWORD Idx (int lvl, int ilat, int ilng);
 	// return the array index of an arbitrary tile ((DWORD)-1: not present)
+	// Levels up to ZTREE_INDEXLVL are resolved by a single table lookup, deeper
+	// levels descend from their ZTREE_INDEXLVL ancestor.
 
-	DWORD ReadData (DWORD idx, BYTE **outp);
+	DWORD ReadData (DWORD idx, BYTE **outp, ZTreeTiming *tm = NULL);
+	// inflate the data of node 'idx' into a read-only buffer, which may be shared
+	// with the node cache and other readers (release with ReleaseData)
+	// Reentrant: may be called concurrently from several loader threads.
+	// If 'tm' is given, the read and inflate times are added to it.
 
-	inline DWORD ReadData (int lvl, int ilat, int ilng, BYTE **outp)
-	{ return ReadData(Idx(lvl, ilat, ilng), outp); }
+	inline DWORD ReadData (int lvl, int ilat, int ilng, BYTE **outp, ZTreeTiming *tm = NULL)
+	{ return ReadData(Idx(lvl, ilat, ilng), outp, tm); }
+
+	DWORD Prefetch (int lvl, int ilat, int ilng, int depth = 0);
+	// Non-blocking readahead of a node and its descendants down to 'depth' levels
+	// below it (at most ZTREE_PREFETCHMAX nodes). Returns the number of nodes requested.
 
 	void ReleaseData (BYTE *data);
 
 	inline DWORD NodeSizeDeflated (DWORD idx) const { return toc.NodeSizeDeflated(idx); }
 	inline DWORD NodeSizeInflated (DWORD idx) const { return toc.NodeSizeInflated(idx); }
 
+	inline bool IsMapped () const { return view != NULL; }
+	// true if the archive is accessed through a memory-mapped view
+
+	inline DWORD Codec () const { return codec; }
+	// payload codec of the archive (ZTreeCodec::Type)
+
+	static void SetMapping (bool enable);
+	// select the backend for archives opened from now on (true: map if possible [default], false: positional reads)
+
 protected:
 	bool OpenArchive ();
+	bool OpenPositional ();
+	void BuildIndex ();
+	bool OpenMapping (const char *fname);
+	void CloseMapping ();
+	void CloseArchive ();
+	void ReadHeader (const TreeFileHeader &tfh);
+	void Warm (__int64 ofs, DWORD size);
 	inline DWORD Inflate (const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp);
 
 private:
 	char    *path;       ///< file path of the tree-file
+	DWORD   archiveId;   ///< unique archive key for the node cache
 	Layer   layer;	     ///< layer type (enum)
-	FILE    *treef;      ///< file pointer to tree-file
+	HANDLE  hFile;       ///< file handle of the tree-file
+	HANDLE  hMap;        ///< file mapping object (mapped backend)
+	const BYTE *view;    ///< mapped view of the entire tree-file (mapped backend)
+	__int64 viewsize;    ///< size of the mapped view [bytes]
 	TreeTOC toc;         ///< tree table of contents
 	DWORD   rootPos1;    ///< index of level-1 tile ((DWORD)-1 for not present)
 	DWORD   rootPos2;    ///< index of level-2 tile ((DWORD)-1 for not present)
 	DWORD   rootPos3;    ///< index of level-3 tile ((DWORD)-1 for not present)
 	DWORD   rootPos4[2]; ///< index of the level-4 tiles (quadtree roots; (DWORD)-1 for not present)
 	__int64 dofs;
+	DWORD   codec;       ///< payload codec (ZTreeCodec::Type)
+	DWORD   *nodeidx;    ///< dense node index for levels 4 to ZTREE_INDEXLVL (row-major per level)
+	DWORD   idxofs[ZTREE_INDEXLVL+1]; ///< offset of each level's table in nodeidx
+
+	static bool bMapping; ///< open archives through memory-mapped views
 };
 
 /// @}
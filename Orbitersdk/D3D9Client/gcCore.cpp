@@ -536,7 +536,20 @@ gcCore::PickGround gcCore::ScanScreen(int scr_x, int scr_y)
 //
 void * gcCore::SeekTileElevation(HPLANETMGR hMgr, int iLng, int iLat, int level, int flags, ElevInfo *pInfo)
 {
-	return NULL;
+	if (!hMgr) return NULL;
+	TileManager2<SurfTile> *pMgr = ((vPlanet *)(hMgr))->SurfMgr2();
+	if (!pMgr) return NULL;
+
+	const ElevGrid *grid = pMgr->SeekTileElevation(iLng, iLat, level, flags);
+	if (!grid) return NULL;
+
+	// The grid is shared with the tiles, it remains valid for the next ElevCache::nLent-1 calls
+	ElevCache::Global().Lend(grid);
+	if (pInfo && pInfo->Size >= sizeof(ElevInfo)) {
+		pInfo->Format = 32;
+		pInfo->Resolution = pMgr->ElevRes();
+	}
+	return grid->elev;
 }
 
 
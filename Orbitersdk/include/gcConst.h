@@ -902,8 +902,8 @@ public:
 
 	typedef struct {
 		WORD			Size;			///< sizeof(ElevInfo)
-		WORD			Format;
-		double			Resolution;
+		WORD			Format;			///< sample format of the returned grid (32 = float [m])
+		double			Resolution;		///< elevation resolution of the planet [m]
 	} ElevInfo;
 
 	typedef struct {
@@ -1320,6 +1320,21 @@ public:
 	*/
 	virtual bool			HasTileData(HPLANETMGR hMgr, int iLng, int iLat, int level, int flags);
 	virtual HSURFNATIVE		SeekTileTexture(HPLANETMGR hMgr, int iLng, int iLat, int level, int flags = 3, void *reserved = NULL);
+
+	/**
+	* \brief Get the elevation grid of a tile in the tile tree or in the elevation cache.
+	* \param hMgr handle to a tile/planet manager
+	* \param iLng longitude index
+	* \param iLat latitude index
+	* \param level level of the tile
+	* \param flags gcTileFlags::ELEVATION, other values return NULL
+	* \param pEI pointer to ElevInfo receiving the grid format, or NULL. Size must be set to sizeof(ElevInfo).
+	* On return Format is 32 (float samples in meters) and Resolution is the elevation resolution of the planet [m].
+	* \return NULL, or a read-only grid of 259 x 259 samples
+	* \note The client keeps the last 16 grids handed out, so a grid remains valid during the next 15 calls
+	* and up to 16 grids (e.g. a tile and its neighbours) can be used together. The 16 grids are shared by the
+	* whole process: calls from any add-on count toward the 15 calls.
+	*/
 	virtual void *			SeekTileElevation(HPLANETMGR hMgr, int iLng, int iLat, int level, int flags, ElevInfo *pEI);
 	
 
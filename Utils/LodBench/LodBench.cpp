@@ -0,0 +1,864 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// --------------------------------------------------------------
+// LodBench.cpp
+// Headless benchmark of the planetary quadtree LOD selection
+//
+//   LodBench [-path orbit|descent|flyover|<file.csv>] [-frames n]
+//            [-radius m] [-elev m] [-maxlvl n] [-aperture deg]
+//            [-height px] [-bias b] [-latency n] [-loads n]
+//            [-cache] [-csv out.csv]
+//
+// Replays a camera trajectory through a model of the client's tile
+// selection. It runs the client's code for the LOD metric and the
+// per-tile decision (TileLod.cpp, which TileManager2Base::ProcessNode
+// calls too) and for the frustum test (TileCull.cpp). The traversal
+// around them is a stub quadtree written after ProcessNode, not the
+// client's: there is no D3D device, the tiles carry their geometry
+// only, and a stub loader delivers requested tiles 'latency' frames
+// later, at most 'loads' tiles per frame, highest priority first. The
+// LOD worker threads, the GPU tile cache budget and the render list
+// are not modelled. Timings are those of the model.
+//
+// Reports per path the nodes visited, tiles rendered, splits and
+// merges (tiles starting or ending to be rendered through their
+// subtiles), loads and the CPU time of the selection per frame.
+// Without -path, the three synthetic paths are run in turn.
+//
+// Recorded paths are CSV files, one frame per line:
+//   x,y,z,fx,fy,fz,ux,uy,uz
+// camera position [m], view and up directions, in the planet frame
+// (y: north pole). Lines starting with '#' are skipped.
+//
+//   LodBench -cull [-frames n] [-reps n]
+//
+// Checks and times the frustum test instead: the boxes tested along
+// the three synthetic paths are run through TileCull, TileCullScalar
+// and the double precision test of Tile::InView (with its per-tile
+// matrix product). The vector kernels must never cull a box the
+// reference keeps. Build with LODBENCH_AVX for the AVX kernel.
+//
+//   LodBench -pool [-reps n]
+//
+// Times the quadtree node and tile allocation instead: subtrees of
+// the client's QuadTreeNode (Qtree.h) are pruned and regrown, with
+// the nodes and tiles on the heap, in their SlabPools freed node by
+// node, and freed in bulk by DelChildren.
+// --------------------------------------------------------------
+
+#include "TileLod.h"
+#include "TileCull.h"
+#ifdef _WIN32
+#include <crtdbg.h>
+#else
+#define _ASSERT(expr) ((void)0)
+#endif
+#include "Qtree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+static const double PI = 3.14159265358979323846;
+
+struct Vec {
+	double x, y, z;
+};
+
+static inline Vec V (double x, double y, double z) { Vec v = {x, y, z}; return v; }
+static inline Vec operator+ (const Vec &a, const Vec &b) { return V(a.x+b.x, a.y+b.y, a.z+b.z); }
+static inline Vec operator- (const Vec &a, const Vec &b) { return V(a.x-b.x, a.y-b.y, a.z-b.z); }
+static inline Vec operator* (const Vec &a, double f) { return V(a.x*f, a.y*f, a.z*f); }
+static inline double dotp (const Vec &a, const Vec &b) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+static inline Vec crossp (const Vec &a, const Vec &b) { return V(a.y*b.z-a.z*b.y, a.z*b.x-a.x*b.z, a.x*b.y-a.y*b.x); }
+static inline double length (const Vec &a) { return sqrt(dotp(a, a)); }
+static inline Vec unit (const Vec &a) { return a * (1.0/length(a)); }
+
+static inline Vec SpherePos (double lat, double lng) { return V(cos(lat)*cos(lng), sin(lat), cos(lat)*sin(lng)); }
+
+// =======================================================================
+
+struct Camera {
+	Vec pos;      ///< position in the planet frame [m]
+	Vec dir, up;  ///< view and up directions
+};
+
+struct BenchPrm {
+	double radius;   ///< planet radius [m]
+	double elev;     ///< maximum terrain elevation [m]
+	int    maxlvl;   ///< highest tile level (client level - 4)
+	double aperture; ///< half vertical field of view [rad]
+	double aspect;
+	int    height;   ///< viewport height [px]
+	double bias;     ///< resolution bias
+	int    latency;  ///< frames from a load request to the tile being available
+	int    loads;    ///< tiles delivered per frame
+	bool   cache;    ///< keep subtrees out of use (the client's tile cache, without budget)
+};
+
+/**
+ * \brief Frustum tests of one frame, recorded for the -cull check
+ */
+struct CullCase {
+	TileCullFrame frm;
+	std::vector<TileCullBox> box;
+};
+
+/**
+ * \brief Per-frame counters of the selection
+ */
+struct FrameStats {
+	int visited;   ///< nodes processed
+	int rendered;  ///< tiles rendered (ForRender)
+	int active;    ///< tiles rendered through their subtiles
+	int culled;    ///< tiles beyond the horizon or outside of the view frustum
+	int splits;    ///< tiles rendered through their subtiles, but not in the previous frame
+	int merges;    ///< tiles rendered themselves again after rendering their subtiles
+	int requests;  ///< tiles created and queued for loading
+	int deleted;   ///< tiles deleted
+	int tiles;     ///< tiles in the tree
+	double us;     ///< CPU time of the selection [us]
+};
+
+// =======================================================================
+/**
+ * \brief Stub of a surface tile: geometry and state only
+ */
+struct Node {
+	enum State { INVALID, QUEUED, LOADING, VALID };
+	enum Role { NONE, FORRENDER, ACTIVE, INVISIBLE };
+
+	int lvl, ilat, ilng;
+	Vec cnt;               ///< centre direction
+	TileCullBox box;       ///< bounding box in the planet frame
+	State state;
+	Role role;
+	int ready;             ///< frame the load completes
+	int rendered;          ///< latest frame the tile was rendered itself
+	float prio;            ///< load priority
+	Node *child[4];
+
+	Node (int _lvl, int _ilat, int _ilng, const BenchPrm &prm)
+		: lvl(_lvl), ilat(_ilat), ilng(_ilng), state(INVALID), role(NONE), ready(0), rendered(0), prio(0.0f)
+	{
+		int nlat = 1 << lvl, nlng = 2 << lvl;
+		double latmin = PI * (0.5 - (double)(ilat+1)/(double)nlat);
+		double latmax = PI * (0.5 - (double)ilat/(double)nlat);
+		double lngmin = 2.0*PI * (double)(ilng-nlng/2)/(double)nlng;
+		double lngmax = 2.0*PI * (double)(ilng-nlng/2+1)/(double)nlng;
+		cnt = SpherePos(0.5*(latmin+latmax), 0.5*(lngmin+lngmax));
+		memset(child, 0, sizeof(child));
+
+		// box aligned with the local east, north and up directions at the tile centre, enclosing
+		// the tile surface from sea level to the maximum elevation (the client's mesh boxes)
+		Vec up = cnt, east = unit(V(-sin(0.5*(lngmin+lngmax)), 0.0, cos(0.5*(lngmin+lngmax))));
+		Vec north = crossp(up, east);
+		double bmin[3] = {1e30, 1e30, 1e30}, bmax[3] = {-1e30, -1e30, -1e30};
+		const int ns = 4;
+		for (int i = 0; i <= ns; i++) {
+			for (int j = 0; j <= ns; j++) {
+				Vec p = SpherePos(latmin + (latmax-latmin)*i/ns, lngmin + (lngmax-lngmin)*j/ns);
+				for (int k = 0; k < 2; k++) {
+					Vec q = p * (prm.radius + k*prm.elev);
+					double c[3] = {dotp(q, east), dotp(q, north), dotp(q, up)};
+					for (int a = 0; a < 3; a++) {
+						bmin[a] = std::min(bmin[a], c[a]);
+						bmax[a] = std::max(bmax[a], c[a]);
+					}
+				}
+			}
+		}
+		// chords between the sample points: widen by the sagitta of the sample spacing
+		double sag = (prm.radius + prm.elev) * (1.0 - cos(0.5*(latmax-latmin)/ns));
+		double corner[8][3];
+		for (int v = 0; v < 8; v++) {
+			double e = (v & 1 ? bmax[0]+sag : bmin[0]-sag);
+			double n = (v & 2 ? bmax[1]+sag : bmin[1]-sag);
+			double u = (v & 4 ? bmax[2]+sag : bmin[2]-sag);
+			Vec q = east*e + north*n + up*u;
+			corner[v][0] = q.x, corner[v][1] = q.y, corner[v][2] = q.z;
+		}
+		TileCullSetBox(&box, corner);
+	}
+};
+
+// =======================================================================
+/**
+ * \brief Quadtree of stub tiles with the selection of ProcessNode
+ */
+class LodBench {
+public:
+	explicit LodBench (const BenchPrm &_prm) : prm(_prm), frame(0), st(NULL), trace(NULL)
+	{
+		lp.bias = prm.bias;
+		lp.tanap = tan(prm.aperture);
+		lp.rscale = 1400.0 / (double)prm.height;
+		lp.radius = prm.radius;
+		lp.maxlvl = prm.maxlvl;
+		ntiles = 0;
+		for (int i = 0; i < 2; i++) {
+			root[i] = New(0, 0, i);
+			root[i]->state = Node::VALID;
+		}
+	}
+
+	~LodBench ()
+	{
+		for (int i = 0; i < 2; i++) Delete(root[i]);
+	}
+
+	void Trace (std::vector<CullCase> *_trace) { trace = _trace; }
+	// record the frustum tests of the following frames
+
+	void Frame (const Camera &cam, FrameStats *fs)
+	{
+		memset(fs, 0, sizeof(FrameStats));
+		st = fs;
+		frame++;
+		Deliver();
+
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		SetCamera(cam);
+		if (trace) {
+			trace->push_back(CullCase());
+			trace->back().frm = frm;
+		}
+		for (int i = 0; i < 2; i++) Process(root[i]);
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+
+		fs->us = std::chrono::duration<double, std::micro>(t1-t0).count();
+		fs->tiles = ntiles;
+		Schedule();
+		st = NULL;
+	}
+
+private:
+	Node *New (int lvl, int ilat, int ilng)
+	{
+		ntiles++;
+		return new Node(lvl, ilat, ilng, prm);
+	}
+
+	void Delete (Node *node)
+	{
+		for (int i = 0; i < 4; i++)
+			if (node->child[i]) Delete(node->child[i]);
+		if (node->state == Node::QUEUED || node->state == Node::LOADING)
+			queue.erase(std::find(queue.begin(), queue.end(), node));
+		delete node;
+		ntiles--;
+		if (st) st->deleted++;
+	}
+
+	void DelChildren (Node *node)
+	{
+		for (int i = 0; i < 4; i++) {
+			if (node->child[i]) {
+				Delete(node->child[i]);
+				node->child[i] = NULL;
+			}
+		}
+	}
+
+	void SetCamera (const Camera &cam)
+	{
+		// the client's clip space: near plane at 1, far plane at infinity
+		double cdist = length(cam.pos);
+		cdir = cam.pos * (1.0/cdist);
+		cdist_r = cdist / prm.radius;
+		viewap = TileLodViewAp((cdist+5e3) / prm.radius, 0.002);
+
+		Vec f = unit(cam.dir), r = unit(crossp(cam.up, f)), u = crossp(f, r);
+		double sy = 1.0/lp.tanap, sx = sy/prm.aspect;
+		double m[4][4] = {
+			{r.x*sx, u.x*sy, f.x, f.x},
+			{r.y*sx, u.y*sy, f.y, f.y},
+			{r.z*sx, u.z*sy, f.z, f.z},
+			{0, 0, 0, 0}
+		};
+		m[3][0] = -dotp(cam.pos, r)*sx;
+		m[3][1] = -dotp(cam.pos, u)*sy;
+		m[3][2] = -dotp(cam.pos, f) - 1.0;
+		m[3][3] = -dotp(cam.pos, f);
+		TileCullSetFrame(&frm, m);
+	}
+
+	void Process (Node *node)
+	{
+		st->visited++;
+		Node::Role prev = node->role;
+		node->role = Node::FORRENDER;
+
+		// EvaluateTile
+		double adist = TileLodAngle(node->lvl, dotp(cdir, node->cnt));
+		bool horizon = (adist >= viewap), inview = true;
+		int tgt = -1;
+		float prio = 0.0f;
+		if (!horizon) {
+			double tdist;
+			tgt = TileLodTarget(&lp, node->lvl, node->ilat, prm.elev, adist, cdist_r, viewap, &tdist);
+			prio = float(tgt - node->lvl) + float(1.0 / (1.0 + tdist));
+			if (node->lvl) {
+				const TileCullBox *box = &node->box;
+				TileCull(&frm, &box, 1, &inview);
+				if (trace) trace->back().box.push_back(node->box);
+			}
+		}
+
+		TileLodStep step = TileLodDecide(node->lvl, horizon, inview, tgt);
+		if (step == TILELOD_HIDE) {
+			Release(node);
+			node->role = Node::INVISIBLE;
+			st->culled++;
+			return;
+		}
+		bool bstepdown = (step == TILELOD_DESCEND);
+
+		if (bstepdown) {
+			bool subcomplete = true;
+			for (int idx = 0; idx < 4; idx++) {
+				Node *child = node->child[idx];
+				if (!child) {
+					child = node->child[idx] = New(node->lvl+1, node->ilat*2 + idx/2, node->ilng*2 + idx%2);
+					child->state = Node::QUEUED;
+					queue.push_back(child);
+					st->requests++;
+				}
+				if (child->state == Node::QUEUED) child->prio = prio; // refresh the priority
+				if (child->state != Node::VALID) subcomplete = false;
+			}
+			if (subcomplete) {
+				node->role = Node::ACTIVE;
+				st->active++;
+				if (prev != Node::ACTIVE) st->splits++;
+				for (int i = 0; i < 4; i++) Process(node->child[i]);
+				return;
+			}
+		}
+
+		st->rendered++;
+		if (prev == Node::ACTIVE) st->merges++;
+		if (!bstepdown) {
+			if (prm.cache) Release(node);
+			else if (frame - node->rendered > 64) DelChildren(node);
+		}
+		node->rendered = frame;
+	}
+
+	void Release (Node *node)
+	{
+		if (prm.cache) { // deactivate, the subtree stays for reuse
+			for (int i = 0; i < 4; i++) {
+				Node *child = node->child[i];
+				if (child && child->role != Node::NONE) {
+					child->role = Node::NONE;
+					Release(child);
+				}
+			}
+		} else DelChildren(node);
+	}
+
+	void Schedule ()
+	{
+		// start the loads of the highest priority requests
+		std::sort(queue.begin(), queue.end(), [](const Node *a, const Node *b) {
+			if (a->state != b->state) return a->state == Node::LOADING;
+			return a->prio > b->prio;
+		});
+		int nloading = 0;
+		for (size_t i = 0; i < queue.size(); i++) {
+			Node *node = queue[i];
+			if (node->state == Node::LOADING) nloading++;
+			else if (nloading < prm.loads) {
+				node->state = Node::LOADING;
+				node->ready = frame + prm.latency;
+				nloading++;
+			}
+		}
+	}
+
+	void Deliver ()
+	{
+		for (size_t i = 0; i < queue.size(); ) {
+			Node *node = queue[i];
+			if (node->state == Node::LOADING && node->ready <= frame) {
+				node->state = Node::VALID;
+				queue[i] = queue.back();
+				queue.pop_back();
+			} else i++;
+		}
+	}
+
+	BenchPrm prm;
+	TileLodParam lp;
+	TileCullFrame frm;
+	Vec cdir;
+	double cdist_r, viewap;
+	Node *root[2];
+	std::vector<Node*> queue; ///< tiles queued or loading
+	int frame;
+	int ntiles;
+	FrameStats *st;           ///< counters of the running frame
+	std::vector<CullCase> *trace; ///< recorded frustum tests, if any
+};
+
+// =======================================================================
+// Camera trajectories, one camera per frame at 60 frames per second
+
+static const double dt = 1.0/60.0;
+
+static Vec Horizontal (const Vec &pos, const Vec &fwd)
+{
+	Vec up = unit(pos);
+	return unit(fwd - up*dotp(fwd, up));
+}
+
+static Camera LookAlong (const Vec &pos, const Vec &fwd, double pitch)
+{
+	// view direction 'pitch' below the local horizon, in the direction of 'fwd'
+	Camera cam;
+	Vec up = unit(pos), h = Horizontal(pos, fwd);
+	cam.pos = pos;
+	cam.dir = h*cos(pitch) - up*sin(pitch);
+	cam.up = unit(crossp(cam.dir, crossp(up, cam.dir)));
+	return cam;
+}
+
+static void OrbitPath (const BenchPrm &prm, int nframe, std::vector<Camera> &path)
+{
+	// 400 km circular orbit, inclined by 51.6 deg, looking 20 deg down along the track
+	double r = prm.radius + 400e3, w = sqrt(3.986e14/(r*r*r)), inc = 51.6*PI/180.0;
+	for (int i = 0; i < nframe; i++) {
+		double a = w*dt*i;
+		Vec p = V(r*cos(a), r*sin(a)*sin(inc), r*sin(a)*cos(inc));
+		Vec v = V(-sin(a), cos(a)*sin(inc), cos(a)*cos(inc));
+		path.push_back(LookAlong(p, v, 20.0*PI/180.0));
+	}
+}
+
+static void DescentPath (const BenchPrm &prm, int nframe, std::vector<Camera> &path)
+{
+	// exponential descent from 1000 km to 100 m altitude, drifting east, looking 45 deg down
+	double lat0 = 28.5*PI/180.0, lng0 = -80.6*PI/180.0;
+	for (int i = 0; i < nframe; i++) {
+		double f = (double)i / (double)std::max(1, nframe-1);
+		double alt = 1e6 * pow(1e-4, f);
+		double lng = lng0 - 0.2*(1.0-f);
+		Vec p = SpherePos(lat0, lng) * (prm.radius + alt);
+		path.push_back(LookAlong(p, V(-sin(lng), 0.0, cos(lng)), 45.0*PI/180.0));
+	}
+}
+
+static void FlyoverPath (const BenchPrm &prm, int nframe, std::vector<Camera> &path)
+{
+	// 1 km altitude at 1 km/s, looking 10 deg down, slowly turning
+	double lat = 46.5*PI/180.0, lng = 8.0*PI/180.0, hdg = 0.0;
+	for (int i = 0; i < nframe; i++) {
+		Vec up = SpherePos(lat, lng);
+		Vec east = V(-sin(lng), 0.0, cos(lng)), north = crossp(up, east);
+		Vec fwd = north*cos(hdg) + east*sin(hdg);
+		path.push_back(LookAlong(up * (prm.radius + 1e3), fwd, 10.0*PI/180.0));
+		double ds = 1e3*dt / prm.radius;
+		lat += ds*cos(hdg);
+		lng += ds*sin(hdg)/cos(lat);
+		hdg += 0.2*dt;
+	}
+}
+
+static bool ReadPath (const char *fname, std::vector<Camera> &path)
+{
+	FILE *f = fopen(fname, "r");
+	if (!f) {
+		fprintf(stderr, "Error: Failed to open %s\n", fname);
+		return false;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		Camera cam;
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf", &cam.pos.x, &cam.pos.y, &cam.pos.z,
+			&cam.dir.x, &cam.dir.y, &cam.dir.z, &cam.up.x, &cam.up.y, &cam.up.z) == 9)
+			path.push_back(cam);
+	}
+	fclose(f);
+	if (path.empty()) fprintf(stderr, "Error: No camera positions in %s\n", fname);
+	return !path.empty();
+}
+
+// =======================================================================
+
+static void Run (const char *name, const BenchPrm &prm, const std::vector<Camera> &path, FILE *csv)
+{
+	LodBench bench(prm);
+	std::vector<FrameStats> fs(path.size());
+	for (size_t i = 0; i < path.size(); i++) {
+		bench.Frame(path[i], &fs[i]);
+		if (csv) fprintf(csv, "%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.2f\n", name, (int)i, fs[i].visited, fs[i].rendered,
+			fs[i].active, fs[i].culled, fs[i].splits, fs[i].merges, fs[i].requests, fs[i].deleted, fs[i].tiles, fs[i].us);
+	}
+
+	double n = (double)path.size(), visited = 0, rendered = 0, splits = 0, merges = 0, requests = 0, tiles = 0;
+	std::vector<double> us(path.size());
+	for (size_t i = 0; i < path.size(); i++) {
+		visited += fs[i].visited, rendered += fs[i].rendered;
+		splits += fs[i].splits, merges += fs[i].merges, requests += fs[i].requests;
+		tiles += fs[i].tiles;
+		us[i] = fs[i].us;
+	}
+	std::sort(us.begin(), us.end());
+	double mean = 0;
+	for (size_t i = 0; i < us.size(); i++) mean += us[i];
+	printf("%-10s %6d %8.1f %8.1f %8.2f %8.2f %8.2f %8.0f %8.1f %8.1f %8.1f\n", name, (int)n, visited/n, rendered/n,
+		splits/n, merges/n, requests/n, tiles/n, mean/n, us[(size_t)(0.95*(n-1))], us.back());
+}
+
+// =======================================================================
+// Frustum test check and benchmark
+
+static volatile int cullsink; // keeps the timed tests from being optimised away
+
+static bool InViewReference (const double m[4][4], const TileCullBox &b)
+{
+	// Tile::InView: the tile's world matrix (a translation to the box centre, the
+	// corners are in tile coordinates) times the view-projection matrix, then
+	// each corner through the product, in double precision
+	double w[4][4] = {{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {b.c[0], b.c[1], b.c[2], 1}}, t[4][4];
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			t[i][j] = w[i][0]*m[0][j] + w[i][1]*m[1][j] + w[i][2]*m[2][j] + w[i][3]*m[3][j];
+
+	bool bx1 = false, bx2 = false, by1 = false, by2 = false, bz1 = false;
+	for (int v = 0; v < 8; v++) {
+		double p[4];
+		for (int j = 0; j < 4; j++)
+			p[j] = b.ex[v]*t[0][j] + b.ey[v]*t[1][j] + b.ez[v]*t[2][j] + t[3][j];
+		double hx = p[0]/p[3], hy = p[1]/p[3];
+		if (p[2] > 0.0) bz1 = true;
+		if (p[3] < 0.0) hx = -hx, hy = -hy;
+		if (hx > -1.0) bx1 = true;
+		if (hx <  1.0) bx2 = true;
+		if (hy > -1.0) by1 = true;
+		if (hy <  1.0) by2 = true;
+		if (bx1 && bx2 && by1 && by2 && bz1) return true;
+	}
+	return false;
+}
+
+static bool CullBench (const BenchPrm &prm, int nframe, int reps)
+{
+	// the boxes tested by the selection along the synthetic paths
+	std::vector<CullCase> cases;
+	for (int k = 0; k < 3; k++) {
+		std::vector<Camera> path;
+		if (k == 0) OrbitPath(prm, nframe, path);
+		else if (k == 1) DescentPath(prm, nframe, path);
+		else FlyoverPath(prm, nframe, path);
+		LodBench bench(prm);
+		bench.Trace(&cases);
+		FrameStats fs;
+		for (size_t i = 0; i < path.size(); i++) bench.Frame(path[i], &fs);
+	}
+
+	// agreement: the kernels may keep boxes the reference culls (within the
+	// rounding tolerance), but never cull one it keeps
+	long long nbox = 0, nref = 0, nfalse[2] = {0, 0}, nkeep[2] = {0, 0}, ndiff = 0;
+	for (size_t c = 0; c < cases.size(); c++) {
+		const CullCase &cc = cases[c];
+		size_t n = cc.box.size();
+		if (!n) continue;
+		std::vector<const TileCullBox*> box(n);
+		for (size_t i = 0; i < n; i++) box[i] = &cc.box[i];
+		bool *res[2] = {new bool[n], new bool[n]};
+		TileCull(&cc.frm, box.data(), (int)n, res[0]);
+		TileCullScalar(&cc.frm, box.data(), (int)n, res[1]);
+		for (size_t i = 0; i < n; i++) {
+			bool ref = InViewReference(cc.frm.m, cc.box[i]);
+			nref += ref;
+			for (int k = 0; k < 2; k++) {
+				if (ref && !res[k][i]) nfalse[k]++;
+				if (!ref && res[k][i]) nkeep[k]++;
+			}
+			if (res[0][i] != res[1][i]) ndiff++;
+		}
+		nbox += n;
+		delete []res[0];
+		delete []res[1];
+	}
+
+	// timing, frame by frame
+	double sec[3] = {0, 0, 0};
+	int sink = 0;
+	std::vector<const TileCullBox*> box;
+	bool *res = NULL;
+	int nres = 0;
+	for (size_t c = 0; c < cases.size(); c++) {
+		const CullCase &cc = cases[c];
+		int n = (int)cc.box.size();
+		if (!n) continue;
+		if (n > nres) {
+			delete []res;
+			res = new bool[nres = n];
+		}
+		box.resize(n);
+		for (int i = 0; i < n; i++) box[i] = &cc.box[i];
+		for (int k = 0; k < 3; k++) {
+			std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			for (int r = 0; r < reps; r++) {
+				if (k == 0) for (int i = 0; i < n; i++) res[i] = InViewReference(cc.frm.m, cc.box[i]);
+				else if (k == 1) TileCullScalar(&cc.frm, box.data(), n, res);
+				else TileCull(&cc.frm, box.data(), n, res);
+				sink += res[r % n];
+			}
+			sec[k] += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		}
+	}
+	delete []res;
+	cullsink = sink;
+
+	printf("Frustum test: %s, %lld boxes in %d frames, %lld in view (reference)\n", TileCullKernel(), nbox, (int)cases.size(), nref);
+	printf("%-10s %10s %10s %10s %10s\n", "test", "ns/box", "speedup", "culled_in", "kept_out");
+	const char *name[3] = {"reference", "scalar", TileCullKernel()};
+	for (int k = 0; k < 3; k++) {
+		double ns = nbox ? sec[k] * 1e9 / ((double)nbox * reps) : 0.0;
+		printf("%-10s %10.1f %9.2fx", name[k], ns, sec[k] > 0 ? sec[0] / sec[k] : 0.0);
+		if (k) printf(" %10lld %10lld\n", nfalse[2-k], nkeep[2-k]);
+		else printf(" %10s %10s\n", "-", "-");
+	}
+	printf("kernel and scalar disagree on %lld boxes\n", ndiff);
+	return !nfalse[0] && !nfalse[1];
+}
+
+// =======================================================================
+// Allocation benchmark: tree churn with heap and slab pool allocation
+
+static const int PoolTileSize = 512; ///< about the size of a SurfTile [bytes]
+
+/**
+ * \brief Tile stub of a QuadTreeNode, pooled like SurfTile and CloudTile
+ */
+struct PoolTile: public Pooled<PoolTile> {
+	char data[PoolTileSize];
+	void SetNode (QuadTreeNode<PoolTile> *) {}
+	bool PreDelete () { return true; }
+};
+
+/**
+ * \brief The same tree on the heap: QuadTreeNode before the slab pools
+ */
+struct HeapTile {
+	char data[PoolTileSize];
+};
+
+struct HeapNode {
+	HeapTile *entry;
+	HeapNode *parent;
+	HeapNode *child[4];
+
+	HeapNode (HeapNode *_parent, HeapTile *_entry) : entry(_entry), parent(_parent) { memset(child, 0, sizeof(child)); }
+	~HeapNode ()
+	{
+		for (int i = 0; i < 4; i++) delete child[i];
+		delete entry;
+	}
+};
+
+static int PoolGrow (QuadTreeNode<PoolTile> *node, int depth)
+{
+	if (!depth) return 0;
+	int n = 0;
+	for (int i = 0; i < 4; i++) {
+		n += 1 + PoolGrow(node->AddChild(i, new PoolTile), depth-1); // replaces an existing child
+	}
+	return n;
+}
+
+static int HeapGrow (HeapNode *node, int depth)
+{
+	if (!depth) return 0;
+	int n = 0;
+	for (int i = 0; i < 4; i++) {
+		delete node->child[i];
+		node->child[i] = new HeapNode(node, new HeapTile);
+		n += 1 + HeapGrow(node->child[i], depth-1);
+	}
+	return n;
+}
+
+static HeapNode *PickNode (HeapNode *root, int lvl, unsigned int &seed)
+{
+	for (int i = 0; i < lvl; i++) {
+		seed = seed * 1103515245u + 12345u;
+		root = root->child[(seed >> 16) & 3];
+	}
+	return root;
+}
+
+static QuadTreeNode<PoolTile> *PickNode (QuadTreeNode<PoolTile> *root, int lvl, unsigned int &seed)
+{
+	for (int i = 0; i < lvl; i++) {
+		seed = seed * 1103515245u + 12345u;
+		root = root->Child((seed >> 16) & 3);
+	}
+	return root;
+}
+
+static void PoolBench (int reps)
+{
+	// trees of 7 levels below two roots, of which subtrees of 4 levels are
+	// dropped and rebuilt, at random, as the camera moves
+	const int depth = 7, plvl = 3;
+	printf("%-14s %10s %10s %10s\n", "allocation", "nodes", "ns/node", "slab_kB");
+
+	for (int mode = 0; mode < 3; mode++) {
+		unsigned int seed = 1;
+		double sec = 0;
+		long long nnode = 0;
+		size_t kb = 0;
+		if (!mode) {
+			HeapNode *root[2] = { new HeapNode(NULL, new HeapTile), new HeapNode(NULL, new HeapTile) };
+			for (int i = 0; i < 2; i++) HeapGrow(root[i], depth);
+			for (int r = 0; r < reps; r++) {
+				HeapNode *node = PickNode(root[r & 1], plvl, seed);
+				auto t0 = std::chrono::steady_clock::now();
+				for (int i = 0; i < 4; i++) { delete node->child[i]; node->child[i] = NULL; }
+				nnode += HeapGrow(node, depth-plvl);
+				sec += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			}
+			for (int i = 0; i < 2; i++) delete root[i];
+		} else {
+			QuadTreeNode<PoolTile> *root[2] = { new QuadTreeNode<PoolTile>(NULL, new PoolTile), new QuadTreeNode<PoolTile>(NULL, new PoolTile) };
+			for (int i = 0; i < 2; i++) PoolGrow(root[i], depth);
+			for (int r = 0; r < reps; r++) {
+				QuadTreeNode<PoolTile> *node = PickNode(root[r & 1], plvl, seed);
+				auto t0 = std::chrono::steady_clock::now();
+				if (mode == 2) node->DelChildren(); // bulk free
+				nnode += PoolGrow(node, depth-plvl); // otherwise AddChild deletes the old children node by node
+				sec += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+			}
+			kb = (SlabPool<QuadTreeNode<PoolTile> >::Global().Bytes() + SlabPool<PoolTile>::Global().Bytes()) >> 10;
+			for (int i = 0; i < 2; i++) delete root[i];
+		}
+		const char *name[3] = { "heap", "pool", "pool+bulk" };
+		printf("%-14s %10lld %10.1f %10u\n", name[mode], nnode, nnode ? sec * 1e9 / nnode : 0.0, (unsigned int)kb);
+	}
+}
+
+// =======================================================================
+
+static void Usage ()
+{
+	fprintf(stderr,
+		"Usage: LodBench [-path orbit|descent|flyover|<file.csv>] [-frames n]\n"
+		"                [-radius m] [-elev m] [-maxlvl n] [-aperture deg]\n"
+		"                [-height px] [-bias b] [-latency n] [-loads n]\n"
+		"                [-cache] [-csv out.csv]\n"
+		"       LodBench -cull [-frames n] [-reps n]\n"
+		"       LodBench -pool [-reps n]\n"
+		"The -path mode replays the camera through a model of the client's\n"
+		"tile selection: the LOD metric, the per-tile decision and the frustum\n"
+		"test are the client's code, the quadtree walk, loader and release\n"
+		"around them are a stub. Its timings measure the model, not the client.\n");
+}
+
+int main (int argc, char *argv[])
+{
+	BenchPrm prm;
+	prm.radius = 6.371e6;
+	prm.elev = 8848.0;
+	prm.maxlvl = 15;
+	prm.aperture = 20.0*PI/180.0;
+	prm.aspect = 16.0/9.0;
+	prm.height = 1080;
+	prm.bias = 4.0;
+	prm.latency = 3;
+	prm.loads = 16;
+	prm.cache = false;
+	int nframe = 3000;
+	const char *pathname = NULL, *csvname = NULL;
+
+	if (argc >= 2 && !strcmp(argv[1], "-cull")) {
+		int reps = 100;
+		nframe = 600;
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "-frames") && i+1 < argc) nframe = std::max(1, atoi(argv[++i]));
+			else if (!strcmp(argv[i], "-reps") && i+1 < argc) reps = std::max(1, atoi(argv[++i]));
+			else {
+				Usage();
+				return 1;
+			}
+		}
+		return CullBench(prm, nframe, reps) ? 0 : 1;
+	}
+
+	if (argc >= 2 && !strcmp(argv[1], "-pool")) {
+		int reps = 2000;
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "-reps") && i+1 < argc) reps = std::max(1, atoi(argv[++i]));
+			else {
+				Usage();
+				return 1;
+			}
+		}
+		PoolBench(reps);
+		return 0;
+	}
+
+	for (int i = 1; i < argc; i++) {
+		bool arg = (i+1 < argc);
+		if      (!strcmp(argv[i], "-path") && arg)     pathname = argv[++i];
+		else if (!strcmp(argv[i], "-frames") && arg)   nframe = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-radius") && arg)   prm.radius = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-elev") && arg)     prm.elev = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-maxlvl") && arg)   prm.maxlvl = std::max(0, std::min(30, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "-aperture") && arg) prm.aperture = atof(argv[++i])*PI/180.0;
+		else if (!strcmp(argv[i], "-height") && arg)   prm.height = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-bias") && arg)     prm.bias = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-latency") && arg)  prm.latency = std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-loads") && arg)    prm.loads = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "-cache"))           prm.cache = true;
+		else if (!strcmp(argv[i], "-csv") && arg)      csvname = argv[++i];
+		else {
+			Usage();
+			return 1;
+		}
+	}
+
+	FILE *csv = NULL;
+	if (csvname) {
+		if (!(csv = fopen(csvname, "w"))) {
+			fprintf(stderr, "Error: Failed to open %s\n", csvname);
+			return 1;
+		}
+		fprintf(csv, "path,frame,visited,rendered,active,culled,splits,merges,requests,deleted,tiles,us\n");
+	}
+
+	printf("Frustum test: %s\n", TileCullKernel());
+	printf("%-10s %6s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "path", "frames", "visited", "rendered",
+		"splits", "merges", "loads", "tiles", "mean_us", "p95_us", "max_us");
+
+	const char *synth[3] = {"orbit", "descent", "flyover"};
+	for (int k = 0; k < 3; k++) {
+		if (pathname && strcmp(pathname, synth[k])) continue;
+		std::vector<Camera> path;
+		if (k == 0) OrbitPath(prm, nframe, path);
+		else if (k == 1) DescentPath(prm, nframe, path);
+		else FlyoverPath(prm, nframe, path);
+		Run(synth[k], prm, path, csv);
+	}
+	if (pathname && strcmp(pathname, "orbit") && strcmp(pathname, "descent") && strcmp(pathname, "flyover")) {
+		std::vector<Camera> path;
+		if (!ReadPath(pathname, path)) return 1;
+		Run("recorded", prm, path, csv);
+	}
+
+	if (csv) fclose(csv);
+	return 0;
+}
@@ -0,0 +1,1179 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// --------------------------------------------------------------
+// ZTreeTool.cpp
+// Command-line utilities for compressed tile trees (.tree files)
+//
+//   ZTreeTool repack <in.tree> <out.tree> [-codec zlib|lz4|zstd] [-level n]
+//     Re-encode all node payloads with another codec and report
+//     the size and decode throughput of both archives.
+//
+//   ZTreeTool reorder <in.tree> <out.tree> [-order dfs|morton]
+//     Renumber the nodes so that related payloads sit next to each
+//     other in the file, and report the read locality before and after.
+//
+//   ZTreeTool scan <planet dir> [-threads n] [-positional]
+//     Inflate every node of every archive of a planet through ZTreeMgr,
+//     check the node sizes and report throughput and compression per level.
+//
+//   ZTreeTool stress <planet dir> [-threads n] [-reps n] [-positional]
+//     Read overlapping random nodes of every archive of a planet from
+//     several threads at once, with the node cache disabled and enabled,
+//     and check every payload against a single-threaded reference read.
+//
+//   ZTreeTool idxbench <planet dir> [-reps n]
+//     Look up every node of every archive of a planet through ZTreeMgr's
+//     dense node index and through a recursive descent from the roots,
+//     check that both agree and report the lookup time of each.
+//
+//   ZTreeTool elevbench [-reps n]
+//     Time the decode of elevation payloads of each format into the
+//     client's elevation grids, and check it against the reference, and
+//     the recovery of the int16 samples from the float grid.
+//
+// Built against the client's ZTreeMgr.cpp with ZTREE_STANDALONE and
+// ElevDecode.cpp, see CMakeLists.txt. On Linux, compat/ stands in for windows.h.
+// --------------------------------------------------------------
+
+#include "ZTreeMgr.h"
+#include "ElevDecode.h"
+#include "Log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+// =======================================================================
+// Log output of the shared ZTreeMgr code
+
+void LogErr (const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fputs("Error: ", stderr);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+void LogAlw (const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+}
+
+// =======================================================================
+/**
+ * \brief Read access to a tree file and the operations built on it
+ */
+class ZTreeTool {
+public:
+	enum Order {
+		ORDER_KEEP,   ///< keep the node order of the source file
+		ORDER_DFS,    ///< depth-first: sibling blocks, each followed by the subtrees of its members
+		ORDER_MORTON  ///< level by level, Morton (Z-order) within each level
+	};
+
+	ZTreeTool () : f(NULL) {}
+	~ZTreeTool () { if (f) fclose(f); }
+
+	bool Open (const char *fname);
+	// read header and TOC of a tree file
+
+	DWORD ReadNode (DWORD idx, std::vector<BYTE> &zbuf);
+	// read the encoded payload of a node. Returns its size
+
+	bool Repack (const char *fname, DWORD codec, int level);
+	// write a copy of the archive with all payloads re-encoded with 'codec'
+
+	bool Reorder (const char *fname, Order order);
+	// write a copy of the archive with the nodes renumbered in 'order'
+
+	static bool Scan (const char *planetdir, int nthread);
+	// inflate all nodes of all archives of a planet on 'nthread' threads. Returns false on any error
+
+	static bool Stress (const char *planetdir, int nthread, int reps);
+	// read random nodes of all archives of a planet concurrently on 'nthread' threads, 'reps' times
+	// the sample each. Returns false if any payload differs from the single-threaded reference
+
+	static bool IdxBench (const char *planetdir, int reps);
+	// time ZTreeMgr::Idx against a recursive descent. Returns false if they disagree on any node
+
+	static bool ElevBench (int reps);
+	// time the elevation decode of each payload format. Returns false if a kernel differs from the reference
+
+private:
+	struct Throughput {
+		Throughput () : nbytes(0), sec(0) {}
+		inline double MBps () const { return sec > 0 ? nbytes / sec / 1048576.0 : 0; }
+		double nbytes;   ///< decoded data [bytes]
+		double sec;      ///< decode time [s]
+	};
+	struct NodePos {
+		int lvl;         ///< tree level (0: not reachable from the roots)
+		DWORD ilat;      ///< latitude index
+		DWORD ilng;      ///< longitude index
+	};
+
+	static DWORD TimedDecode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp, Throughput &tp);
+	static void PrintLocality (const char *label, const TreeFileHeader &hdr, const TreeTOC &t);
+
+	void LocateNodes (std::vector<NodePos> &np) const;
+	// tile coordinates of all nodes
+
+	DWORD IdxRecursive (int lvl, int ilat, int ilng) const;
+	// node index of a tile by descent from the roots, as ZTreeMgr::Idx did before the dense index
+
+	void SortNodes (Order order, std::vector<DWORD> &seq) const;
+	// source node indices in the requested order
+
+	bool Write (const char *fname, const std::vector<DWORD> &seq, DWORD codec, int level, Throughput *tpin, Throughput *tpout);
+	// write the nodes in sequence 'seq'. Payloads are re-encoded if throughput records are passed, copied otherwise
+
+	FILE *f;             ///< tree file
+	TreeFileHeader tfh;  ///< file header
+	TreeTOC toc;         ///< table of contents
+};
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::Open (const char *fname)
+{
+	if (!(f = fopen(fname, "rb"))) {
+		LogErr("Cannot open [%s]", fname);
+		return false;
+	}
+	if (!tfh.fread(f)) {
+		LogErr("[%s] is not a tree file", fname);
+		return false;
+	}
+	if (fseek64(f, tfh.size, SEEK_SET) || toc.fread(tfh.nodeCount, f) != tfh.nodeCount) {
+		LogErr("[%s]: cannot read the table of contents", fname);
+		return false;
+	}
+	toc.totlength = tfh.dataLength;
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeTool::ReadNode (DWORD idx, std::vector<BYTE> &zbuf)
+{
+	DWORD zsize = toc.NodeSizeDeflated(idx);
+	zbuf.resize(zsize);
+	if (!zsize) return 0;
+	if (fseek64(f, tfh.dataOfs + toc[idx].pos, SEEK_SET) || ::fread(zbuf.data(), 1, zsize, f) != zsize) {
+		return 0;
+	}
+	return zsize;
+}
+
+// -----------------------------------------------------------------------
+
+DWORD ZTreeTool::TimedDecode (DWORD codec, const BYTE *inp, DWORD ninp, BYTE *outp, DWORD noutp, Throughput &tp)
+{
+	auto t0 = std::chrono::high_resolution_clock::now();
+	DWORD ndata = ZTreeCodec::Decode(codec, inp, ninp, outp, noutp);
+	auto t1 = std::chrono::high_resolution_clock::now();
+	tp.sec += std::chrono::duration<double>(t1 - t0).count();
+	tp.nbytes += ndata;
+	return ndata;
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::Repack (const char *fname, DWORD codec, int level)
+{
+	DWORD srccodec = tfh.Codec();
+	if (!ZTreeCodec::Supported(srccodec) || !ZTreeCodec::Supported(codec)) {
+		LogErr("Codec %s is not supported by this build", ZTreeCodec::Name(ZTreeCodec::Supported(codec) ? srccodec : codec));
+		return false;
+	}
+
+	std::vector<DWORD> seq;
+	SortNodes(ORDER_KEEP, seq);
+	Throughput tpin, tpout;
+	if (!Write(fname, seq, codec, level, &tpin, &tpout)) {
+		return false;
+	}
+
+	__int64 nout = 0;
+	FILE *fo = fopen(fname, "rb");
+	TreeFileHeader ohdr;
+	if (fo && ohdr.fread(fo)) nout = ohdr.dataLength;
+	if (fo) fclose(fo);
+
+	printf("nodes            : %u\n", tfh.nodeCount);
+	printf("inflated         : %.1f MB\n", tpin.nbytes / 1048576.0);
+	printf("%-5s size       : %.1f MB (%.1f%%)\n", ZTreeCodec::Name(srccodec), tfh.dataLength / 1048576.0, tpin.nbytes ? 100.0 * tfh.dataLength / tpin.nbytes : 0.0);
+	printf("%-5s size       : %.1f MB (%.1f%%)\n", ZTreeCodec::Name(codec), nout / 1048576.0, tpin.nbytes ? 100.0 * nout / tpin.nbytes : 0.0);
+	printf("%-5s decode     : %.0f MB/s\n", ZTreeCodec::Name(srccodec), tpin.MBps());
+	printf("%-5s decode     : %.0f MB/s\n", ZTreeCodec::Name(codec), tpout.MBps());
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::Reorder (const char *fname, Order order)
+{
+	std::vector<DWORD> seq;
+	SortNodes(order, seq);
+	if (!Write(fname, seq, tfh.Codec(), -1, NULL, NULL)) {
+		return false;
+	}
+
+	ZTreeTool out;
+	if (!out.Open(fname)) {
+		return false;
+	}
+	printf("nodes            : %u\n", tfh.nodeCount);
+	PrintLocality("before", tfh, toc);
+	PrintLocality("after", out.tfh, out.toc);
+	return true;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeTool::LocateNodes (std::vector<NodePos> &np) const
+{
+	DWORD n = toc.size();
+	NodePos none = { 0, 0, 0 };
+	np.assign(n, none);
+
+	std::vector<DWORD> stack;
+	DWORD root[3] = { tfh.rootPos1, tfh.rootPos2, tfh.rootPos3 };
+	for (int i = 0; i < 3; i++) {
+		if (root[i] < n) {
+			NodePos p = { i+1, 0, 0 };
+			np[root[i]] = p;
+		}
+	}
+	for (DWORD i = 0; i < 2; i++) {
+		if (tfh.rootPos4[i] < n) {
+			NodePos p = { 4, 0, i };
+			np[tfh.rootPos4[i]] = p;
+			stack.push_back(tfh.rootPos4[i]);
+		}
+	}
+	while (stack.size()) {
+		DWORD idx = stack.back();
+		stack.pop_back();
+		for (DWORD c = 0; c < 4; c++) {
+			DWORD cidx = toc[idx].child[c];
+			if (cidx >= n || np[cidx].lvl) continue; // no child, or corrupt tree
+			NodePos p = { np[idx].lvl+1, np[idx].ilat*2 + (c >> 1), np[idx].ilng*2 + (c & 1) };
+			np[cidx] = p;
+			stack.push_back(cidx);
+		}
+	}
+}
+
+// -----------------------------------------------------------------------
+
+static UINT64 Morton (DWORD ilat, DWORD ilng)
+{
+	UINT64 m = 0;
+	for (int i = 0; i < 32; i++) {
+		m |= ((UINT64)((ilng >> i) & 1) << (2*i)) | ((UINT64)((ilat >> i) & 1) << (2*i+1));
+	}
+	return m;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeTool::SortNodes (Order order, std::vector<DWORD> &seq) const
+{
+	DWORD i, n = toc.size();
+	seq.clear();
+	seq.reserve(n);
+
+	if (order == ORDER_KEEP) {
+		for (i = 0; i < n; i++) seq.push_back(i);
+		return;
+	}
+
+	std::vector<NodePos> np;
+	LocateNodes(np);
+	std::vector<bool> done(n, false);
+
+	// levels 1-3 are single nodes outside the quadtrees
+	DWORD root[3] = { tfh.rootPos1, tfh.rootPos2, tfh.rootPos3 };
+	for (i = 0; i < 3; i++) {
+		if (root[i] < n && !done[root[i]]) {
+			seq.push_back(root[i]);
+			done[root[i]] = true;
+		}
+	}
+
+	if (order == ORDER_DFS) {
+		// A node's children are written as one block (they are loaded together when
+		// the node is subdivided), followed by the subtrees of the children in turn
+		std::vector<DWORD> stack;
+		for (i = 0; i < 2; i++) {
+			DWORD root4 = tfh.rootPos4[i];
+			if (root4 >= n || done[root4]) continue;
+			seq.push_back(root4);
+			done[root4] = true;
+			stack.push_back(root4);
+			while (stack.size()) {
+				DWORD idx = stack.back();
+				stack.pop_back();
+				DWORD cidx[4], nc = 0;
+				for (int c = 0; c < 4; c++) {
+					DWORD k = toc[idx].child[c];
+					if (k >= n || done[k]) continue;
+					seq.push_back(k);
+					done[k] = true;
+					cidx[nc++] = k;
+				}
+				while (nc) stack.push_back(cidx[--nc]); // subtree of child 0 comes first
+			}
+		}
+	} else { // ORDER_MORTON
+		std::vector<DWORD> lvlseq;
+		for (i = 0; i < n; i++) {
+			if (np[i].lvl >= 4 && !done[i]) lvlseq.push_back(i);
+		}
+		std::sort(lvlseq.begin(), lvlseq.end(), [&np](DWORD a, DWORD b) {
+			if (np[a].lvl != np[b].lvl) return np[a].lvl < np[b].lvl;
+			return Morton(np[a].ilat, np[a].ilng) < Morton(np[b].ilat, np[b].ilng);
+		});
+		for (i = 0; i < lvlseq.size(); i++) {
+			seq.push_back(lvlseq[i]);
+			done[lvlseq[i]] = true;
+		}
+	}
+
+	// nodes the tree doesn't reach are kept, in their original order
+	for (i = 0; i < n; i++) {
+		if (!done[i]) seq.push_back(i);
+	}
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::Write (const char *fname, const std::vector<DWORD> &seq, DWORD codec, int level, Throughput *tpin, Throughput *tpout)
+{
+	DWORD srccodec = tfh.Codec();
+	DWORD i, n = toc.size();
+	bool recode = (tpin != NULL);
+
+	// seq maps new to old node indices, remap maps old to new
+	std::vector<DWORD> remap(n);
+	for (i = 0; i < n; i++) remap[seq[i]] = i;
+	auto Remap = [&remap, n](DWORD idx) { return idx < n ? remap[idx] : (DWORD)-1; };
+
+	FILE *fo = fopen(fname, "wb");
+	if (!fo) {
+		LogErr("Cannot create [%s]", fname);
+		return false;
+	}
+
+	// Header and TOC are written once up front to reserve the space and
+	// again when the payload positions are known.
+	TreeFileHeader ohdr = tfh;
+	ohdr.flags = (tfh.flags & ~ZTREE_CODEC_MASK) | codec;
+	ohdr.size = sizeof(TreeFileHeader);
+	ohdr.dataOfs = sizeof(TreeFileHeader) + n * sizeof(TreeNode);
+	ohdr.rootPos1 = Remap(tfh.rootPos1);
+	ohdr.rootPos2 = Remap(tfh.rootPos2);
+	ohdr.rootPos3 = Remap(tfh.rootPos3);
+	for (i = 0; i < 2; i++) ohdr.rootPos4[i] = Remap(tfh.rootPos4[i]);
+
+	TreeTOC otoc;
+	otoc.tree = new TreeNode[otoc.ntree = otoc.ntreebuf = n];
+	for (i = 0; i < n; i++) {
+		otoc.tree[i] = toc[seq[i]];
+		for (int c = 0; c < 4; c++) otoc.tree[i].child[c] = Remap(otoc.tree[i].child[c]);
+	}
+	ohdr.fwrite(fo);
+	otoc.fwrite(fo);
+
+	std::vector<BYTE> zbuf, ebuf, obuf, vbuf;
+	__int64 pos = 0;
+	bool ok = true;
+
+	for (i = 0; i < n; i++) {
+		DWORD idx = seq[i];
+		DWORD esize = toc.NodeSizeInflated(idx);
+		otoc.tree[i].pos = pos;
+		if (!esize) continue; // no data, but has descendants with data
+
+		DWORD zsize = ReadNode(idx, zbuf), osize = zsize;
+		if (!zsize) {
+			LogErr("Node %u: read error", idx);
+			ok = false;
+			break;
+		}
+
+		if (recode) {
+			ebuf.resize(esize);
+			if (TimedDecode(srccodec, zbuf.data(), zsize, ebuf.data(), esize, *tpin) != esize) {
+				LogErr("Node %u: cannot decode source payload", idx);
+				ok = false;
+				break;
+			}
+			obuf.resize(ZTreeCodec::EncodeBound(codec, esize));
+			osize = ZTreeCodec::Encode(codec, ebuf.data(), esize, obuf.data(), (DWORD)obuf.size(), level);
+
+			// verify the round trip, and time the new codec on the way
+			vbuf.resize(esize);
+			if (!osize || TimedDecode(codec, obuf.data(), osize, vbuf.data(), esize, *tpout) != esize || vbuf != ebuf) {
+				LogErr("Node %u: %s round trip failed", idx, ZTreeCodec::Name(codec));
+				ok = false;
+				break;
+			}
+		}
+		if (::fwrite(recode ? obuf.data() : zbuf.data(), 1, osize, fo) != osize) {
+			LogErr("Write error on [%s]", fname);
+			ok = false;
+			break;
+		}
+		pos += osize;
+	}
+
+	if (ok) {
+		otoc.totlength = ohdr.dataLength = pos;
+		ok = !fseek64(fo, 0, SEEK_SET) && ohdr.fwrite(fo) == 1 && otoc.fwrite(fo) == n;
+	}
+	ok = (fclose(fo) == 0) && ok;
+	if (!ok) {
+		remove(fname);
+	}
+	return ok;
+}
+
+// -----------------------------------------------------------------------
+
+void ZTreeTool::PrintLocality (const char *label, const TreeFileHeader &hdr, const TreeTOC &t)
+{
+	// Gap: file distance between the payload of a node and the payload of its
+	// nearest ancestor with data, i.e. the seek of a descent through the tree.
+	// Sibling groups are contiguous if the children's payloads form one block.
+	DWORD n = t.size();
+	double gapsum = 0;
+	DWORD nedge = 0, nadj = 0, nnear = 0, ngroup = 0, ncontig = 0;
+	std::vector<std::pair<DWORD,DWORD> > stack; // node, ancestor with data
+	std::vector<bool> seen(n, false);
+
+	for (int i = 0; i < 2; i++) {
+		if (hdr.rootPos4[i] < n) stack.push_back(std::make_pair(hdr.rootPos4[i], (DWORD)-1));
+	}
+	while (stack.size()) {
+		DWORD idx = stack.back().first, anc = stack.back().second;
+		stack.pop_back();
+		if (seen[idx]) continue;
+		seen[idx] = true;
+
+		__int64 pos = t[idx].pos, end = pos + t.NodeSizeDeflated(idx);
+		if (t.NodeSizeInflated(idx)) {
+			if (anc != (DWORD)-1) {
+				__int64 apos = t[anc].pos, aend = apos + t.NodeSizeDeflated(anc);
+				__int64 gap = (pos >= aend ? pos - aend : end <= apos ? apos - end : 0);
+				gapsum += (double)gap;
+				nedge++;
+				if (!gap) nadj++;
+				if (gap <= 65536) nnear++;
+			}
+			anc = idx;
+		}
+
+		__int64 cmin = 0, cmax = 0, csum = 0;
+		DWORD nc = 0;
+		for (int c = 0; c < 4; c++) {
+			DWORD cidx = t[idx].child[c];
+			if (cidx >= n) continue;
+			stack.push_back(std::make_pair(cidx, anc));
+			DWORD csize = t.NodeSizeDeflated(cidx);
+			if (!t.NodeSizeInflated(cidx)) continue;
+			if (!nc || t[cidx].pos < cmin) cmin = t[cidx].pos;
+			if (!nc || t[cidx].pos + csize > cmax) cmax = t[cidx].pos + csize;
+			csum += csize;
+			nc++;
+		}
+		if (nc > 1) {
+			ngroup++;
+			if (cmax - cmin == csum) ncontig++;
+		}
+	}
+
+	printf("%-6s           : gap %.1f KB mean, %.1f%% adjacent, %.1f%% within 64 KB, %.1f%% sibling groups contiguous\n", label,
+		nedge ? gapsum / nedge / 1024.0 : 0.0,
+		nedge ? 100.0 * nadj / nedge : 0.0,
+		nedge ? 100.0 * nnear / nedge : 0.0,
+		ngroup ? 100.0 * ncontig / ngroup : 0.0);
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::Scan (const char *planetdir, int nthread)
+{
+	const char *name[6] = { "Surf", "Mask", "Elev", "Elev_mod", "Label", "Cloud" };
+	const int maxlvl = 32;
+	double ztotal = 0, etotal = 0, sectotal = 0;
+	DWORD narchive = 0, errtotal = 0;
+
+	for (int layer = ZTreeMgr::LAYER_SURF; layer <= ZTreeMgr::LAYER_CLOUD; layer++) {
+		ZTreeMgr *mgr = ZTreeMgr::CreateFromFile(planetdir, (ZTreeMgr::Layer)layer);
+		if (!mgr) continue;
+		narchive++;
+
+		// node levels, from a walk down the tree
+		const TreeTOC &t = mgr->TOC();
+		DWORD i, n = t.size();
+		std::vector<BYTE> lvl(n, 0);
+		std::vector<DWORD> stack;
+		for (int l = 1; l <= 3; l++) {
+			DWORD idx = mgr->Idx(l, 0, 0);
+			if (idx < n) lvl[idx] = (BYTE)l;
+		}
+		for (int r = 0; r < 2; r++) {
+			DWORD idx = mgr->Idx(4, 0, r);
+			if (idx < n && !lvl[idx]) { lvl[idx] = 4; stack.push_back(idx); }
+		}
+		while (stack.size()) {
+			DWORD idx = stack.back();
+			stack.pop_back();
+			for (int c = 0; c < 4; c++) {
+				DWORD cidx = t[idx].child[c];
+				if (cidx >= n || lvl[cidx]) continue;
+				lvl[cidx] = (BYTE)(lvl[idx]+1 < maxlvl ? lvl[idx]+1 : maxlvl-1);
+				stack.push_back(cidx);
+			}
+		}
+
+		// inflate everything
+		std::atomic<DWORD> next(0), nerr(0);
+		std::vector<std::thread> pool;
+		auto t0 = std::chrono::high_resolution_clock::now();
+		for (int k = 0; k < nthread; k++) {
+			pool.push_back(std::thread([&]() {
+				DWORD idx;
+				while ((idx = next++) < n) {
+					DWORD esize = mgr->NodeSizeInflated(idx);
+					if (!esize) continue;
+					BYTE *buf = NULL;
+					DWORD ndata = mgr->ReadData(idx, &buf);
+					if (ndata != esize && nerr++ < 10) {
+						LogErr("%s.tree node %u: inflated %u bytes, TOC says %u", name[layer], idx, ndata, esize);
+					}
+					mgr->ReleaseData(buf);
+				}
+			}));
+		}
+		for (auto &th : pool) th.join();
+		double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+
+		// per-level statistics
+		DWORD lnode[maxlvl] = { 0 };
+		double lz[maxlvl] = { 0 }, le[maxlvl] = { 0 }, z = 0, e = 0;
+		for (i = 0; i < n; i++) {
+			DWORD esize = t.NodeSizeInflated(i);
+			if (!esize) continue;
+			lnode[lvl[i]]++;
+			lz[lvl[i]] += t.NodeSizeDeflated(i);
+			le[lvl[i]] += esize;
+		}
+		for (int l = 0; l < maxlvl; l++) { z += lz[l]; e += le[l]; }
+
+		printf("%s.tree: %u nodes, %s, %s, %.1f MB -> %.1f MB, %.0f MB/s, %u errors\n", name[layer], n,
+			ZTreeCodec::Name(mgr->Codec()), mgr->IsMapped() ? "mapped" : "positional",
+			z / 1048576.0, e / 1048576.0, sec > 0 ? e / sec / 1048576.0 : 0.0, (DWORD)nerr);
+		printf("  lvl     nodes   deflated   inflated  ratio\n");
+		for (int l = 0; l < maxlvl; l++) {
+			if (!lnode[l]) continue;
+			printf("  %3s %9u %7.1f MB %7.1f MB %5.1f%%\n", l ? std::to_string(l).c_str() : "-", lnode[l],
+				lz[l] / 1048576.0, le[l] / 1048576.0, le[l] ? 100.0 * lz[l] / le[l] : 0.0);
+		}
+
+		ztotal += z;
+		etotal += e;
+		sectotal += sec;
+		errtotal += nerr;
+		delete mgr;
+	}
+
+	if (!narchive) {
+		LogErr("No archives found in [%s/Archive]", planetdir);
+		return false;
+	}
+	printf("total: %u archives, %.1f MB -> %.1f MB, %.0f MB/s inflated (%.0f MB/s deflated) on %d threads, %u errors\n",
+		narchive, ztotal / 1048576.0, etotal / 1048576.0,
+		sectotal > 0 ? etotal / sectotal / 1048576.0 : 0.0, sectotal > 0 ? ztotal / sectotal / 1048576.0 : 0.0,
+		nthread, errtotal);
+	return errtotal == 0;
+}
+
+// -----------------------------------------------------------------------
+// Concurrent read check. A sample of nodes is read once on one thread
+// without the cache as the reference. Then all threads read random nodes
+// of the sample at the same time, half of them from a small hot set so
+// that the threads meet on the same nodes and cache entries. The cache
+// budget holds half of the sample, so entries are evicted while readers
+// still hold them.
+
+static DWORD Checksum (const BYTE *data, DWORD ndata)
+{
+	DWORD h = 2166136261u; // FNV-1a
+	for (DWORD i = 0; i < ndata; i++) h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+bool ZTreeTool::Stress (const char *planetdir, int nthread, int reps)
+{
+	const char *name[6] = { "Surf", "Mask", "Elev", "Elev_mod", "Label", "Cloud" };
+	const DWORD maxsample = 4096, nhot = 64;
+	DWORD narchive = 0, errtotal = 0;
+	ZTreeCache &cache = ZTreeCache::Global();
+
+	for (int layer = ZTreeMgr::LAYER_SURF; layer <= ZTreeMgr::LAYER_CLOUD; layer++) {
+		ZTreeMgr *mgr = ZTreeMgr::CreateFromFile(planetdir, (ZTreeMgr::Layer)layer);
+		if (!mgr) continue;
+		narchive++;
+
+		// random sample of the nodes with data
+		DWORD i, n = mgr->TOC().size();
+		std::vector<DWORD> sample;
+		for (i = 0; i < n; i++)
+			if (mgr->NodeSizeInflated(i)) sample.push_back(i);
+		DWORD ndatanode = (DWORD)sample.size();
+		srand(layer+1);
+		for (i = 0; i < ndatanode && i < maxsample; i++)
+			std::swap(sample[i], sample[i + (DWORD)(((double)rand() / ((double)RAND_MAX + 1.0)) * (ndatanode - i))]);
+		if (sample.size() > maxsample) sample.resize(maxsample);
+		DWORD ns = (DWORD)sample.size();
+		if (!ns) {
+			printf("%s.tree: no nodes with data\n", name[layer]);
+			delete mgr;
+			continue;
+		}
+
+		// single-threaded reference, without the cache
+		cache.SetBudget(0);
+		DWORD nerr = 0;
+		std::vector<DWORD> refsize(ns), refsum(ns);
+		double bytes = 0;
+		for (i = 0; i < ns; i++) {
+			BYTE *buf = NULL;
+			refsize[i] = mgr->ReadData(sample[i], &buf);
+			refsum[i] = Checksum(buf, refsize[i]);
+			if (refsize[i] != mgr->NodeSizeInflated(sample[i]) && nerr++ < 10)
+				LogErr("%s.tree node %u: inflated %u bytes, TOC says %u", name[layer], sample[i], refsize[i], mgr->NodeSizeInflated(sample[i]));
+			mgr->ReleaseData(buf);
+			bytes += refsize[i];
+		}
+
+		DWORD nread = ns * reps;
+		printf("%s.tree: %u of %u nodes, %s, %d threads x %u reads\n", name[layer], ns, ndatanode,
+			mgr->IsMapped() ? "mapped" : "positional", nthread, nread);
+		printf("  cache        reads/s      hits    misses evictions  errors\n");
+
+		for (int c = 0; c < 2; c++) {
+			__int64 budget = (c ? (__int64)(bytes / 2) : 0);
+			cache.SetBudget(0); // start empty
+			cache.SetBudget(budget);
+			ZTreeCache::Stats s0;
+			cache.GetStats(&s0);
+
+			std::atomic<DWORD> cerr(0);
+			std::vector<std::thread> pool;
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for (int k = 0; k < nthread; k++) {
+				pool.push_back(std::thread([&, k]() {
+					DWORD x = 2463534242u + 7919u * k; // xorshift32, one sequence per thread
+					for (DWORD r = 0; r < nread; r++) {
+						x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+						DWORD j = ((r & 1) ? x % (ns < nhot ? ns : nhot) : x % ns);
+						BYTE *buf = NULL;
+						DWORD ndata = mgr->ReadData(sample[j], &buf);
+						if ((ndata != refsize[j] || Checksum(buf, ndata) != refsum[j]) && cerr++ < 10)
+							LogErr("%s.tree node %u: payload differs from the reference (%u bytes, %s cache)", name[layer],
+								sample[j], ndata, budget ? "with" : "no");
+						mgr->ReleaseData(buf);
+					}
+				}));
+			}
+			for (auto &th : pool) th.join();
+			double sec = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+
+			ZTreeCache::Stats s1;
+			cache.GetStats(&s1);
+			std::string label = (budget ? std::to_string(budget >> 10) + " KB" : std::string("off"));
+			printf("  %-10s %9.0f %9u %9u %9u %7u\n", label.c_str(), sec > 0 ? (double)nread * nthread / sec : 0.0,
+				s1.hits - s0.hits, s1.misses - s0.misses, s1.evictions - s0.evictions, (DWORD)cerr);
+			nerr += cerr;
+		}
+
+		cache.SetBudget(0);
+		errtotal += nerr;
+		delete mgr;
+	}
+
+	if (!narchive) {
+		LogErr("No archives found in [%s/Archive]", planetdir);
+		return false;
+	}
+	printf("total: %u archives, %u errors\n", narchive, errtotal);
+	return errtotal == 0;
+}
+
+// -----------------------------------------------------------------------
+
+static volatile DWORD idxsink; // keeps the timed lookups from being optimised away
+
+DWORD ZTreeTool::IdxRecursive (int lvl, int ilat, int ilng) const
+{
+	if (lvl <= 4) {
+		return (lvl == 1 ? tfh.rootPos1 : lvl == 2 ? tfh.rootPos2 : lvl == 3 ? tfh.rootPos3 : tfh.rootPos4[ilng]);
+	} else {
+		DWORD pidx = IdxRecursive(lvl-1, ilat/2, ilng/2);
+		if (pidx == (DWORD)-1) { return pidx; }
+		return toc[pidx].child[((ilat&1) << 1) + (ilng&1)];
+	}
+}
+
+// -----------------------------------------------------------------------
+
+bool ZTreeTool::IdxBench (const char *planetdir, int reps)
+{
+	const char *name[6] = { "Surf", "Mask", "Elev", "Elev_mod", "Label", "Cloud" };
+	const int maxlvl = 32;
+	DWORD narchive = 0, errtotal = 0;
+
+	for (int layer = ZTreeMgr::LAYER_SURF; layer <= ZTreeMgr::LAYER_CLOUD; layer++) {
+		ZTreeMgr *mgr = ZTreeMgr::CreateFromFile(planetdir, (ZTreeMgr::Layer)layer);
+		if (!mgr) continue;
+		narchive++;
+
+		// independent read of the same file for the reference descent
+		std::string fname = std::string(planetdir) + "/Archive/" + name[layer] + ".tree";
+		ZTreeTool tool;
+		if (!tool.Open(fname.c_str())) {
+			delete mgr;
+			errtotal++;
+			continue;
+		}
+
+		// query set: every reachable node, and the missing children of every
+		// node, which both lookups must report as absent
+		std::vector<NodePos> np, query;
+		tool.LocateNodes(np);
+		for (DWORD i = 0; i < np.size(); i++) {
+			if (!np[i].lvl) continue;
+			query.push_back(np[i]);
+			if (np[i].lvl < 4 || np[i].lvl >= maxlvl-1) continue;
+			for (DWORD c = 0; c < 4; c++) {
+				if (tool.toc[i].child[c] != (DWORD)-1) continue;
+				NodePos p = { np[i].lvl+1, np[i].ilat*2 + (c >> 1), np[i].ilng*2 + (c & 1) };
+				query.push_back(p);
+			}
+		}
+		std::sort(query.begin(), query.end(), [](const NodePos &a, const NodePos &b) {
+			return a.lvl != b.lvl ? a.lvl < b.lvl : a.ilat != b.ilat ? a.ilat < b.ilat : a.ilng < b.ilng;
+		});
+
+		// per-level agreement and timing
+		DWORD lquery[maxlvl] = { 0 }, nerr = 0;
+		double lsec[2][maxlvl] = { { 0 } };
+		DWORD sink = 0;
+		size_t q0 = 0;
+		while (q0 < query.size()) {
+			int l = query[q0].lvl;
+			size_t q1 = q0;
+			while (q1 < query.size() && query[q1].lvl == l) q1++;
+			for (size_t q = q0; q < q1; q++) {
+				DWORD idx = mgr->Idx(l, query[q].ilat, query[q].ilng);
+				DWORD ref = tool.IdxRecursive(l, query[q].ilat, query[q].ilng);
+				if (idx != ref && nerr++ < 10) {
+					LogErr("%s.tree level %d (%u,%u): Idx returns %d, descent %d", name[layer], l,
+						query[q].ilat, query[q].ilng, (int)idx, (int)ref);
+				}
+			}
+			for (int k = 0; k < 2; k++) {
+				auto t0 = std::chrono::high_resolution_clock::now();
+				for (int r = 0; r < reps; r++) {
+					for (size_t q = q0; q < q1; q++) {
+						sink += (k ? tool.IdxRecursive(l, query[q].ilat, query[q].ilng) : mgr->Idx(l, query[q].ilat, query[q].ilng));
+					}
+				}
+				lsec[k][l] += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+			}
+			lquery[l] += (DWORD)(q1 - q0);
+			q0 = q1;
+		}
+
+		idxsink = sink;
+		printf("%s.tree: %u nodes, %u lookups, %u errors\n", name[layer], tool.toc.size(), (DWORD)query.size(), nerr);
+		printf("  lvl   lookups   index [ns]  descent [ns]\n");
+		double sec[2] = { 0, 0 };
+		for (int l = 0; l < maxlvl; l++) {
+			if (!lquery[l]) continue;
+			double n = (double)lquery[l] * reps;
+			printf("  %3d %9u %12.1f %13.1f   %.1fx\n", l, lquery[l], lsec[0][l] / n * 1e9, lsec[1][l] / n * 1e9,
+				lsec[0][l] > 0 ? lsec[1][l] / lsec[0][l] : 0.0);
+			sec[0] += lsec[0][l];
+			sec[1] += lsec[1][l];
+		}
+		if (query.size()) {
+			double n = (double)query.size() * reps;
+			printf("  all %9u %12.1f %13.1f   %.1fx\n", (DWORD)query.size(), sec[0] / n * 1e9, sec[1] / n * 1e9,
+				sec[0] > 0 ? sec[1] / sec[0] : 0.0);
+		}
+
+		errtotal += nerr;
+		delete mgr;
+	}
+
+	if (!narchive) {
+		LogErr("No archives found in [%s/Archive]", planetdir);
+		return false;
+	}
+	return errtotal == 0;
+}
+
+// -----------------------------------------------------------------------
+// Elevation decode benchmark. The reference is the per-pass decode the
+// client used before ElevDecode: widening into an int16 grid, rescaling,
+// offset and float conversion as separate loops, and the masked merge of
+// the mod layer.
+
+static void ElevDecodeReference (const ElevDecodePrm *prm, const BYTE *p, int ndat, INT16 *e, float *elev)
+{
+	int i;
+	if (!prm->mask) {
+		switch (prm->dtype) {
+		case 0:
+			for (i = 0; i < ndat; i++) e[i] = 0;
+			break;
+		case 8: {
+			BYTE *tmp = new BYTE[ndat];
+			memcpy(tmp, p, ndat);
+			for (i = 0; i < ndat; i++)
+				e[i] = (INT16)tmp[i];
+			delete []tmp;
+			}
+			break;
+		case -16:
+			memcpy(e, p, ndat*sizeof(INT16));
+			break;
+		}
+		if (prm->rescale != 1.0) {
+			for (i = 0; i < ndat; i++)
+				e[i] = (INT16)(int)(e[i] * prm->rescale);
+		}
+		if (prm->offset) {
+			for (i = 0; i < ndat; i++)
+				e[i] += prm->offset;
+		}
+		for (i = 0; i < ndat; i++) elev[i] = float(e[i]) * prm->res;
+	} else {
+		bool do_rescale = (prm->rescale != 1.0), do_shift = (prm->offset != 0);
+		if (prm->dtype == 8) {
+			BYTE *tmp = new BYTE[ndat];
+			memcpy(tmp, p, ndat);
+			for (i = 0; i < ndat; i++) {
+				if (tmp[i] != 0xFF) {
+					e[i] = (INT16)(do_rescale ? (INT16)(int)(tmp[i] * prm->rescale) : (INT16)tmp[i]);
+					if (do_shift) e[i] += prm->offset;
+					elev[i] = float(e[i]) * prm->res;
+				}
+			}
+			delete []tmp;
+		} else if (prm->dtype == -16) {
+			INT16 *tmp = new INT16[ndat];
+			memcpy(tmp, p, ndat*sizeof(INT16));
+			for (i = 0; i < ndat; i++) {
+				if (tmp[i] != 0x7FFF) {
+					e[i] = (do_rescale ? (INT16)(int)(tmp[i] * prm->rescale) : tmp[i]);
+					if (do_shift) e[i] += prm->offset;
+					elev[i] = float(e[i]) * prm->res;
+				}
+			}
+			delete []tmp;
+		}
+	}
+}
+
+bool ZTreeTool::ElevBench (int reps)
+{
+	const int ndat = 259*259; // TILE_ELEVSTRIDE^2
+	struct Case {
+		const char *name;
+		int dtype;
+		double rescale;
+		INT16 offset;
+		bool mask;
+	} cases[] = {
+		{ "flat",          0,   2.0,  100, false },
+		{ "uint8",         8,   1.0,  100, false },
+		{ "uint8 x2",      8,   2.0,  100, false },
+		{ "uint8 x0.4",    8,   0.4,  100, false },
+		{ "int16",       -16,   1.0,  100, false },
+		{ "int16 x2",    -16,   2.0,  100, false },
+		{ "int16 x0.4",  -16,   0.4,  100, false },
+		{ "uint8 mod",     8,   1.0,   50, true  },
+		{ "int16 mod",   -16,   1.0,   50, true  },
+	};
+	typedef void (*DecodeFunc)(const ElevDecodePrm*, const void*, int, int16_t*, float*);
+	DecodeFunc func[3] = { (DecodeFunc)ElevDecodeReference, ElevDecodeScalar, ElevDecode };
+	const char *fname[3] = { "reference", "scalar", ElevDecodeKernel() };
+
+	std::vector<BYTE> payload(ndat*sizeof(INT16));
+	std::vector<INT16> base(ndat), e[3];
+	std::vector<float> basef(ndat), elev[3];
+	bool ok = true;
+
+	printf("%-10s %12s %12s %12s   %s\n", "payload", fname[0], fname[1], fname[2], "(us per 259x259 grid, best of reps)");
+	srand(1);
+	for (size_t c = 0; c < sizeof(cases)/sizeof(Case); c++) {
+		const Case &cs = cases[c];
+		ElevDecodePrm prm;
+		prm.dtype = cs.dtype;
+		prm.rescale = cs.rescale;
+		prm.offset = cs.offset;
+		prm.res = 0.5f;
+		prm.mask = cs.mask;
+
+		// terrain-like samples, a third of them masked out in the mod layers
+		for (int i = 0; i < ndat; i++) {
+			bool masked = cs.mask && (rand() % 3 == 0);
+			if (cs.dtype == 8) payload[i] = (BYTE)(masked ? 0xFF : rand() % 255);
+			else ((INT16*)&payload[0])[i] = (INT16)(masked ? 0x7FFF : rand() % 16384 - 2048);
+			base[i] = (INT16)(rand() % 1000);
+			basef[i] = float(base[i]) * prm.res;
+		}
+
+		double us[3];
+		for (int k = 0; k < 3; k++) {
+			e[k] = base;
+			elev[k] = basef;
+			func[k](&prm, &payload[0], ndat, &e[k][0], &elev[k][0]);
+			us[k] = 1e30;
+			for (int r = 0; r < reps; r++) {
+				if (cs.mask) { // the mod layer merges into the grid decoded before
+					memcpy(&e[k][0], &base[0], ndat*sizeof(INT16));
+					memcpy(&elev[k][0], &basef[0], ndat*sizeof(float));
+				}
+				auto t0 = std::chrono::high_resolution_clock::now();
+				func[k](&prm, &payload[0], ndat, &e[k][0], &elev[k][0]);
+				double t = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count();
+				if (t < us[k]) us[k] = t;
+			}
+			if (k && (memcmp(&e[k][0], &e[0][0], ndat*sizeof(INT16)) || memcmp(&elev[k][0], &elev[0][0], ndat*sizeof(float)))) {
+				LogErr("%s: %s decode differs from the reference", cs.name, fname[k]);
+				ok = false;
+			}
+		}
+		printf("%-10s %12.1f %12.1f %12.1f   %.1fx\n", cs.name, us[0], us[1], us[2], us[2] > 0 ? us[0]/us[2] : 0.0);
+	}
+
+	// Recovery of the int16 samples from the float grid, for the cubic interpolation of descendants
+	typedef void (*EncodeFunc)(const float*, int, float, int16_t*);
+	EncodeFunc efunc[2] = { ElevEncodeScalar, ElevEncode };
+	const float eres[] = { 0.1f, 0.5f, 1.0f, 2.0f };
+	const int nres = sizeof(eres)/sizeof(float);
+	for (int i = 0; i < ndat; i++) base[i] = (INT16)(rand() % 65536 - 32768);
+	double us[2] = { 0.0, 0.0 };
+	for (int r = 0; r < nres; r++) {
+		ElevDecodePrm prm = { -16, 1.0, 0, eres[r], false };
+		ElevDecode(&prm, &base[0], ndat, NULL, &basef[0]);
+		for (int k = 0; k < 2; k++) {
+			e[k].assign(ndat, 0);
+			auto t0 = std::chrono::high_resolution_clock::now();
+			for (int n = 0; n < reps; n++) efunc[k](&basef[0], ndat, eres[r], &e[k][0]);
+			us[k] += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - t0).count() / reps;
+			if (memcmp(&e[k][0], &base[0], ndat*sizeof(INT16))) {
+				LogErr("encode (res %g): %s samples not recovered", eres[r], k ? ElevDecodeKernel() : "scalar");
+				ok = false;
+			}
+		}
+	}
+	printf("%-10s %12s %12.1f %12.1f   %.1fx\n", "encode", "", us[0]/nres, us[1]/nres, us[1] > 0 ? us[0]/us[1] : 0.0);
+	return ok;
+}
+
+// =======================================================================
+
+static void Usage ()
+{
+	fputs(
+		"Usage: ZTreeTool repack <in.tree> <out.tree> [-codec zlib|lz4|zstd] [-level n]\n"
+		"       ZTreeTool reorder <in.tree> <out.tree> [-order dfs|morton]\n"
+		"       ZTreeTool scan <planet dir> [-threads n] [-positional]\n"
+		"       ZTreeTool stress <planet dir> [-threads n] [-reps n] [-positional]\n"
+		"       ZTreeTool idxbench <planet dir> [-reps n]\n"
+		"       ZTreeTool elevbench [-reps n]\n"
+		"\n"
+		"  repack: re-encode the node payloads of a tile archive. Archives using lz4\n"
+		"  or zstd can only be read by a D3D9Client built with ZTREE_LZ4/ZTREE_ZSTD,\n"
+		"  and never by the Orbiter core: keep Elev.tree and Elev_mod.tree in zlib,\n"
+		"  the core reads them for surface elevation queries.\n"
+		"\n"
+		"  reorder: renumber the nodes for read locality. dfs (default) stores the\n"
+		"  four children of a node as one block, followed depth-first by their\n"
+		"  subtrees. morton stores the tree level by level in Z-order.\n"
+		"\n"
+		"  scan: inflate all nodes of <planet dir>/Archive/*.tree, check them against\n"
+		"  the TOC and report throughput and compression per level. -positional uses\n"
+		"  file reads instead of memory-mapped views.\n"
+		"\n"
+		"  stress: read up to 4096 random nodes of each archive of <planet dir> once\n"
+		"  as the reference, then on -threads threads at once, -reps times the sample\n"
+		"  per thread, half of the reads from a hot set of 64 nodes. Runs with the\n"
+		"  node cache disabled and with a budget of half the sample, and reports\n"
+		"  payloads that differ from the reference.\n"
+		"\n"
+		"  idxbench: look up every node of <planet dir>/Archive/*.tree, and the\n"
+		"  missing children of every node, through the dense node index and through\n"
+		"  a recursive descent from the roots. Reports disagreements and the time per\n"
+		"  lookup of each, by level.\n"
+		"\n"
+		"  elevbench: decode synthetic elevation payloads (flat, uint8 and int16 at\n"
+		"  unit, integral and fractional scale, and the masked uint8/int16 mod layers)\n"
+		"  and compare the vectorised decode with the reference. Reports the best\n"
+		"  time of -reps decodes.\n", stderr);
+}
+
+// -----------------------------------------------------------------------
+
+static bool ParseCodec (const char *name, DWORD *codec)
+{
+	for (DWORD i = 0; i < ZTreeCodec::NTYPE; i++) {
+		if (!strcmp(name, ZTreeCodec::Name(i))) {
+			*codec = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// -----------------------------------------------------------------------
+
+int main (int argc, char *argv[])
+{
+	if (argc >= 2 && !strcmp(argv[1], "elevbench")) {
+		int reps = 1000;
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "-reps") && i+1 < argc) {
+				reps = atoi(argv[++i]);
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		return ZTreeTool::ElevBench(reps > 1 ? reps : 1) ? 0 : 1;
+	}
+
+	if (argc >= 3 && !strcmp(argv[1], "idxbench")) {
+		int reps = 10;
+		for (int i = 3; i < argc; i++) {
+			if (!strcmp(argv[i], "-reps") && i+1 < argc) {
+				reps = atoi(argv[++i]);
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		return ZTreeTool::IdxBench(argv[2], reps > 1 ? reps : 1) ? 0 : 1;
+	}
+
+	if (argc >= 3 && !strcmp(argv[1], "stress")) {
+		int nthread = (int)std::thread::hardware_concurrency();
+		int reps = 4;
+		for (int i = 3; i < argc; i++) {
+			if (!strcmp(argv[i], "-threads") && i+1 < argc) {
+				nthread = atoi(argv[++i]);
+			} else if (!strcmp(argv[i], "-reps") && i+1 < argc) {
+				reps = atoi(argv[++i]);
+			} else if (!strcmp(argv[i], "-positional")) {
+				ZTreeMgr::SetMapping(false);
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		return ZTreeTool::Stress(argv[2], nthread > 1 ? nthread : 1, reps > 1 ? reps : 1) ? 0 : 1;
+	}
+
+	if (argc >= 3 && !strcmp(argv[1], "scan")) {
+		int nthread = (int)std::thread::hardware_concurrency();
+		for (int i = 3; i < argc; i++) {
+			if (!strcmp(argv[i], "-threads") && i+1 < argc) {
+				nthread = atoi(argv[++i]);
+			} else if (!strcmp(argv[i], "-positional")) {
+				ZTreeMgr::SetMapping(false);
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		return ZTreeTool::Scan(argv[2], nthread > 1 ? nthread : 1) ? 0 : 1;
+	}
+
+	if (argc < 4) {
+		Usage();
+		return 1;
+	}
+
+	if (!strcmp(argv[1], "repack")) {
+		DWORD codec = ZTreeCodec::LZ4;
+		int level = -1;
+		for (int i = 4; i < argc; i++) {
+			if (!strcmp(argv[i], "-codec") && i+1 < argc) {
+				if (!ParseCodec(argv[++i], &codec)) {
+					LogErr("Unknown codec [%s]", argv[i]);
+					return 1;
+				}
+			} else if (!strcmp(argv[i], "-level") && i+1 < argc) {
+				level = atoi(argv[++i]);
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		ZTreeTool tool;
+		return tool.Open(argv[2]) && tool.Repack(argv[3], codec, level) ? 0 : 1;
+	}
+
+	if (!strcmp(argv[1], "reorder")) {
+		ZTreeTool::Order order = ZTreeTool::ORDER_DFS;
+		for (int i = 4; i < argc; i++) {
+			if (!strcmp(argv[i], "-order") && i+1 < argc) {
+				i++;
+				if      (!strcmp(argv[i], "dfs"))    order = ZTreeTool::ORDER_DFS;
+				else if (!strcmp(argv[i], "morton")) order = ZTreeTool::ORDER_MORTON;
+				else {
+					LogErr("Unknown order [%s]", argv[i]);
+					return 1;
+				}
+			} else {
+				Usage();
+				return 1;
+			}
+		}
+		ZTreeTool tool;
+		return tool.Open(argv[2]) && tool.Reorder(argv[3], order) ? 0 : 1;
+	}
+
+	Usage();
+	return 1;
+}
@@ -0,0 +1,2 @@
+// Case-sensitive file systems: Log.h includes <Windows.h>
+#include "windows.h"
@@ -0,0 +1,307 @@
+// ==============================================================
+//   ORBITER VISUALISATION PROJECT (OVP)
+//   D3D9 Client module
+//   Dual licensed under GPL v3 and LGPL v3
+// ==============================================================
+
+// --------------------------------------------------------------
+// compat/windows.h
+// Minimal Win32 subset on POSIX, just enough to build ZTreeMgr.cpp
+// and ZTreeTool on Linux. Not used on Windows.
+// --------------------------------------------------------------
+
+#ifndef __ZTREE_COMPAT_WINDOWS_H
+#define __ZTREE_COMPAT_WINDOWS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define __int64 long long
+
+typedef uint8_t  BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t  LONG;
+typedef int      BOOL;
+typedef uint32_t UINT;
+typedef uint64_t UINT64;
+typedef uint64_t ULONGLONG;
+typedef size_t   SIZE_T;
+typedef int16_t  INT16;
+typedef uint32_t ULONG;
+typedef uintptr_t ULONG_PTR;
+typedef void    *HANDLE;
+typedef void    *HMODULE;
+typedef void   (*FARPROC)();
+typedef const char *LPCSTR;
+
+typedef union {
+	struct { DWORD LowPart; LONG HighPart; };
+	long long QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	DWORD Offset;
+	DWORD OffsetHigh;
+} OVERLAPPED;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define WINAPI
+#define MAX_PATH               260
+#define INFINITE               0xFFFFFFFF
+#define WAIT_OBJECT_0          0
+#define WAIT_TIMEOUT           258
+#define INVALID_HANDLE_VALUE   ((HANDLE)(intptr_t)-1)
+#define GENERIC_READ           0x80000000
+#define FILE_SHARE_READ        0x00000001
+#define OPEN_EXISTING          3
+#define FILE_FLAG_RANDOM_ACCESS   0x10000000
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000
+#define PAGE_READONLY          0x02
+#define FILE_MAP_READ          0x0004
+
+#define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
+#define MAKEFOURCC(a,b,c,d) ((DWORD)(BYTE)(a) | ((DWORD)(BYTE)(b) << 8) | ((DWORD)(BYTE)(c) << 16) | ((DWORD)(BYTE)(d) << 24))
+
+#define sprintf_s(buf, n, ...)  snprintf(buf, n, __VA_ARGS__)
+#define lstrlen(s)              ((int)strlen(s))
+
+inline int strcpy_s (char *dst, size_t n, const char *src)
+{
+	snprintf(dst, n, "%s", src);
+	return 0;
+}
+
+// -----------------------------------------------------------------------
+// Files and file mappings
+
+struct CompatHandle {
+	enum Kind { FILEOBJ, MAPPING, THREAD, EVENT } kind;
+	int fd;       ///< file descriptor (files, mappings share the file's descriptor)
+	size_t size;  ///< file size (mappings)
+	std::thread thread;           ///< threads
+	std::mutex mtx;               ///< events
+	std::condition_variable cond; ///< events
+	bool signaled, manual;        ///< events
+
+	CompatHandle (Kind k, int _fd = -1, size_t _size = 0)
+		: kind(k), fd(_fd), size(_size), signaled(false), manual(false) {}
+};
+
+inline std::map<const void*, size_t> &CompatViews (std::mutex **mtx)
+{
+	static std::mutex m;
+	static std::map<const void*, size_t> views;
+	*mtx = &m;
+	return views;
+}
+
+inline HANDLE CreateFile (const char *name, DWORD, DWORD, void*, DWORD, DWORD, HANDLE)
+{
+	std::string path(name);
+	for (size_t i = 0; i < path.size(); i++) {
+		if (path[i] == '\\') path[i] = '/';
+	}
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return INVALID_HANDLE_VALUE;
+	return new CompatHandle(CompatHandle::FILEOBJ, fd);
+}
+
+inline BOOL ReadFile (HANDLE h, void *buf, DWORD nbuf, DWORD *nread, OVERLAPPED *ov)
+{
+	off_t ofs = ov ? (off_t)(((uint64_t)ov->OffsetHigh << 32) | ov->Offset) : lseek(((CompatHandle*)h)->fd, 0, SEEK_CUR);
+	ssize_t n = pread(((CompatHandle*)h)->fd, buf, nbuf, ofs);
+	if (n < 0) return FALSE;
+	*nread = (DWORD)n;
+	return TRUE;
+}
+
+inline BOOL GetFileSizeEx (HANDLE h, LARGE_INTEGER *size)
+{
+	struct stat st;
+	if (fstat(((CompatHandle*)h)->fd, &st)) return FALSE;
+	size->QuadPart = st.st_size;
+	return TRUE;
+}
+
+inline HANDLE CreateFileMapping (HANDLE h, void*, DWORD, DWORD, DWORD, const char*)
+{
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(h, &size) || !size.QuadPart) return NULL;
+	return new CompatHandle(CompatHandle::MAPPING, ((CompatHandle*)h)->fd, (size_t)size.QuadPart);
+}
+
+inline void *MapViewOfFile (HANDLE hMap, DWORD, DWORD, DWORD, SIZE_T)
+{
+	CompatHandle *m = (CompatHandle*)hMap;
+	void *view = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
+	if (view == MAP_FAILED) return NULL;
+	std::mutex *mtx;
+	std::map<const void*, size_t> &views = CompatViews(&mtx);
+	std::lock_guard<std::mutex> lock(*mtx);
+	views[view] = m->size;
+	return view;
+}
+
+inline BOOL UnmapViewOfFile (const void *view)
+{
+	std::mutex *mtx;
+	std::map<const void*, size_t> &views = CompatViews(&mtx);
+	std::lock_guard<std::mutex> lock(*mtx);
+	auto it = views.find(view);
+	if (it == views.end()) return FALSE;
+	munmap((void*)view, it->second);
+	views.erase(it);
+	return TRUE;
+}
+
+// -----------------------------------------------------------------------
+// Threads and events
+
+typedef DWORD (*LPTHREAD_START_ROUTINE)(void*);
+
+inline HANDLE CreateThread (void*, SIZE_T, LPTHREAD_START_ROUTINE proc, void *data, DWORD, DWORD *id)
+{
+	CompatHandle *h = new CompatHandle(CompatHandle::THREAD);
+	h->thread = std::thread(proc, data);
+	if (id) *id = 0;
+	return h;
+}
+
+inline HANDLE CreateEvent (void*, BOOL manual, BOOL initial, const char*)
+{
+	CompatHandle *h = new CompatHandle(CompatHandle::EVENT);
+	h->manual = manual != 0;
+	h->signaled = initial != 0;
+	return h;
+}
+
+inline BOOL SetEvent (HANDLE h)
+{
+	CompatHandle *ch = (CompatHandle*)h;
+	std::lock_guard<std::mutex> lock(ch->mtx);
+	ch->signaled = true;
+	if (ch->manual) ch->cond.notify_all();
+	else            ch->cond.notify_one();
+	return TRUE;
+}
+
+inline BOOL ResetEvent (HANDLE h)
+{
+	CompatHandle *ch = (CompatHandle*)h;
+	std::lock_guard<std::mutex> lock(ch->mtx);
+	ch->signaled = false;
+	return TRUE;
+}
+
+inline DWORD WaitForSingleObject (HANDLE h, DWORD ms)
+{
+	CompatHandle *ch = (CompatHandle*)h;
+	if (ch->kind == CompatHandle::THREAD) { // only infinite waits for threads
+		if (ch->thread.joinable()) ch->thread.join();
+		return WAIT_OBJECT_0;
+	}
+	std::unique_lock<std::mutex> lock(ch->mtx);
+	if (ms == INFINITE) {
+		ch->cond.wait(lock, [ch]() { return ch->signaled; });
+	} else if (!ch->cond.wait_for(lock, std::chrono::milliseconds(ms), [ch]() { return ch->signaled; })) {
+		return WAIT_TIMEOUT;
+	}
+	if (!ch->manual) ch->signaled = false;
+	return WAIT_OBJECT_0;
+}
+
+inline BOOL QueryPerformanceFrequency (LARGE_INTEGER *f)
+{
+	f->QuadPart = 1000000000LL;
+	return TRUE;
+}
+
+inline BOOL QueryPerformanceCounter (LARGE_INTEGER *t)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t->QuadPart = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	return TRUE;
+}
+
+inline void Sleep (DWORD ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline BOOL CloseHandle (HANDLE h)
+{
+	CompatHandle *ch = (CompatHandle*)h;
+	if (ch->kind == CompatHandle::FILEOBJ) close(ch->fd);
+	if (ch->kind == CompatHandle::THREAD && ch->thread.joinable()) ch->thread.detach();
+	delete ch;
+	return TRUE;
+}
+
+// -----------------------------------------------------------------------
+// Dynamically resolved API: PrefetchVirtualMemory maps to madvise(MADV_WILLNEED)
+
+struct CompatPrefetchRange {
+	void  *VirtualAddress;
+	SIZE_T NumberOfBytes;
+};
+
+inline BOOL CompatPrefetchVirtualMemory (HANDLE, ULONG_PTR n, CompatPrefetchRange *range, ULONG)
+{
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	for (ULONG_PTR i = 0; i < n; i++) {
+		uintptr_t a = (uintptr_t)range[i].VirtualAddress & ~(page-1);
+		madvise((void*)a, (uintptr_t)range[i].VirtualAddress + range[i].NumberOfBytes - a, MADV_WILLNEED);
+	}
+	return TRUE;
+}
+
+inline HANDLE  GetCurrentProcess () { return NULL; }
+inline HMODULE GetModuleHandleA (const char*) { return NULL; }
+
+inline FARPROC GetProcAddress (HMODULE, const char *name)
+{
+	if (!strcmp(name, "PrefetchVirtualMemory")) return (FARPROC)CompatPrefetchVirtualMemory;
+	return NULL;
+}
+
+// -----------------------------------------------------------------------
+// Synchronisation
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+inline void InitializeCriticalSection (CRITICAL_SECTION *cs)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE); // critical sections are reentrant
+	pthread_mutex_init(cs, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+inline void DeleteCriticalSection (CRITICAL_SECTION *cs) { pthread_mutex_destroy(cs); }
+inline void EnterCriticalSection (CRITICAL_SECTION *cs)  { pthread_mutex_lock(cs); }
+inline void LeaveCriticalSection (CRITICAL_SECTION *cs)  { pthread_mutex_unlock(cs); }
+
+inline LONG InterlockedIncrement (volatile LONG *v) { return __sync_add_and_fetch(v, 1); }
+inline LONG InterlockedDecrement (volatile LONG *v) { return __sync_sub_and_fetch(v, 1); }
+
+#endif // !__ZTREE_COMPAT_WINDOWS_H